@@ -14,368 +14,11586 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <list>
+#include <cstdint>
+#include <climits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#else
+#include <experimental/string_view>
+#endif
 #include <dirent.h>
 #include <sys/stat.h>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cctype>
+#include <cmath>
 #include <ctime>
+#include <cerrno>
+#include <csignal>
 #include <unistd.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <sys/utime.h>
+#include <io.h>
 #define PATH_SEP '\\'
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #define PATH_SEP '/'
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+// io_uring through raw syscalls; needs kernel headers and glibc's statx.
+// Build with -DFE_NO_IO_URING to keep every call synchronous.
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(STATX_BASIC_STATS) && \
+    defined(__has_include) && !defined(FE_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/sysmacros.h>
+#define FE_HAVE_IO_URING 1
+#endif
+#endif
+
+// zstd for pack/unpack is optional: build with -DFE_WITH_ZSTD and link -lzstd
+#ifdef FE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
 using namespace std;
+#if __cplusplus < 201703L
+using std::experimental::string_view;
+#endif
 
 /*-------------------------------------------------------------
-    Write each action performed by user to a log file
+    Binary activity log (activity_log.bin)
+    Append-only. Each block starts with a header and ends with a
+    trailer that points back at that header, so the file can be
+    walked from either end:
+      FileHeader
+      DATA block  - one Record per action (time, text offset and
+                    length) followed by a string table holding
+                    the text of those actions
+      TIDX block  - one IndexEntry (offset, time range) for each
+                    DATA block written since the previous TIDX
+    Each TIDX links back to the one before it, so 'history
+    --since' binary-searches the time index when it can and
+    only touches the blocks it prints. If a crash leaves a torn
+    block at the end, it is cut off the next time the log is
+    opened for writing.
 -------------------------------------------------------------*/
-void logAction(const string &action) {
-    ofstream log("activity_log.txt", ios::app);
-    if (!log) return;
+namespace log_format {
 
-    time_t now = time(NULL);
-    tm *t = localtime(&now);
+const char MAGIC[8] = { 'F', 'E', 'L', 'O', 'G', '0', '1', '\0' };
+const uint32_t VERSION = 1;
+const uint32_t DATA = 0x41544144;   // "DATA"
+const uint32_t TIDX = 0x58444954;   // "TIDX"
+const uint32_t END = 0x21444e45;    // "END!"
+const uint64_t NONE = ~0ULL;
 
-    char timeStr[64];
-    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", t);
+const size_t INDEX_EVERY = 64;              // DATA blocks per TIDX block
+const size_t BLOCK_RECORDS = 4096;          // records per block when rewriting
+const uint64_t ROTATE_BYTES = 64ULL << 20;  // live log size that triggers rotation
+const int ROTATE_KEEP = 4;                  // activity_log.1.bin ... .4.bin
 
-    log << "[" << timeStr << "] " << action << endl;
-    log.close();
+struct FileHeader { char magic[8]; uint32_t version, pad; };
+
+struct BlockHeader {
+    uint32_t magic, count;
+    int64_t first, last;    // time range covered, seconds since the epoch
+    uint64_t prevIndex;     // previous TIDX block, or NONE
+    uint64_t payload;       // bytes between header and trailer, 8-aligned
+};
+
+struct Record { int64_t time; uint32_t offset, length; };
+struct IndexEntry { uint64_t offset; int64_t first, last; };
+struct Trailer { uint64_t start; uint32_t magic, pad; };
+
+// One action to append; 'text' only has to live until append() returns
+struct Item { int64_t time; string_view text; };
+
+inline uint64_t blockBytes(const BlockHeader &h) {
+    return sizeof(BlockHeader) + h.payload + sizeof(Trailer);
 }
 
-/*-------------------------------------------------------------
-    Split input line into words
--------------------------------------------------------------*/
-vector<string> split(const string &line) {
-    stringstream ss(line);
-    string word;
-    vector<string> parts;
-    while (ss >> word)
-        parts.push_back(word);
-    return parts;
+// Rotated generations sit next to the live log: activity_log.N.bin
+inline string generation(const string &path, int n) {
+    if (n == 0) return path;
+    size_t dot = path.rfind('.');
+    return path.substr(0, dot) + "." + to_string(n) + path.substr(dot);
+}
+
+// activity_log.bin becomes .1.bin, .1 becomes .2 and the oldest is dropped
+inline void rotateGenerations(const string &path) {
+    remove(generation(path, ROTATE_KEEP).c_str());
+    for (int i = ROTATE_KEEP - 1; i >= 0; --i)
+        rename(generation(path, i).c_str(), generation(path, i + 1).c_str());
 }
 
+} // namespace log_format
+
 /*-------------------------------------------------------------
-    Check if path refers to a directory
+    Appends blocks to a binary log file
+    Only one thread uses an appender at a time: the logger's
+    drain, or a rewrite that owns its own temporary file.
 -------------------------------------------------------------*/
-bool isDirectory(const string &path) {
-    struct stat st;
-    if (stat(path.c_str(), &st) == 0)
-        return (st.st_mode & S_IFDIR);
-    return false;
-}
+class LogAppender {
+public:
+    LogAppender() {}
+    ~LogAppender() { close(); }
 
+    // Open or create the log and pick up the time index from its tail.
+    // A non-zero 'rotateAt' rotates the log once it reaches that size.
+    bool open(const string &file, uint64_t rotateAt = 0) {
+        using namespace log_format;
+        close();
+        path = file;
+        rotateBytes = rotateAt;
 
+        f = fopen(file.c_str(), "r+b");
+        if (!f) f = fopen(file.c_str(), "w+b");
+        if (!f) return false;
 
+        end = 0;
+        if (fseek(f, 0, SEEK_END) == 0) end = (uint64_t)tellPos();
 
+        FileHeader fh;
+        if (end >= sizeof(fh)) {
+            if (!readAt(0, &fh, sizeof(fh)) || memcmp(fh.magic, MAGIC, sizeof(MAGIC)) != 0) {
+                // Not a log we wrote; leave it alone
+                fclose(f);
+                f = NULL;
+                return false;
+            }
+        } else {
+            memset(&fh, 0, sizeof(fh));
+            memcpy(fh.magic, MAGIC, sizeof(MAGIC));
+            fh.version = VERSION;
+            end = 0;
+            if (!truncateTo(0) || !writeAt(0, &fh, sizeof(fh))) {
+                close();
+                return false;
+            }
+            end = sizeof(fh);
+        }
 
-/*-------------------------------------------------------------
-    List all files and folders in a directory
--------------------------------------------------------------*/
-void listFiles(const string &path = ".") {
-    DIR *dir = opendir(path.c_str());
-    if (!dir) {
-        perror("ls");
-        return;
+        recover();
+        return true;
     }
 
-    cout << "Contents of " << path << ":\n";
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        string name = entry->d_name;
-        if (name == "." || name == "..") continue;
+    bool isOpen() const { return f != NULL; }
+    uint64_t size() const { return end; }
 
-        string fullPath = path + PATH_SEP + name;
-        struct stat st;
-        if (stat(fullPath.c_str(), &st) == 0) {
-            if (isDirectory(fullPath))
-                cout << "[DIR]  ";
-            else
-                cout << "       ";
-            cout << name << "\t(" << st.st_size << " bytes)\n";
+    // Write one DATA block holding 'items', then a TIDX block every
+    // INDEX_EVERY data blocks
+    bool append(const log_format::Item *items, size_t n) {
+        using namespace log_format;
+        if (!f) return false;
+        if (n == 0) return true;
+
+        size_t strings = 0;
+        int64_t first = items[0].time, last = items[0].time;
+        for (size_t i = 0; i < n; ++i) {
+            strings += items[i].text.size();
+            first = min(first, items[i].time);
+            last = max(last, items[i].time);
+        }
+
+        BlockHeader h = { DATA, (uint32_t)n, first, last, lastIndex, 0 };
+        h.payload = (n * sizeof(Record) + strings + 7) & ~(uint64_t)7;
+        startBlock(h);
+
+        uint32_t offset = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Record r = { items[i].time, offset, (uint32_t)items[i].text.size() };
+            buf.append((const char *)&r, sizeof(r));
+            offset += r.length;
         }
+        for (size_t i = 0; i < n; ++i)
+            buf.append(items[i].text.data(), items[i].text.size());
+
+        uint64_t start = end;
+        if (!finishBlock(h)) return false;
+
+        IndexEntry e = { start, first, last };
+        unindexed.push_back(e);
+        if (unindexed.size() >= INDEX_EVERY && !writeIndex()) return false;
+        if (rotateBytes && end >= rotateBytes) return rotate();
+        return true;
     }
-    closedir(dir);
-    logAction("Listed contents of: " + path);
-}
 
-/*-------------------------------------------------------------
-    Change current working directory
--------------------------------------------------------------*/
-void changeDir(const string &path) {
-    if (chdir(path.c_str()) == 0) {
-        cout << "Changed directory to: " << path << endl;
-        logAction("Changed directory to: " + path);
-    } else {
-        perror("cd");
+    // Index the remaining DATA blocks and close the file
+    void close() {
+        if (!f) return;
+        writeIndex();
+        fclose(f);
+        f = NULL;
+        unindexed.clear();
     }
-}
 
+    // Move the live log to generation 1 and start an empty one
+    bool rotate() {
+        string file = path;
+        uint64_t limit = rotateBytes;
+        close();
+        log_format::rotateGenerations(file);
+        return open(file, limit);
+    }
 
+private:
+    FILE *f = NULL;
+    string path;
+    uint64_t end = 0;
+    uint64_t rotateBytes = 0;
+    uint64_t lastIndex = log_format::NONE;
+    vector<log_format::IndexEntry> unindexed;
+    string buf;
 
+    LogAppender(const LogAppender &) = delete;
+    LogAppender &operator=(const LogAppender &) = delete;
 
+    long long tellPos() {
+#ifdef _WIN32
+        return _ftelli64(f);
+#else
+        return (long long)ftello(f);
+#endif
+    }
 
-/*-------------------------------------------------------------
-    Print current working directory path
--------------------------------------------------------------*/
-void printPwd() {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)))
-        cout << cwd << endl;
-    else
-        perror("pwd");
+    bool seekTo(uint64_t at) {
+#ifdef _WIN32
+        return _fseeki64(f, (__int64)at, SEEK_SET) == 0;
+#else
+        return fseeko(f, (off_t)at, SEEK_SET) == 0;
+#endif
+    }
 
-    logAction("Checked current directory.");
-}
+    bool readAt(uint64_t at, void *p, size_t n) {
+        return seekTo(at) && fread(p, 1, n, f) == n;
+    }
 
-/*-------------------------------------------------------------
-    Copy a file from one location to another
--------------------------------------------------------------*/
-bool copyFile(const string &src, const string &dest) {
-    FILE *in = fopen(src.c_str(), "rb");
-    if (!in) return false;
+    bool writeAt(uint64_t at, const void *p, size_t n) {
+        return seekTo(at) && fwrite(p, 1, n, f) == n && fflush(f) == 0;
+    }
 
-    FILE *out = fopen(dest.c_str(), "wb");
-    if (!out) {
-        fclose(in);
-        return false;
+    bool truncateTo(uint64_t at) {
+        fflush(f);
+#ifdef _WIN32
+        return _chsize_s(_fileno(f), (__int64)at) == 0;
+#else
+        return ftruncate(fileno(f), (off_t)at) == 0;
+#endif
     }
 
-    char buffer[4096];
-    size_t n;
-    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
-        fwrite(buffer, 1, n, out);
+    void startBlock(const log_format::BlockHeader &h) {
+        buf.clear();
+        buf.reserve(log_format::blockBytes(h));
+        buf.append((const char *)&h, sizeof(h));
+    }
 
-    fclose(in);
-    fclose(out);
-    logAction("Copied file: " + src + " -> " + dest);
-    return true;
-}
+    // Pad the payload, add the trailer and write the block at the end
+    bool finishBlock(const log_format::BlockHeader &h) {
+        using namespace log_format;
+        buf.resize(sizeof(h) + h.payload, '\0');
+        Trailer t = { end, END, 0 };
+        buf.append((const char *)&t, sizeof(t));
 
-/*-------------------------------------------------------------
-    Delete a file or folder (recursively)
--------------------------------------------------------------*/
-void removeRecursive(const string &path) {
-    if (isDirectory(path)) {
-        DIR *dir = opendir(path.c_str());
-        if (!dir) return;
-        struct dirent *entry;
+        if (!writeAt(end, buf.data(), buf.size())) {
+            // Drop whatever part of the block made it to disk
+            truncateTo(end);
+            return false;
+        }
+        end += buf.size();
+        return true;
+    }
 
-        while ((entry = readdir(dir)) != NULL) {
-            string name = entry->d_name;
-            if (name == "." || name == "..") continue;
-            string subPath = path + PATH_SEP + name;
-            removeRecursive(subPath);
+    bool writeIndex() {
+        using namespace log_format;
+        if (unindexed.empty()) return true;
+
+        BlockHeader h = { TIDX, (uint32_t)unindexed.size(), unindexed.front().first,
+                          unindexed.front().last, lastIndex, 0 };
+        for (const IndexEntry &e : unindexed) {
+            h.first = min(h.first, e.first);
+            h.last = max(h.last, e.last);
         }
-        closedir(dir);
+        h.payload = unindexed.size() * sizeof(IndexEntry);
+        startBlock(h);
+        buf.append((const char *)unindexed.data(), h.payload);
 
-#ifdef _WIN32
-        _rmdir(path.c_str());
-#else
-        rmdir(path.c_str());
-#endif
-    } else {
-        remove(path.c_str());
+        uint64_t start = end;
+        if (!finishBlock(h)) return false;
+        lastIndex = start;
+        unindexed.clear();
+        return true;
+    }
+
+    // The block that ends at 'at', if its trailer and header agree
+    bool blockBefore(uint64_t at, log_format::BlockHeader &h, uint64_t &start) {
+        using namespace log_format;
+        Trailer t;
+        if (at < sizeof(FileHeader) + sizeof(BlockHeader) + sizeof(t) ||
+            !readAt(at - sizeof(t), &t, sizeof(t)) || t.magic != END ||
+            t.start < sizeof(FileHeader) || t.start >= at)
+            return false;
+        if (!readAt(t.start, &h, sizeof(h)) || (h.magic != DATA && h.magic != TIDX) ||
+            t.start + blockBytes(h) != at)
+            return false;
+        start = t.start;
+        return true;
     }
-    logAction("Removed: " + path);
-}
+
+    // Walk back from the end to the newest TIDX block; the DATA blocks
+    // after it still need indexing. A bad trailer means a torn write,
+    // so scan from the front and cut the file after the last good block.
+    void recover() {
+        using namespace log_format;
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            lastIndex = NONE;
+            unindexed.clear();
+
+            uint64_t at = end;
+            bool intact = true;
+            while (at > sizeof(FileHeader)) {
+                BlockHeader h;
+                uint64_t start;
+                if (!blockBefore(at, h, start)) {
+                    intact = false;
+                    break;
+                }
+                if (h.magic == TIDX) {
+                    lastIndex = start;
+                    break;
+                }
+                IndexEntry e = { start, h.first, h.last };
+                unindexed.push_back(e);
+                at = start;
+            }
+            if (intact) {
+                reverse(unindexed.begin(), unindexed.end());
+                return;
+            }
+
+            uint64_t good = sizeof(FileHeader);
+            for (;;) {
+                BlockHeader h, back;
+                uint64_t start;
+                if (!readAt(good, &h, sizeof(h)) || (h.magic != DATA && h.magic != TIDX) ||
+                    good + blockBytes(h) > end || !blockBefore(good + blockBytes(h), back, start))
+                    break;
+                good += blockBytes(h);
+            }
+            truncateTo(good);
+            end = good;
+        }
+        unindexed.clear();
+    }
+};
 
 /*-------------------------------------------------------------
-    Search for a file by name (recursive)
+    Buffered activity logger
+    Keeps activity_log.bin open for the whole session and queues
+    timestamped records in a fixed ring buffer. A background thread
+    drains the ring once a second (or as soon as it is half full)
+    into one DATA block, so hot paths such as rm/search only pay
+    for a lock and a copy.
 -------------------------------------------------------------*/
-void searchFile(const string &pattern, const string &path = ".") {
-    DIR *dir = opendir(path.c_str());
-    if (!dir) return;
+class ActivityLogger {
+public:
+    static ActivityLogger &instance() {
+        static ActivityLogger logger;
+        return logger;
+    }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        string name = entry->d_name;
-        if (name == "." || name == "..") continue;
+    void log(const string &action) {
+        if (paused) return;
+        unique_lock<mutex> lock(mtx);
+        if (stopped) return;
+        if (count == ring.size()) {
+            // Ring is full: drain it on this thread rather than drop records
+            drainLocked(lock);
+        }
 
-        string fullPath = path + PATH_SEP + name;
+        Entry &slot = ring[(head + count) % ring.size()];
+        slot.time = (int64_t)time(NULL);
+        slot.text.assign(action);
+        ++count;
 
-        if (name.find(pattern) != string::npos)
-            cout << fullPath << endl;
+        if (count >= ring.size() / 2)
+            wake.notify_one();
+    }
 
-        if (isDirectory(fullPath))
-            searchFile(pattern, fullPath);
+    // Write every queued record out to disk
+    void flush() {
+        unique_lock<mutex> lock(mtx);
+        drainLocked(lock);
     }
-    closedir(dir);
-    logAction("Searched for: " + pattern + " in " + path);
-}
 
+    // Drop records while set (the benchmark runs commands thousands of times)
+    void pause(bool on) { paused = on; }
+
+    // Absolute path of the log, fixed at startup so 'cd' doesn't move it
+    const string &path() const { return logPath; }
+
+    // Run 'fn' with every queued record on disk and the log closed, so
+    // it can rotate or rewrite the files; logging resumes afterwards
+    void exclusive(const function<void()> &fn) {
+        unique_lock<mutex> lock(mtx);
+        drainLocked(lock);
+        writer.close();
+        fn();
+        if (!stopped) writer.open(logPath, log_format::ROTATE_BYTES);
+    }
+
+    // Flush and stop the background thread (called on exit)
+    void shutdown() {
+        {
+            unique_lock<mutex> lock(mtx);
+            if (stopped) return;
+            stopped = true;
+            drainLocked(lock);
+        }
+        wake.notify_one();
+        if (flusher.joinable()) flusher.join();
+        writer.close();
+    }
+
+private:
+    static const size_t RING_SIZE = 4096;
+
+    struct Entry {
+        int64_t time;
+        string text;
+    };
+
+    vector<Entry> ring;
+    size_t head = 0, count = 0;
+    bool stopped = false;
+    bool draining = false;
+    atomic<bool> paused{false};
+    LogAppender writer;
+    string logPath;
+    vector<Entry> pending;
+    vector<log_format::Item> items;
+
+    mutex mtx;
+    condition_variable wake, drained;
+    thread flusher;
+
+    ActivityLogger() : ring(RING_SIZE) {
+        char cwd[1024];
+        logPath = getcwd(cwd, sizeof(cwd)) ? string(cwd) + PATH_SEP : string();
+        logPath += "activity_log.bin";
+
+        writer.open(logPath, log_format::ROTATE_BYTES);
+        flusher = thread(&ActivityLogger::run, this);
+    }
+
+    ~ActivityLogger() { shutdown(); }
+
+    // Move queued records into 'pending' and write them without holding the lock
+    void drainLocked(unique_lock<mutex> &lock) {
+        while (draining) drained.wait(lock);
+        if (count == 0) return;
+
+        draining = true;
+        // Swap the strings out so both buffers keep their capacity
+        pending.resize(count);
+        items.clear();
+        for (size_t i = 0; count > 0; --count, ++i) {
+            pending[i].time = ring[head].time;
+            pending[i].text.swap(ring[head].text);
+            log_format::Item item = { pending[i].time, pending[i].text };
+            items.push_back(item);
+            head = (head + 1) % ring.size();
+        }
+
+        lock.unlock();
+        writer.append(items.data(), items.size());
+        lock.lock();
 
+        draining = false;
+        drained.notify_all();
+    }
 
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        while (!stopped) {
+            wake.wait_for(lock, chrono::seconds(1));
+            drainLocked(lock);
+        }
+    }
+};
 
 /*-------------------------------------------------------------
-    Create an empty file (similar to Linux 'touch')
+    Write each action performed by user to a log file
 -------------------------------------------------------------*/
-void touchFile(const string &path) {
-    FILE *f = fopen(path.c_str(), "ab");
-    if (f) {
-        fclose(f);
-        cout << "File created/updated: " << path << endl;
-        logAction("Created or updated file: " + path);
-    } else {
-        perror("touch");
-    }
+void logAction(const string &action) {
+    ActivityLogger::instance().log(action);
 }
 
-
 /*-------------------------------------------------------------
-    Create a new folder
+    Flush the activity log before the process dies on a signal
 -------------------------------------------------------------*/
-void makeDir(const string &path) {
 #ifdef _WIN32
-    if (CreateDirectoryA(path.c_str(), NULL))
-        cout << "Directory created: " << path << endl;
-    else
-        perror("mkdir");
-#else
-    if (mkdir(path.c_str(), 0755) == 0)
-        cout << "Directory created: " << path << endl;
-    else
-        perror("mkdir");
-#endif
-    logAction("Created directory: " + path);
+BOOL WINAPI consoleCtrlHandler(DWORD) {
+    // Runs on its own thread, so taking the logger lock is safe here
+    ActivityLogger::instance().shutdown();
+    return FALSE;
 }
 
+void installLogFlushHandlers() {
+    SetConsoleCtrlHandler(consoleCtrlHandler, TRUE);
+}
+#else
+void installLogFlushHandlers() {
+    // Block the signals everywhere and take them on a dedicated thread,
+    // which can then lock and flush the logger like any other caller.
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    thread([] {
+        int sig = 0;
+        sigwait(&set, &sig);
+        ActivityLogger::instance().shutdown();
+
+        signal(sig, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        raise(sig);
+    }).detach();
+}
+#endif
 
 /*-------------------------------------------------------------
-    Move or rename a file
+    Hot-path instrumentation
+    Every thread owns a block of counters (syscalls issued, bytes
+    moved, entries visited) and per-phase nanosecond totals. Only
+    the owner writes its block, so an update is a relaxed load and
+    store with no lock and no shared cache line; 'stats' sums all
+    blocks. Blocks of exited threads are reused, so totals survive.
+    With --trace the phase scopes and commands are also recorded
+    per thread and written as Chrome trace JSON at exit.
 -------------------------------------------------------------*/
-void moveFile(const string &src, const string &dest) {
-    if (rename(src.c_str(), dest.c_str()) == 0) {
-        cout << "Moved: " << src << " -> " << dest << endl;
-        logAction("Moved/Renamed: " + src + " -> " + dest);
-    } else {
-        perror("mv");
+namespace perf {
+
+enum Counter {
+    DIR_OPENS, DIR_READS, STATS, OPENS, READS, WRITES, COPY_CALLS, UNLINKS,
+    BYTES_READ, BYTES_WRITTEN, BYTES_OUT, ENTRIES, MATCHES, FILES, COUNTER_COUNT
+};
+
+enum Phase { PH_READDIR, PH_STAT, PH_MATCH, PH_COPY, PH_REMOVE, PH_OUTPUT, PHASE_COUNT };
+
+const char *const counterNames[COUNTER_COUNT] = {
+    "dir opens", "dir reads", "stat", "open", "read", "write", "copy calls", "unlink",
+    "bytes read", "bytes written", "console bytes", "entries", "matches", "files done"
+};
+
+const char *const phaseNames[PHASE_COUNT] = {
+    "readdir", "stat", "match", "copy", "remove", "output"
+};
+
+const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+inline long long nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+}
+
+struct TraceEvent {
+    const char *name;
+    string detail;
+    long long startNs, durNs;
+};
+
+struct Block {
+    atomic<uint64_t> counts[COUNTER_COUNT];
+    atomic<uint64_t> phaseNs[PHASE_COUNT];
+    int tid = 0;
+    mutex traceMtx;         // uncontended: only taken by the owner and the final writer
+    vector<TraceEvent> events;
+
+    Block() {
+        for (auto &c : counts) c.store(0, memory_order_relaxed);
+        for (auto &p : phaseNs) p.store(0, memory_order_relaxed);
     }
+};
+
+// Only the owning thread writes a counter, so no read-modify-write is needed
+inline void bump(atomic<uint64_t> &c, uint64_t n) {
+    c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
 }
 
+struct Snapshot {
+    uint64_t counts[COUNTER_COUNT] = {};
+    uint64_t phaseNs[PHASE_COUNT] = {};
 
-/*-------------------------------------------------------------
-    Show all previously logged activities
--------------------------------------------------------------*/
-void showHistory() {
-    ifstream log("activity_log.txt");
-    if (!log) {
-        cout << "No activity history found yet.\n";
-        return;
+    Snapshot operator-(const Snapshot &o) const {
+        Snapshot d;
+        for (int i = 0; i < COUNTER_COUNT; ++i) d.counts[i] = counts[i] - o.counts[i];
+        for (int i = 0; i < PHASE_COUNT; ++i) d.phaseNs[i] = phaseNs[i] - o.phaseNs[i];
+        return d;
     }
+};
 
-    cout << "----------- ACTIVITY LOG -----------\n";
-    string line;
-    while (getline(log, line))
-        cout << line << endl;
-    cout << "------------------------------------\n";
-    log.close();
+class Registry {
+public:
+    static Registry &instance() {
+        static Registry *r = new Registry();    // pool threads may still exit after main
+        return *r;
+    }
+
+    Block *acquire() {
+        lock_guard<mutex> lock(mtx);
+        for (Slot &s : slots)
+            if (!s.inUse) {
+                s.inUse = true;
+                return s.block.get();
+            }
+        slots.push_back(Slot{ unique_ptr<Block>(new Block()), true });
+        slots.back().block->tid = (int)slots.size();
+        return slots.back().block.get();
+    }
+
+    void release(Block *b) {
+        lock_guard<mutex> lock(mtx);
+        for (Slot &s : slots)
+            if (s.block.get() == b) s.inUse = false;
+    }
+
+    Snapshot total() {
+        Snapshot t;
+        lock_guard<mutex> lock(mtx);
+        for (const Slot &s : slots) {
+            for (int i = 0; i < COUNTER_COUNT; ++i)
+                t.counts[i] += s.block->counts[i].load(memory_order_relaxed);
+            for (int i = 0; i < PHASE_COUNT; ++i)
+                t.phaseNs[i] += s.block->phaseNs[i].load(memory_order_relaxed);
+        }
+        return t;
+    }
+
+    template <class Fn>
+    void forEach(Fn fn) {
+        lock_guard<mutex> lock(mtx);
+        for (Slot &s : slots) fn(*s.block);
+    }
+
+private:
+    struct Slot {
+        unique_ptr<Block> block;
+        bool inUse;
+    };
+    mutex mtx;
+    deque<Slot> slots;
+};
+
+inline Block &local() {
+    struct Holder {
+        Block *block = Registry::instance().acquire();
+        ~Holder() { Registry::instance().release(block); }
+    };
+    static thread_local Holder holder;
+    return *holder.block;
 }
 
-/*-------------------------------------------------------------
-    Display list of available commands
--------------------------------------------------------------*/
-void showHelp() {
-    cout << "\nAvailable Commands:\n";
-    cout << "  ls [path]        - List files and folders\n";
-    cout << "  cd <dir>         - Change directory\n";
-    cout << "  pwd              - Print current directory\n";
-    cout << "  cp <src> <dest>  - Copy file\n";
-    cout << "  mv <src> <dest>  - Move or rename file\n";
-    cout << "  rm <path>        - Delete file/folder\n";
-    cout << "  touch <file>     - Create empty file\n";
-    cout << "  mkdir <dir>      - Create new folder\n";
-    cout << "  search <name>    - Search file by name\n";
-    cout << "  history          - Show activity log\n";
-    cout << "  help             - Show help menu\n";
-    cout << "  exit             - Exit explorer\n\n";
+inline void count(Counter c, uint64_t n = 1) { bump(local().counts[c], n); }
+
+atomic<bool> tracing{false};
+
+inline void traceEvent(const char *name, const string &detail, long long startNs, long long durNs) {
+    Block &b = local();
+    lock_guard<mutex> lock(b.traceMtx);
+    b.events.push_back(TraceEvent{ name, detail, startNs, durNs });
+}
+
+// Adds the time until the end of the enclosing block to a phase
+class Scope {
+public:
+    explicit Scope(Phase p) : phase(p), start(nowNs()) {}
+    ~Scope() {
+        long long dur = nowNs() - start;
+        bump(local().phaseNs[phase], (uint64_t)dur);
+        if (tracing.load(memory_order_relaxed)) traceEvent(phaseNames[phase], string(), start, dur);
+    }
+
+private:
+    Phase phase;
+    long long start;
+};
+
+string jsonEscape(const string &s) {
+    string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// Write every recorded event as a Chrome trace (chrome://tracing, Perfetto)
+bool writeTrace(const string &path) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) return false;
+    fputs("{\"traceEvents\": [\n", f);
+    bool first = true;
+    long pid = (long)getpid();
+    Registry::instance().forEach([&](Block &b) {
+        lock_guard<mutex> lock(b.traceMtx);
+        for (const TraceEvent &e : b.events) {
+            string name = e.detail.empty() ? e.name : jsonEscape(e.detail);
+            fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                       "\"dur\": %.3f, \"pid\": %ld, \"tid\": %d}",
+                    first ? "" : ",\n", name.c_str(), e.name, e.startNs / 1000.0,
+                    e.durNs / 1000.0, pid, b.tid);
+            first = false;
+        }
+    });
+    fputs("\n]}\n", f);
+    return fclose(f) == 0;
 }
 
+} // namespace perf
 
 /*-------------------------------------------------------------
-    MAIN PROGRAM
+    Console output routing
+    cout and cerr are pointed at a router each at startup. A
+    thread can capture what it prints into a sink of its own
+    (background jobs and server sessions do), and pool tasks
+    print into the sink of whoever submitted them. In batch mode
+    all other standard output is held and written out at the
+    end, in 4 MiB chunks at most; interactively it goes straight
+    through.
 -------------------------------------------------------------*/
-int main() {
-    cout << "---------------------------------------------\n";
-    cout << "   SIMPLE CONSOLE FILE EXPLORER (C++ / GCC6)\n";
-    cout << "---------------------------------------------\n";
-    cout << "Type 'help' to see available commands.\n\n";
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    // 'stream' is 0 for cout, 1 for cerr; may be called from several threads
+    virtual void write(int stream, const char *s, size_t n) = 0;
+};
 
-    string line;
-    while (true) {
-        char cwd[1024];
-        getcwd(cwd, sizeof(cwd));
-        cout << cwd << " $ ";
+class OutputRouter : public streambuf {
+public:
+    static OutputRouter &instance() {
+        static OutputRouter *router = new OutputRouter(0);  // outlives cout's final flush
+        return *router;
+    }
 
-        if (!getline(cin, line)) break;
-        vector<string> args = split(line);
-        if (args.empty()) continue;
+    static OutputRouter &errors() {
+        static OutputRouter *router = new OutputRouter(1);
+        return *router;
+    }
 
-        string cmd = args[0];
+    void install(bool holdOutput) {
+        held = holdOutput;
+        os = stream ? &cerr : &cout;
+        target = os->rdbuf(this);
+    }
 
-        if (cmd == "exit" || cmd == "quit")
-            break;
-        else if (cmd == "help")
-            showHelp();
-        else if (cmd == "ls")
-            listFiles(args.size() > 1 ? args[1] : ".");
-        else if (cmd == "cd") {
-            if (args.size() > 1) changeDir(args[1]);
-            else cout << "Usage: cd <dir>\n";
-        }
-        else if (cmd == "pwd")
-            printPwd();
-        else if (cmd == "cp") {
-            if (args.size() > 2) {
-                if (copyFile(args[1], args[2]))
-                    cout << "Copied: " << args[1] << " -> " << args[2] << endl;
-                else
-                    perror("cp");
-            } else cout << "Usage: cp <src> <dest>\n";
+    // Write out held output and hand the stream its own buffer back
+    void finish() {
+        if (!target) return;
+        {
+            lock_guard<mutex> lock(mtx);
+            drainLocked();
         }
-        else if (cmd == "mv") {
-            if (args.size() > 2)
-                moveFile(args[1], args[2]);
-            else
-                cout << "Usage: mv <src> <dest>\n";
+        os->rdbuf(target);
+        target->pubsync();
+        target = NULL;
+    }
+
+    // Discard all uncaptured output while set
+    void mute(bool on) { muted = on; }
+
+    // Write as if nothing were captured (sinks pass output on with this)
+    void emit(const char *s, size_t n) {
+        if (muted) return;
+        lock_guard<mutex> lock(mtx);
+        if (!target) {
+            fwrite(s, 1, n, stream ? stderr : stdout);
+            return;
         }
-        else if (cmd == "rm") {
-            if (args.size() > 1)
-                removeRecursive(args[1]);
-            else
-                cout << "Usage: rm <path>\n";
+        if (!held) {
+            target->sputn(s, (streamsize)n);
+            return;
         }
-        else if (cmd == "touch") {
-            if (args.size() > 1)
-                touchFile(args[1]);
+        pending.append(s, n);
+        if (pending.size() >= HOLD_LIMIT) drainLocked();
+    }
+
+    // Write standard output into 'sink', or the usual way when it is NULL
+    static void send(OutputSink *sink, const char *s, size_t n) {
+        perf::count(perf::BYTES_OUT, (uint64_t)n);
+        if (sink) sink->write(0, s, n);
+        else instance().emit(s, n);
+    }
+
+    // Route this thread's output into 'sink' (NULL to stop)
+    static void capture(OutputSink *sink) { captured() = sink; }
+    static OutputSink *capturing() { return captured(); }
+
+protected:
+    streamsize xsputn(const char *s, streamsize n) override {
+        if (stream == 0) perf::count(perf::BYTES_OUT, (uint64_t)n);
+        if (OutputSink *c = captured()) {
+            c->write(stream, s, (size_t)n);
+            return n;
+        }
+        emit(s, (size_t)n);
+        return n;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    int sync() override {
+        if (captured()) return 0;
+        lock_guard<mutex> lock(mtx);
+        return held ? 0 : target->pubsync();
+    }
+
+private:
+    static const size_t HOLD_LIMIT = 4 << 20;
+
+    explicit OutputRouter(int s) : stream(s) {}
+
+    int stream;
+    ostream *os = NULL;
+    streambuf *target = NULL;
+    bool held = false;
+    atomic<bool> muted{false};
+    string pending;
+    mutex mtx;
+
+    static OutputSink *&captured() {
+        static thread_local OutputSink *s = NULL;
+        return s;
+    }
+
+    void drainLocked() {
+        if (pending.empty()) return;
+        target->sputn(pending.data(), (streamsize)pending.size());
+        pending.clear();
+    }
+};
+
+// Collects standard output in a string; errors go on to 'parent', or
+// wherever they would have gone without a capture
+class StringSink : public OutputSink {
+public:
+    explicit StringSink(OutputSink *up = NULL) : parent(up) {}
+
+    void write(int stream, const char *s, size_t n) override {
+        if (stream != 0) {
+            if (parent) parent->write(stream, s, n);
+            else OutputRouter::errors().emit(s, n);
+            return;
+        }
+        lock_guard<mutex> lock(mtx);
+        text.append(s, n);
+    }
+
+    string take() {
+        lock_guard<mutex> lock(mtx);
+        string out;
+        out.swap(text);
+        return out;
+    }
+
+private:
+    OutputSink *parent;
+    mutex mtx;
+    string text;
+};
+
+/*-------------------------------------------------------------
+    perror() through cerr, so that a captured thread's errors
+    reach its sink (a server session's client) like the rest
+-------------------------------------------------------------*/
+void printError(const char *what) {
+    int err = errno;
+    cerr << what << ": " << strerror(err) << endl;
+    errno = err;
+}
+
+/*-------------------------------------------------------------
+    Result output for parallel commands
+    Workers build each block of output (a directory's hits, one
+    file's matching lines) in a buffer of their own and hand the
+    whole block over; a single writer thread per command writes
+    them out in large pieces, so workers never wait on a console
+    lock and nothing flushes per line.
+    Unordered, blocks go onto a lock-free MPSC list (a push is
+    one CAS; the writer takes the whole list at once) and come
+    out in completion order. Ordered, every block has a slot in a
+    tree that mirrors the traversal: a slot's own text comes
+    first, then its children's in the order they were reserved.
+    The writer follows the tree depth-first and waits at a slot
+    that is not closed yet, so the output is the same as a
+    sequential walk's no matter which worker finishes first.
+    Only the thread that reserved a slot puts into it, reserves
+    children under it and closes it, exactly once.
+-------------------------------------------------------------*/
+class ResultSlot {
+private:
+    friend class ResultWriter;
+    string text;
+    vector<ResultSlot *> kids;
+    atomic<bool> closed{false};
+};
+
+class ResultWriter {
+public:
+    explicit ResultWriter(bool inOrder)
+        : ordered(inOrder), sink(OutputRouter::capturing()) {
+        if (ordered) top = new ResultSlot;
+        writer = thread([this] { run(); });
+    }
+    ~ResultWriter() { finish(); }
+
+    ResultWriter(const ResultWriter &) = delete;
+    ResultWriter &operator=(const ResultWriter &) = delete;
+
+    bool inOrder() const { return ordered; }
+
+    // The slot everything else hangs off (NULL when unordered)
+    ResultSlot *root() { return top; }
+
+    // Reserve the next place under 'parent' (NULL when unordered)
+    ResultSlot *child(ResultSlot *parent) {
+        if (!parent) return NULL;
+        ResultSlot *s = new ResultSlot;
+        parent->kids.push_back(s);
+        return s;
+    }
+
+    // Hand over 'text' (left empty); in order it joins the slot's text
+    void put(ResultSlot *slot, string &text) {
+        if (text.empty()) return;
+        if (slot) {
+            if (slot->text.empty()) slot->text.swap(text);
+            else slot->text += text;
+            text.clear();
+            return;
+        }
+        Chunk *c = new Chunk;
+        c->text.swap(text);
+        c->next = head.load(memory_order_relaxed);
+        while (!head.compare_exchange_weak(c->next, c)) {
+        }
+        wake();
+    }
+
+    // No more text or children for 'slot'
+    void close(ResultSlot *slot) {
+        if (!slot) return;
+        slot->closed = true;
+        wake();
+    }
+
+    void finish(ResultSlot *slot, string &text) {
+        put(slot, text);
+        close(slot);
+    }
+
+    // Write out everything; every slot must be closed by now
+    void finish() {
+        if (!writer.joinable()) return;
+        if (top) close(top);
+        stopping = true;
+        wake();
+        writer.join();
+    }
+
+private:
+    struct Chunk {
+        string text;
+        Chunk *next;
+    };
+
+    static const size_t WRITE_CHUNK = 1 << 20;
+
+    bool ordered;
+    OutputSink *sink;           // the command's console, for the writer thread
+    ResultSlot *top = NULL;
+    atomic<Chunk *> head{nullptr};
+    atomic<bool> stopping{false};
+    atomic<bool> sleeping{false};
+    mutex mtx;
+    condition_variable cv;
+    thread writer;
+    string out;
+
+    void wake() {
+        if (!sleeping.load()) return;
+        lock_guard<mutex> lock(mtx);
+        cv.notify_one();
+    }
+
+    void emit(string &text) {
+        if (out.empty() && text.size() >= WRITE_CHUNK) {
+            OutputRouter::send(sink, text.data(), text.size());
+        } else {
+            out += text;
+            if (out.size() >= WRITE_CHUNK) flushOut();
+        }
+        string().swap(text);
+    }
+
+    void flushOut() {
+        if (out.empty()) return;
+        perf::Scope timing(perf::PH_OUTPUT);
+        OutputRouter::send(sink, out.data(), out.size());
+        out.clear();
+    }
+
+    // Write what is ready; false when the writer has to wait
+    bool drainList() {
+        Chunk *c = head.exchange(nullptr, memory_order_acquire);
+        if (!c) return false;
+        Chunk *prev = NULL;             // LIFO to completion order
+        while (c) {
+            Chunk *next = c->next;
+            c->next = prev;
+            prev = c;
+            c = next;
+        }
+        while (prev) {
+            Chunk *next = prev->next;
+            emit(prev->text);
+            delete prev;
+            prev = next;
+        }
+        return true;
+    }
+
+    struct Cursor {
+        ResultSlot *slot;
+        size_t next;
+    };
+    vector<Cursor> path;
+
+    bool drainTree() {
+        bool progress = false;
+        while (!path.empty()) {
+            Cursor &c = path.back();
+            if (c.next == 0 && !c.slot->closed.load(memory_order_acquire)) break;
+            if (c.next == 0) emit(c.slot->text);
+            if (c.next < c.slot->kids.size()) {
+                ResultSlot *kid = c.slot->kids[c.next++];
+                path.push_back(Cursor{ kid, 0 });
+            } else {
+                delete c.slot;
+                path.pop_back();
+            }
+            progress = true;
+        }
+        return progress;
+    }
+
+    void run() {
+        if (ordered) path.push_back(Cursor{ top, 0 });
+        while (true) {
+            bool progress = ordered ? drainTree() : drainList();
+            bool done = ordered ? path.empty() : stopping.load() && !head.load();
+            if (done) break;
+            if (progress) continue;
+
+            flushOut();
+            unique_lock<mutex> lock(mtx);
+            sleeping = true;
+            bool ready = ordered ? path.back().slot->closed.load()
+                                 : head.load() != nullptr || stopping.load();
+            if (!ready) cv.wait_for(lock, chrono::milliseconds(50));
+            sleeping = false;
+        }
+        flushOut();
+        top = NULL;
+    }
+};
+
+// "64K", "1.5M", "2G" -> bytes (1024-based); false if there is no number
+bool parseScaled(const string &s, double &out) {
+    char *end;
+    double n = strtod(s.c_str(), &end);
+    if (end == s.c_str() || n < 0) return false;
+    switch (toupper((unsigned char)*end)) {
+    case 'G': n *= 1024;    // fall through
+    case 'M': n *= 1024;    // fall through
+    case 'K': n *= 1024; break;
+    default: break;
+    }
+    out = n;
+    return true;
+}
+
+// How a parallel command prints its results
+struct ResultFormat {
+    bool ordered = false;       // --ordered: in walk order
+    bool nul = false;           // -0 / --null: paths end in NUL, not newline or ':'
+    bool sorted = false;        // --sort: one sorted list of paths (see SortedOutput)
+    size_t memory = 0;          // --mem SIZE: cap for --sort, 0 = SORT_MEMORY
+};
+
+// Remove the options above from 'args'
+void takeResultFormat(vector<string> &args, ResultFormat &fmt) {
+    vector<string> rest;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const string &a = args[i];
+        double v;
+        if (a == "--ordered") fmt.ordered = true;
+        else if (a == "-0" || a == "--null") fmt.nul = true;
+        else if (a == "--sort") fmt.sorted = true;
+        else if (a == "--mem" && i + 1 < args.size() && parseScaled(args[i + 1], v)) {
+            fmt.memory = (size_t)v;
+            ++i;
+        }
+        else rest.push_back(a);
+    }
+    args.swap(rest);
+}
+
+/*-------------------------------------------------------------
+    Split input line into words
+-------------------------------------------------------------*/
+vector<string> split(string_view line) {
+    vector<string> parts;
+    size_t i = 0, n = line.size();
+    while (true) {
+        while (i < n && isspace((unsigned char)line[i])) ++i;
+        if (i == n) break;
+        size_t start = i;
+        while (i < n && !isspace((unsigned char)line[i])) ++i;
+        parts.emplace_back(line.data() + start, i - start);
+    }
+    return parts;
+}
+
+/*-------------------------------------------------------------
+    Path builder for traversals
+    Keeps one growing buffer per directory being read: push()
+    appends a component and returns a mark, pop() truncates back
+    to it. Per-entry paths therefore cost no allocation once the
+    buffer has grown to the longest name.
+-------------------------------------------------------------*/
+class PathBuilder {
+public:
+    explicit PathBuilder(string_view root) {
+        buf.reserve(root.size() + 256);
+        buf.assign(root.data(), root.size());
+    }
+
+    size_t push(string_view name) {
+        size_t mark = buf.size();
+        buf += PATH_SEP;
+        buf.append(name.data(), name.size());
+        return mark;
+    }
+    void pop(size_t mark) { buf.resize(mark); }
+
+    const string &str() const { return buf; }
+    const char *c_str() const { return buf.c_str(); }
+    string_view view() const { return string_view(buf.data(), buf.size()); }
+
+private:
+    string buf;
+};
+
+/*-------------------------------------------------------------
+    Arena for names that must outlive one directory read
+    Strings are copied NUL-terminated into 64 KiB blocks and live
+    until the arena is destroyed, so a traversal hands out
+    string_views instead of owning one string per directory.
+    Safe to call from several workers.
+-------------------------------------------------------------*/
+const size_t NAME_ARENA_BLOCK = 64 << 10;
+
+class NameArena {
+public:
+    string_view store(string_view s) {
+        lock_guard<mutex> lock(mtx);
+        if (blocks.empty() || used + s.size() + 1 > blockSize) {
+            blockSize = max(NAME_ARENA_BLOCK, s.size() + 1);
+            blocks.emplace_back(new char[blockSize]);
+            used = 0;
+        }
+        char *p = blocks.back().get() + used;
+        memcpy(p, s.data(), s.size());
+        p[s.size()] = '\0';
+        used += s.size() + 1;
+        return string_view(p, s.size());
+    }
+
+private:
+    mutex mtx;
+    vector<unique_ptr<char[]>> blocks;
+    size_t used = 0, blockSize = 0;
+};
+
+/*-------------------------------------------------------------
+    Check if path refers to a directory
+-------------------------------------------------------------*/
+bool isDirectory(const string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        return (st.st_mode & S_IFDIR);
+    return false;
+}
+
+
+class Throttle;
+
+// The throttle of the command the calling thread works for, if any;
+// pool tasks carry their submitter's, like its output sink
+Throttle *&currentThrottle() {
+    static thread_local Throttle *t = NULL;
+    return t;
+}
+
+/*-------------------------------------------------------------
+    Work-stealing thread pool
+    Every worker owns a deque: it pushes and pops its own tasks
+    at the back (depth first, cache friendly) and steals from the
+    front of other workers' deques when it runs dry.
+-------------------------------------------------------------*/
+class WorkPool {
+public:
+    explicit WorkPool(unsigned workers) {
+        if (workers == 0) workers = 1;
+        for (unsigned i = 0; i < workers; ++i)
+            queues.emplace_back(new TaskQueue);
+        for (unsigned i = 0; i < workers; ++i)
+            threads.emplace_back(&WorkPool::run, this, i);
+    }
+
+    ~WorkPool() {
+        {
+            lock_guard<mutex> lock(idleMtx);
+            stopping = true;
+        }
+        idleCv.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    // Pool shared by every traversal; directory walks are I/O bound,
+    // so keep a few workers busy even on small machines.
+    static WorkPool &shared() {
+        static WorkPool pool(max(4u, thread::hardware_concurrency()));
+        return pool;
+    }
+
+    size_t size() const { return threads.size(); }
+
+    // The task prints into the submitter's output sink, if it has one,
+    // and runs under the submitter's throttle
+    void submit(function<void()> task) {
+        size_t q = (currentPool == this) ? currentIndex
+                                         : nextQueue++ % queues.size();
+        {
+            lock_guard<mutex> lock(queues[q]->mtx);
+            queues[q]->tasks.push_back(Task{ move(task), OutputRouter::capturing(),
+                                             currentThrottle() });
+        }
+        {
+            lock_guard<mutex> lock(idleMtx);
+            ++queued;
+        }
+        idleCv.notify_one();
+    }
+
+    // Run queued tasks on the calling thread until done() returns true
+    template <class Done>
+    void helpUntil(Done done) {
+        Task task;
+        while (!done()) {
+            if (tryPop(task)) {
+                execute(task);
+                continue;
+            }
+            unique_lock<mutex> lock(idleMtx);
+            idleCv.wait_for(lock, chrono::milliseconds(5),
+                            [&] { return done() || queued > 0; });
+        }
+    }
+
+    // Wake sleeping workers and helpers (used to signal completion)
+    void wakeAll() {
+        { lock_guard<mutex> lock(idleMtx); }
+        idleCv.notify_all();
+    }
+
+private:
+    struct Task {
+        function<void()> fn;
+        OutputSink *sink;
+        Throttle *throttle;
+    };
+
+    struct TaskQueue {
+        mutex mtx;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> threads;
+    atomic<size_t> nextQueue{0};
+
+    mutex idleMtx;
+    condition_variable idleCv;
+    size_t queued = 0;
+    bool stopping = false;
+
+    static thread_local WorkPool *currentPool;
+    static thread_local size_t currentIndex;
+
+    bool tryPop(Task &task) {
+        size_t n = queues.size();
+        bool own = (currentPool == this);
+        size_t self = own ? currentIndex : 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            TaskQueue &q = *queues[(self + i) % n];
+            lock_guard<mutex> lock(q.mtx);
+            if (q.tasks.empty()) continue;
+            if (own && i == 0) {
+                task = move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            lock_guard<mutex> idle(idleMtx);
+            --queued;
+            return true;
+        }
+        return false;
+    }
+
+    static void execute(Task &task) {
+        OutputSink *saved = OutputRouter::capturing();
+        Throttle *savedThrottle = currentThrottle();
+        OutputRouter::capture(task.sink);
+        currentThrottle() = task.throttle;
+        task.fn();
+        task.fn = nullptr;
+        OutputRouter::capture(saved);
+        currentThrottle() = savedThrottle;
+    }
+
+    void run(size_t index) {
+        currentPool = this;
+        currentIndex = index;
+
+        Task task;
+        while (true) {
+            {
+                unique_lock<mutex> lock(idleMtx);
+                idleCv.wait(lock, [&] { return stopping || queued > 0; });
+                if (stopping && queued == 0) return;
+            }
+            while (tryPop(task)) execute(task);
+        }
+    }
+};
+
+thread_local WorkPool *WorkPool::currentPool = NULL;
+thread_local size_t WorkPool::currentIndex = 0;
+
+/*-------------------------------------------------------------
+    A batch of pool tasks that can be waited for on its own
+    (other commands may be using the same pool at the time)
+-------------------------------------------------------------*/
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkPool &p) : pool(p) {}
+    ~TaskGroup() { wait(); }
+
+    void run(function<void()> fn) {
+        ++pending;
+        WorkPool *p = &pool;
+        atomic<long> *count = &pending;
+        pool.submit([p, count, fn] {
+            fn();
+            // The group may be gone as soon as the count drops to zero
+            if (--*count == 0) p->wakeAll();
+        });
+    }
+
+    void wait() {
+        pool.helpUntil([this] { return pending.load() == 0; });
+    }
+
+private:
+    WorkPool &pool;
+    atomic<long> pending{0};
+};
+
+/*-------------------------------------------------------------
+    External merge sort for output too big to hold in memory
+    Records are byte strings, ordered by memcmp (the shorter one
+    first on a tie). They collect in a run until it reaches its
+    share of the memory cap; a full run is handed to a pool task
+    that sorts it and spills it to a temp file while the next run
+    fills, so up to SORT_PARALLEL_RUNS are sorted at once. A
+    spilled run is just varint-length-prefixed records. merge()
+    sorts the last run where it is and k-way merges it with the
+    spilled ones through a heap; when there are more runs than
+    read buffers fit in the cap, groups of them are merged into
+    longer runs first.
+-------------------------------------------------------------*/
+const size_t SORT_MEMORY = 256 << 20;           // default cap
+const size_t SORT_READ_BUFFER = 64 << 10;       // per run while merging
+const size_t SORT_MIN_RUN = 1 << 20;
+const unsigned SORT_PARALLEL_RUNS = 4;
+
+class ExternalSorter {
+public:
+    explicit ExternalSorter(size_t memory = SORT_MEMORY, WorkPool &p = WorkPool::shared())
+        : pool(p) {
+        if (memory == 0) memory = SORT_MEMORY;
+        parallel = (unsigned)min<size_t>(SORT_PARALLEL_RUNS, max<size_t>(1, pool.size()));
+        runLimit = max(SORT_MIN_RUN, memory / (parallel + 1));
+        fanIn = max<size_t>(2, min<size_t>(memory / 2 / SORT_READ_BUFFER, 256));
+    }
+
+    ~ExternalSorter() {
+        pool.helpUntil([this] { return inFlight.load() == 0; });
+        for (FILE *f : files)
+            if (f) fclose(f);
+    }
+
+    ExternalSorter(const ExternalSorter &) = delete;
+    ExternalSorter &operator=(const ExternalSorter &) = delete;
+
+    void add(const char *s, size_t n) {
+        Rec r = { run.bytes.size(), n };
+        run.bytes.append(s, n);
+        run.recs.push_back(r);
+        ++total;
+        if (run.bytes.size() + run.recs.size() * sizeof(Rec) >= runLimit) spill();
+    }
+
+    size_t count() const { return total; }
+    size_t spilled() const { return spills; }
+
+    // Call fn(data, size) for every record in order until it returns false;
+    // false if a temp file could not be written or read back
+    template <class Fn>
+    bool merge(Fn fn) {
+        pool.helpUntil([this] { return inFlight.load() == 0; });
+        if (failed) return false;
+        run.sort();
+
+        while (files.size() > fanIn) {
+            vector<FILE *> group(files.begin(), files.begin() + fanIn);
+            files.erase(files.begin(), files.begin() + fanIn);
+            FILE *out = tmpfile();
+            auto copy = [out](const char *p, size_t n) { return putRecord(out, p, n); };
+            bool ok = out && mergeRuns(group, NULL, copy);
+            for (FILE *f : group) fclose(f);
+            if (out && (fflush(out) != 0 || ferror(out))) ok = false;
+            if (!ok) {
+                if (out) fclose(out);
+                return false;
+            }
+            rewind(out);
+            files.push_back(out);
+        }
+        bool ok = mergeRuns(files, &run, fn);
+        for (FILE *f : files) fclose(f);
+        files.clear();
+        return ok;
+    }
+
+private:
+    struct Rec {
+        size_t offset, length;
+    };
+
+    struct Run {
+        string bytes;
+        vector<Rec> recs;
+
+        void sort() {
+            const char *base = bytes.data();
+            std::sort(recs.begin(), recs.end(), [base](const Rec &a, const Rec &b) {
+                return less(base + a.offset, a.length, base + b.offset, b.length);
+            });
+        }
+    };
+
+    // A spilled run read back through a buffer of its own
+    struct Reader {
+        FILE *f;
+        vector<char> buf;
+        size_t pos = 0, end = 0;
+        string cur;
+        bool bad = false;
+
+        explicit Reader(FILE *file) : f(file), buf(SORT_READ_BUFFER) {}
+
+        bool fill() {
+            pos = 0;
+            end = fread(buf.data(), 1, buf.size(), f);
+            return end > 0;
+        }
+
+        bool next() {
+            uint64_t len = 0;
+            unsigned shift = 0;
+            unsigned char c;
+            do {
+                if (pos == end && !fill()) {
+                    bad = shift != 0 || ferror(f);  // clean end only between records
+                    return false;
+                }
+                c = (unsigned char)buf[pos++];
+                len |= (uint64_t)(c & 0x7f) << shift;
+                shift += 7;
+            } while (c & 0x80);
+
+            cur.resize((size_t)len);
+            for (size_t got = 0; got < len;) {
+                if (pos == end && !fill()) {
+                    bad = true;
+                    return false;
+                }
+                size_t k = min((size_t)len - got, end - pos);
+                memcpy(&cur[got], buf.data() + pos, k);
+                got += k;
+                pos += k;
+            }
+            return true;
+        }
+    };
+
+    // One input of a merge: a reader, or the in-memory run when reader is NULL
+    struct Source {
+        Reader *reader;
+        size_t index;
+        const char *p;
+        size_t n;
+    };
+
+    WorkPool &pool;
+    unsigned parallel;
+    size_t runLimit, fanIn;
+    Run run;
+    size_t total = 0, spills = 0;
+
+    mutex mtx;                  // files, filled in by the spill tasks
+    vector<FILE *> files;
+    atomic<unsigned> inFlight{0};
+    atomic<bool> failed{false};
+
+    static bool less(const char *a, size_t an, const char *b, size_t bn) {
+        int c = memcmp(a, b, min(an, bn));
+        return c != 0 ? c < 0 : an < bn;
+    }
+
+    static bool putRecord(FILE *out, const char *p, size_t n) {
+        unsigned char len[10];
+        size_t k = 0;
+        uint64_t v = n;
+        do {
+            len[k] = (unsigned char)(v & 0x7f);
+            v >>= 7;
+            if (v) len[k] |= 0x80;
+            ++k;
+        } while (v);
+        return fwrite(len, 1, k, out) == k && fwrite(p, 1, n, out) == n;
+    }
+
+    static FILE *writeRun(const Run &r) {
+        FILE *f = tmpfile();
+        if (!f) return NULL;
+        bool ok = true;
+        for (size_t i = 0; i < r.recs.size() && ok; ++i)
+            ok = putRecord(f, r.bytes.data() + r.recs[i].offset, r.recs[i].length);
+        if (!ok || fflush(f) != 0 || ferror(f)) {
+            fclose(f);
+            return NULL;
+        }
+        rewind(f);
+        return f;
+    }
+
+    // Sort and write the current run on the pool; wait for a free slot first
+    void spill() {
+        pool.helpUntil([this] { return inFlight.load() < parallel; });
+        shared_ptr<Run> full = make_shared<Run>();
+        full->bytes.swap(run.bytes);
+        full->recs.swap(run.recs);
+        size_t slot;
+        {
+            lock_guard<mutex> lock(mtx);
+            files.push_back(NULL);
+            slot = files.size() - 1;
+        }
+        ++spills;
+        ++inFlight;
+        WorkPool *p = &pool;
+        pool.submit([this, p, full, slot] {
+            full->sort();
+            FILE *f = writeRun(*full);
+            {
+                lock_guard<mutex> lock(mtx);
+                files[slot] = f;
+                if (!f) failed = true;
+            }
+            // The sorter may be gone as soon as the count drops
+            --inFlight;
+            p->wakeAll();
+        });
+    }
+
+    bool advance(Source &s, const Run *mem) const {
+        if (s.reader) {
+            if (!s.reader->next()) return false;
+            s.p = s.reader->cur.data();
+            s.n = s.reader->cur.size();
+            return true;
+        }
+        if (s.index >= mem->recs.size()) return false;
+        const Rec &r = mem->recs[s.index++];
+        s.p = mem->bytes.data() + r.offset;
+        s.n = r.length;
+        return true;
+    }
+
+    template <class Fn>
+    bool mergeRuns(const vector<FILE *> &runs, const Run *mem, Fn &fn) {
+        vector<unique_ptr<Reader>> readers;
+        vector<Source> sources;
+        sources.reserve(runs.size() + 1);
+        for (FILE *f : runs) {
+            readers.emplace_back(new Reader(f));
+            sources.push_back(Source{ readers.back().get(), 0, NULL, 0 });
+        }
+        if (mem) sources.push_back(Source{ NULL, 0, NULL, 0 });
+
+        // Min-heap on each source's current record
+        auto after = [](const Source *a, const Source *b) { return less(b->p, b->n, a->p, a->n); };
+        vector<Source *> heap;
+        for (Source &s : sources)
+            if (advance(s, mem)) heap.push_back(&s);
+        make_heap(heap.begin(), heap.end(), after);
+
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), after);
+            Source *s = heap.back();
+            if (!fn(s->p, s->n)) return true;
+            if (advance(*s, mem)) push_heap(heap.begin(), heap.end(), after);
+            else heap.pop_back();
+        }
+        for (const unique_ptr<Reader> &r : readers)
+            if (r->bad) return false;
+        return true;
+    }
+};
+
+/*-------------------------------------------------------------
+    Sorted output (--sort)
+    Captures the calling thread's standard output (and so that of
+    the pool tasks and result writer it starts) while in scope,
+    takes every line ending in 'end' as one record, and writes
+    them out in order through an ExternalSorter at finish().
+-------------------------------------------------------------*/
+class SortedOutput : public OutputSink {
+public:
+    SortedOutput(size_t memory, char endChar)
+        : sorter(memory), end(endChar), parent(OutputRouter::capturing()) {
+        OutputRouter::capture(this);
+    }
+    ~SortedOutput() { finish(); }
+
+    void write(int stream, const char *s, size_t n) override {
+        if (stream != 0) {
+            if (parent) parent->write(stream, s, n);
+            else OutputRouter::errors().emit(s, n);
+            return;
+        }
+        // Recursive: a spill may run a pool task here that prints too
+        lock_guard<recursive_mutex> lock(mtx);
+        const char *stop = s + n;
+        while (s < stop) {
+            const char *e = (const char *)memchr(s, end, (size_t)(stop - s));
+            if (!e) {
+                carry.append(s, (size_t)(stop - s));
+                break;
+            }
+            if (carry.empty()) {
+                sorter.add(s, (size_t)(e - s));
+            } else {
+                carry.append(s, (size_t)(e - s));
+                sorter.add(carry.data(), carry.size());
+                carry.clear();
+            }
+            s = e + 1;
+        }
+    }
+
+    void finish() {
+        if (done) return;
+        done = true;
+        OutputRouter::capture(parent);
+        lock_guard<recursive_mutex> lock(mtx);
+        if (!carry.empty()) sorter.add(carry.data(), carry.size());
+
+        string out;
+        bool ok = sorter.merge([&](const char *p, size_t n) {
+            out.append(p, n);
+            out += end;
+            if (out.size() >= (1 << 20)) {
+                OutputRouter::send(parent, out.data(), out.size());
+                out.clear();
+            }
+            return true;
+        });
+        OutputRouter::send(parent, out.data(), out.size());
+        if (!ok) cerr << "sort: could not write or read back a temporary run\n";
+    }
+
+private:
+    ExternalSorter sorter;
+    char end;
+    OutputSink *parent;
+    recursive_mutex mtx;
+    string carry;
+    bool done = false;
+};
+
+/*-------------------------------------------------------------
+    Modification time of a stat result in nanoseconds
+-------------------------------------------------------------*/
+int64_t mtimeNs(const struct stat &st) {
+#ifdef _WIN32
+    return (int64_t)st.st_mtime * 1000000000LL;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+/*-------------------------------------------------------------
+    File identity and change time
+-------------------------------------------------------------*/
+struct FileId {
+    uint64_t dev, ino;
+    bool operator==(const FileId &o) const { return dev == o.dev && ino == o.ino; }
+};
+
+struct FileIdHash {
+    size_t operator()(const FileId &f) const {
+        return (size_t)(f.ino * 0x9e3779b97f4a7c15ULL ^ f.dev);
+    }
+};
+
+int64_t ctimeNs(const struct stat &st) {
+#ifdef _WIN32
+    return (int64_t)st.st_ctime * 1000000000LL;
+#else
+    return (int64_t)st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+#endif
+}
+
+/*-------------------------------------------------------------
+    Entry types reported by the traversal
+-------------------------------------------------------------*/
+enum EntryType { ENTRY_UNKNOWN, ENTRY_FILE, ENTRY_DIR, ENTRY_LINK, ENTRY_OTHER };
+
+EntryType typeFromMode(mode_t mode) {
+    if (S_ISDIR(mode)) return ENTRY_DIR;
+    if (S_ISREG(mode)) return ENTRY_FILE;
+#ifdef S_ISLNK
+    if (S_ISLNK(mode)) return ENTRY_LINK;
+#endif
+    return ENTRY_OTHER;
+}
+
+#ifdef _DIRENT_HAVE_D_TYPE
+EntryType typeFromDirent(unsigned char t) {
+    switch (t) {
+    case DT_DIR:     return ENTRY_DIR;
+    case DT_REG:     return ENTRY_FILE;
+    case DT_LNK:     return ENTRY_LINK;
+    case DT_UNKNOWN: return ENTRY_UNKNOWN;
+    default:         return ENTRY_OTHER;
+    }
+}
+#endif
+
+/*-------------------------------------------------------------
+    Stat an entry of an open directory
+    On POSIX this resolves 'name' against the directory handle
+    (fstatat) instead of walking 'fullPath' again from the root.
+    Symlinks are not followed unless 'follow' is set, so walks
+    normally never leave the tree.
+-------------------------------------------------------------*/
+bool statEntry(DIR *dir, const char *name, const string &fullPath,
+               struct stat &st, bool follow = false) {
+    perf::count(perf::STATS);
+#ifdef _WIN32
+    (void)dir; (void)name; (void)follow;
+    return stat(fullPath.c_str(), &st) == 0;
+#else
+    (void)fullPath;
+    return fstatat(dirfd(dir), name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+#endif
+}
+
+/*-------------------------------------------------------------
+    Parallel directory traversal
+    Directories are explicit work items on the pool rather than
+    stack frames, so depth is bounded only by memory. Each one is
+    also hinted to the Prefetcher when it is queued (see below).
+    walkTree() is a template over the command's walk policy, a
+    struct derived from WalkPolicy<flags> that hides the hooks it
+    needs. The flags:
+      WALK_STAT       - stat every entry (otherwise only when
+                        d_type is unknown)
+      WALK_FOLLOW     - stat through symlinks and descend into
+                        linked directories (a cycle is walked
+                        until the paths get too long)
+      WALK_NO_RECURSE - visit the root's entries only
+      WALK_NO_PREFETCH - no read-ahead hints (a walk that removes
+                         what it visits; on Windows a helper's open
+                         handle would keep a directory from going)
+    and the hooks:
+      enterDir    - before a directory's entries are read
+      entry       - once per entry; return true to descend into it
+      leaveDir    - after a directory's entries (same thread as enterDir)
+      finishDir   - after a directory and its whole subtree are done
+      error       - a directory could not be opened
+    The flags are constants and the hooks plain inline members,
+    so each walk is compiled into its own loop with no indirect
+    calls, and stats or hooks a policy leaves alone are not even
+    compiled in. Hooks may run concurrently on different workers
+    and are const; state lives behind references.
+    With an output writer each directory gets a slot in it, in
+    readdir order; walkSlot() is the slot of the directory whose
+    callbacks are running, closed by the walk after leaveDir.
+-------------------------------------------------------------*/
+struct WalkEntry {
+    const string &path;     // full path of the entry
+    const char *name;       // name inside its parent directory
+    EntryType type;
+    const struct stat *st;  // NULL unless stat'ed (or if stat failed)
+    int depth;              // 1 for the children of the walk root
+    DIR *dir;               // the open parent, for a policy that stats on its own
+
+    bool isDir() const { return type == ENTRY_DIR; }
+};
+
+enum WalkFlag { WALK_STAT = 1, WALK_FOLLOW = 2, WALK_NO_RECURSE = 4, WALK_NO_PREFETCH = 8 };
+
+template <unsigned Flags = 0>
+struct WalkPolicy {
+    static constexpr bool needStat = (Flags & WALK_STAT) != 0;
+    static constexpr bool followLinks = (Flags & WALK_FOLLOW) != 0;
+    static constexpr bool recurse = (Flags & WALK_NO_RECURSE) == 0;
+    static constexpr bool prefetch = (Flags & WALK_NO_PREFETCH) == 0;
+
+    void enterDir(const string &, int) const {}
+    bool entry(const WalkEntry &e) const { return e.isDir(); }
+    void leaveDir(const string &, int) const {}
+    void finishDir(const string &, int) const {}
+    void error(const string &, int) const {}
+
+    ResultWriter *output = NULL;
+};
+
+// Serializes console output coming from walk workers
+mutex consoleMutex;
+
+// Ask the Prefetcher to read 'dir' ahead of the walk; 'reached' is set
+// once the walk opens it itself (the hint is then dropped)
+void prefetchDir(const string &dir, bool stat, shared_ptr<const atomic<bool>> reached);
+
+namespace walk_detail {
+
+struct Node {
+    string path;
+    int depth;
+    shared_ptr<Node> parent;
+    atomic<int> pending{1};     // this directory's own read + live child dirs
+    atomic<bool> opened{false};
+    ResultSlot *slot = NULL;
+};
+
+inline ResultSlot *&currentSlot() {
+    static thread_local ResultSlot *s = NULL;
+    return s;
+}
+
+template <class Policy>
+struct State {
+    const Policy &policy;
+    WorkPool &pool;
+    atomic<bool> done{false};
+
+    State(const Policy &p, WorkPool &w) : policy(p), pool(w) {}
+};
+
+// Drop one reference from 'node' and complete every ancestor that drains
+template <class Policy>
+void release(State<Policy> &ws, shared_ptr<Node> node) {
+    while (node && --node->pending == 0) {
+        ws.policy.finishDir(node->path, node->depth);
+
+        shared_ptr<Node> parent = node->parent;
+        if (!parent) {
+            // 'ws' lives on the waiting thread's stack: don't touch it after 'done'
+            WorkPool &pool = ws.pool;
+            ws.done = true;
+            pool.wakeAll();
+            return;
+        }
+        node = parent;
+    }
+}
+
+template <class Policy>
+void readDir(State<Policy> &ws, shared_ptr<Node> node) {
+    const Policy &p = ws.policy;
+    ResultSlot *outer = currentSlot();
+    currentSlot() = node->slot;
+
+    node->opened = true;
+    DIR *dir = opendir(node->path.c_str());
+    if (!dir) {
+        p.error(node->path, errno);
+        if (p.output) p.output->close(node->slot);
+        currentSlot() = outer;
+        release(ws, node);
+        return;
+    }
+
+    p.enterDir(node->path, node->depth);
+
+    perf::count(perf::DIR_OPENS);
+    perf::count(perf::DIR_READS);
+    perf::Scope timing(perf::PH_READDIR);      // includes the policy's per-entry work
+    uint64_t visited = 0;
+
+    // Not thread_local: a policy that waits may run another readDir on this thread
+    PathBuilder fullPath(node->path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        size_t mark = fullPath.push(name);
+        ++visited;
+
+        EntryType type = ENTRY_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+        type = typeFromDirent(entry->d_type);
+#endif
+        struct stat st;
+        bool haveStat = false;
+        if (Policy::needStat || type == ENTRY_UNKNOWN ||
+            (Policy::followLinks && type == ENTRY_LINK)) {
+            haveStat = statEntry(dir, name, fullPath.str(), st, Policy::followLinks);
+            if (haveStat) type = typeFromMode(st.st_mode);
+        }
+
+        WalkEntry e = { fullPath.str(), name, type, haveStat ? &st : NULL,
+                        node->depth + 1, dir };
+        if (p.entry(e) && Policy::recurse && type == ENTRY_DIR) {
+            shared_ptr<Node> child = make_shared<Node>();
+            child->path = fullPath.str();
+            child->depth = node->depth + 1;
+            child->parent = node;
+            if (p.output) child->slot = p.output->child(node->slot);
+            if (Policy::prefetch)
+                prefetchDir(child->path, Policy::needStat,
+                            shared_ptr<const atomic<bool>>(child, &child->opened));
+
+            ++node->pending;
+            ws.pool.submit([&ws, child] { readDir(ws, child); });
+        }
+        fullPath.pop(mark);
+    }
+    closedir(dir);
+    perf::count(perf::ENTRIES, visited);
+
+    p.leaveDir(node->path, node->depth);
+    if (p.output) p.output->close(node->slot);
+    currentSlot() = outer;
+    release(ws, node);
+}
+
+} // namespace walk_detail
+
+// Output slot of the directory being visited on this thread (see walkTree)
+ResultSlot *walkSlot() { return walk_detail::currentSlot(); }
+
+/*-------------------------------------------------------------
+    Walk the tree under 'root' (a directory) and block until done
+-------------------------------------------------------------*/
+template <class Policy>
+void walkTree(const string &root, const Policy &policy, WorkPool &pool = WorkPool::shared()) {
+    walk_detail::State<Policy> ws(policy, pool);
+
+    shared_ptr<walk_detail::Node> node = make_shared<walk_detail::Node>();
+    node->path = root;
+    node->depth = 0;
+    if (policy.output) node->slot = policy.output->root();
+
+    pool.submit([&ws, node] { walk_detail::readDir(ws, node); });
+    pool.helpUntil([&ws] { return ws.done.load(); });
+}
+
+/*-------------------------------------------------------------
+    Format one 'ls' line for an entry
+-------------------------------------------------------------*/
+void formatEntry(const struct stat &st, const char *name, string &out) {
+    out += S_ISDIR(st.st_mode) ? "[DIR]  " : "       ";
+    out += name;
+    out += "\t(" + to_string((long long)st.st_size) + " bytes)\n";
+}
+
+/*-------------------------------------------------------------
+    Large buffered writer for command output
+    Formats numbers itself and hands cout's buffer whole 1 MiB
+    chunks instead of going through operator<< per field.
+-------------------------------------------------------------*/
+class OutputWriter {
+public:
+    explicit OutputWriter(size_t capacity = 1 << 20) : cap(capacity) {
+        buf.reserve(capacity);
+    }
+    ~OutputWriter() { flush(); }
+
+    void put(const char *s, size_t n) {
+        if (buf.size() + n > cap) flush();
+        buf.append(s, n);
+    }
+    void put(const char *s) { put(s, strlen(s)); }
+    void put(const string &s) { put(s.data(), s.size()); }
+    void put(char c) {
+        if (buf.size() + 1 > cap) flush();
+        buf += c;
+    }
+
+    void putNum(long long v) {
+        char tmp[24];
+        char *p = tmp + sizeof(tmp);
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        do {
+            *--p = (char)('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (v < 0) *--p = '-';
+        put(p, (size_t)(tmp + sizeof(tmp) - p));
+    }
+
+    // Same layout as formatEntry()
+    void putEntry(bool isDir, const char *name, long long size) {
+        put(isDir ? "[DIR]  " : "       ", 7);
+        put(name);
+        put("\t(", 2);
+        putNum(size);
+        put(" bytes)\n", 8);
+    }
+
+    void flush() {
+        if (buf.empty()) return;
+        perf::Scope timing(perf::PH_OUTPUT);
+        cout.rdbuf()->sputn(buf.data(), (streamsize)buf.size());
+        cout.flush();
+        buf.clear();
+    }
+
+private:
+    size_t cap;
+    string buf;
+};
+
+/*-------------------------------------------------------------
+    Batched file I/O
+    Commands that need many independent stat/open/read/write
+    calls queue them in an IoBatch and run() the whole batch.
+    On Linux the batch goes through an io_uring (raw syscalls,
+    one ring per thread, hundreds of requests per submission), so
+    on network storage the round trips overlap instead of queuing
+    behind each other. Where io_uring is missing or refused (old
+    kernels, seccomp, other platforms) run() issues the same calls
+    one by one. Each op's result is what the syscall would return,
+    or -errno. Ops in one batch must not depend on each other.
+-------------------------------------------------------------*/
+#ifndef _WIN32
+struct IoOp {
+    enum Kind { STAT, OPEN, READ, WRITE, CLOSE };
+    Kind kind;
+    int fd;                 // directory fd for STAT/OPEN
+    const char *path;
+    int flags;
+    mode_t mode;
+    char *buf;
+    size_t len;
+    int64_t offset;
+    struct stat *st;
+    long result;
+};
+
+#ifdef FE_HAVE_IO_URING
+// One io_uring owned by the calling thread
+class IoRing {
+public:
+    static const unsigned ENTRIES = 256;
+
+    static IoRing *forThread() {
+        static atomic<bool> unavailable{false};
+        static thread_local unique_ptr<IoRing> ring;
+        static thread_local bool retired = false;
+        if (ring && ring->failed) {
+            // A ring that lost track of requests is left open rather than
+            // torn down under them; the thread goes on with plain syscalls
+            if (ring->stranded) ring.release();
+            else ring.reset();
+            retired = true;
+        }
+        if (!ring && !unavailable && !retired) {
+            ring.reset(new IoRing());
+            if (!ring->ok()) {
+                ring.reset();
+                unavailable = true;
+            }
+        }
+        return ring.get();
+    }
+
+    ~IoRing() {
+        if (sqes) munmap(sqes, sqeBytes);
+        if (cqMap && cqMap != sqMap) munmap(cqMap, cqBytes);
+        if (sqMap) munmap(sqMap, sqBytes);
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool ok() const { return fd >= 0 && sqes != NULL; }
+
+    // Run ops[0..n) and store every op's result; false if the ring failed.
+    // Then ops the kernel never saw are left PENDING (safe to redo), and
+    // ops it took but never answered are -EIO, since redoing a read,
+    // write or close that may still happen is not. The ring is not used
+    // again after a failure (see forThread).
+    bool run(IoOp *ops, size_t n) {
+        vector<struct statx> &sx = statBuffers;
+        sx.resize(n);
+        for (size_t i = 0; i < n; ++i) ops[i].result = PENDING;
+
+        size_t next = 0, done = 0;
+        unsigned inFlight = 0, unsubmitted = 0;
+        while (done < n) {
+            while (next < n && inFlight + unsubmitted < sqEntries) {
+                prepare(ops[next], sx[next], next);
+                ++next;
+                ++unsubmitted;
+            }
+            unsigned wait = (unsubmitted == 0 || next == n) ? 1 : 0;
+            long r = syscall(__NR_io_uring_enter, fd, unsubmitted, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (r >= 0) {
+                inFlight += (unsigned)r;
+                unsubmitted -= (unsigned)r;
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                abandon(ops, next, unsubmitted, inFlight);
+                return false;
+            }
+            done += reap(ops, inFlight);
+        }
+        return true;
+    }
+
+    static const long PENDING = LONG_MIN;
+
+private:
+    int fd = -1;
+    void *sqMap = NULL, *cqMap = NULL;
+    io_uring_sqe *sqes = NULL;
+    size_t sqBytes = 0, cqBytes = 0, sqeBytes = 0;
+    unsigned *sqTail = NULL, *sqArray = NULL, sqMask = 0, sqEntries = 0;
+    unsigned *cqHead = NULL, *cqTail = NULL, cqMask = 0;
+    io_uring_cqe *cqes = NULL;
+    vector<struct statx> statBuffers;
+    bool failed = false;
+    unsigned stranded = 0;      // requests of a failed run that never completed
+
+    // Store the results of every completion posted so far; returns how many
+    size_t reap(IoOp *ops, unsigned &inFlight) {
+        size_t n = 0;
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++n) {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            IoOp &op = ops[cqe.user_data];
+            op.result = cqe.res;
+            if (op.kind == IoOp::STAT && cqe.res == 0) fromStatx(statBuffers[cqe.user_data], *op.st);
+            --inFlight;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    // io_uring_enter failed: take back the entries the kernel has not
+    // consumed (the last 'unsubmitted' prepared), then wait out the ones
+    // in flight so no completion can land after the caller moves on
+    void abandon(IoOp *ops, size_t prepared, unsigned unsubmitted, unsigned inFlight) {
+        __atomic_store_n(sqTail, *sqTail - unsubmitted, __ATOMIC_RELEASE);
+        while (inFlight > 0) {
+            reap(ops, inFlight);
+            if (inFlight == 0) break;
+            long r = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (r < 0 && errno != EINTR) break;
+        }
+        stranded = inFlight;
+        for (size_t i = 0; i + unsubmitted < prepared; ++i)
+            if (ops[i].result == PENDING) ops[i].result = -EIO;
+        failed = true;
+    }
+
+    IoRing() {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, ENTRIES, &p);
+        if (fd < 0) return;
+
+        sqBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sqBytes = cqBytes = max(sqBytes, cqBytes);
+
+        sqMap = mmap(NULL, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED) {
+            sqMap = NULL;
+            return;
+        }
+        cqMap = sqMap;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+            cqMap = mmap(NULL, cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+            if (cqMap == MAP_FAILED) {
+                cqMap = NULL;
+                return;
+            }
+        }
+        sqeBytes = p.sq_entries * sizeof(io_uring_sqe);
+        void *s = mmap(NULL, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return;
+        sqes = (io_uring_sqe *)s;
+
+        char *sq = (char *)sqMap, *cq = (char *)cqMap;
+        sqTail = (unsigned *)(sq + p.sq_off.tail);
+        sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + p.sq_off.array);
+        sqEntries = p.sq_entries;
+        cqHead = (unsigned *)(cq + p.cq_off.head);
+        cqTail = (unsigned *)(cq + p.cq_off.tail);
+        cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    }
+
+    void prepare(const IoOp &op, struct statx &sx, size_t tag) {
+        unsigned tail = *sqTail;
+        unsigned idx = tail & sqMask;
+        io_uring_sqe &e = sqes[idx];
+        memset(&e, 0, sizeof(e));
+        e.fd = op.fd;
+        e.user_data = tag;
+        switch (op.kind) {
+        case IoOp::STAT:
+            e.opcode = IORING_OP_STATX;
+            e.addr = (uint64_t)(uintptr_t)op.path;
+            e.len = STATX_BASIC_STATS;
+            e.off = (uint64_t)(uintptr_t)&sx;
+            e.statx_flags = (uint32_t)op.flags;
+            break;
+        case IoOp::OPEN:
+            e.opcode = IORING_OP_OPENAT;
+            e.addr = (uint64_t)(uintptr_t)op.path;
+            e.len = op.mode;
+            e.open_flags = (uint32_t)op.flags;
+            break;
+        case IoOp::READ:
+        case IoOp::WRITE:
+            e.opcode = op.kind == IoOp::READ ? IORING_OP_READ : IORING_OP_WRITE;
+            e.addr = (uint64_t)(uintptr_t)op.buf;
+            e.len = (uint32_t)op.len;
+            e.off = (uint64_t)op.offset;
+            break;
+        case IoOp::CLOSE:
+            e.opcode = IORING_OP_CLOSE;
+            break;
+        }
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    static void fromStatx(const struct statx &x, struct stat &st) {
+        memset(&st, 0, sizeof(st));
+        st.st_dev = makedev(x.stx_dev_major, x.stx_dev_minor);
+        st.st_ino = x.stx_ino;
+        st.st_mode = x.stx_mode;
+        st.st_nlink = x.stx_nlink;
+        st.st_uid = x.stx_uid;
+        st.st_gid = x.stx_gid;
+        st.st_rdev = makedev(x.stx_rdev_major, x.stx_rdev_minor);
+        st.st_size = (off_t)x.stx_size;
+        st.st_blksize = x.stx_blksize;
+        st.st_blocks = (blkcnt_t)x.stx_blocks;
+        st.st_atim.tv_sec = x.stx_atime.tv_sec;
+        st.st_atim.tv_nsec = x.stx_atime.tv_nsec;
+        st.st_mtim.tv_sec = x.stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+        st.st_ctim.tv_sec = x.stx_ctime.tv_sec;
+        st.st_ctim.tv_nsec = x.stx_ctime.tv_nsec;
+    }
+};
+#endif
+
+class IoBatch {
+public:
+    size_t stat(int dirfd, const char *path, struct stat *st, bool follow) {
+        return push(IoOp::STAT, dirfd, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, 0, NULL, 0, 0, st);
+    }
+    size_t open(int dirfd, const char *path, int flags, mode_t mode = 0) {
+        return push(IoOp::OPEN, dirfd, path, flags | O_CLOEXEC, mode, NULL, 0, 0, NULL);
+    }
+    size_t read(int fd, char *buf, size_t len, int64_t offset) {
+        return push(IoOp::READ, fd, NULL, 0, 0, buf, len, offset, NULL);
+    }
+    size_t write(int fd, const char *buf, size_t len, int64_t offset) {
+        return push(IoOp::WRITE, fd, NULL, 0, 0, (char *)buf, len, offset, NULL);
+    }
+    size_t close(int fd) {
+        return push(IoOp::CLOSE, fd, NULL, 0, 0, NULL, 0, 0, NULL);
+    }
+
+    size_t size() const { return ops.size(); }
+    long result(size_t i) const { return ops[i].result; }
+    void clear() { ops.clear(); }
+
+    void run() {
+        if (ops.empty()) return;
+        countOps();
+#ifdef FE_HAVE_IO_URING
+        IoRing *ring = ops.size() > 1 ? IoRing::forThread() : NULL;
+        if (ring) {
+            ring->run(ops.data(), ops.size());
+            // Kernels without a given opcode answer -EINVAL; redo those directly,
+            // and the ones a failed ring never submitted
+            for (IoOp &op : ops)
+                if (op.result == -EINVAL || op.result == -EOPNOTSUPP ||
+                    op.result == IoRing::PENDING)
+                    runSync(op);
+            countBytes();
+            return;
+        }
+#endif
+        for (IoOp &op : ops) runSync(op);
+        countBytes();
+    }
+
+    // True when batches really overlap rather than running one call at a time
+    static bool async() {
+#ifdef FE_HAVE_IO_URING
+        return IoRing::forThread() != NULL;
+#else
+        return false;
+#endif
+    }
+
+private:
+    vector<IoOp> ops;
+
+    void countOps() const {
+        uint64_t n[5] = {};
+        for (const IoOp &op : ops) ++n[op.kind];
+        perf::count(perf::STATS, n[IoOp::STAT]);
+        perf::count(perf::OPENS, n[IoOp::OPEN]);
+        perf::count(perf::READS, n[IoOp::READ]);
+        perf::count(perf::WRITES, n[IoOp::WRITE]);
+    }
+
+    void countBytes() const {
+        uint64_t in = 0, out = 0;
+        for (const IoOp &op : ops) {
+            if (op.result <= 0) continue;
+            if (op.kind == IoOp::READ) in += (uint64_t)op.result;
+            if (op.kind == IoOp::WRITE) out += (uint64_t)op.result;
+        }
+        perf::count(perf::BYTES_READ, in);
+        perf::count(perf::BYTES_WRITTEN, out);
+    }
+
+    size_t push(IoOp::Kind kind, int fd, const char *path, int flags, mode_t mode,
+                char *buf, size_t len, int64_t offset, struct stat *st) {
+        IoOp op = { kind, fd, path, flags, mode, buf, len, offset, st, 0 };
+        ops.push_back(op);
+        return ops.size() - 1;
+    }
+
+    static void runSync(IoOp &op) {
+        long r = 0;
+        switch (op.kind) {
+        case IoOp::STAT:  r = fstatat(op.fd, op.path, op.st, op.flags); break;
+        case IoOp::OPEN:  r = openat(op.fd, op.path, op.flags, op.mode); break;
+        case IoOp::READ:  r = pread(op.fd, op.buf, op.len, (off_t)op.offset); break;
+        case IoOp::WRITE: r = pwrite(op.fd, op.buf, op.len, (off_t)op.offset); break;
+        case IoOp::CLOSE: r = ::close(op.fd); break;
+        }
+        op.result = r < 0 ? -errno : r;
+    }
+};
+#endif
+
+/*-------------------------------------------------------------
+    Directory reader returning entries in large batches
+    On Linux it calls getdents64 with a 1 MiB buffer, so a
+    directory with millions of entries needs a few hundred
+    syscalls instead of one libc refill per 32 KiB. Elsewhere it
+    wraps readdir. The buffer is allocated on the first open and
+    never cleared; walks that read one directory after another use
+    SMALL_BUFFER, since most directories fit in a fraction of it.
+-------------------------------------------------------------*/
+class DirStream {
+public:
+    static const size_t SMALL_BUFFER = 64 << 10;
+
+    // 'bufferSize' is the getdents batch; callers that keep many streams use less
+    explicit DirStream(size_t bufferSize = 1 << 20) : bufSize(bufferSize) {}
+    ~DirStream() { close(); }
+
+    bool open(const string &path) {
+        close();
+        dirPath = path;
+        perf::count(perf::DIR_OPENS);
+#if defined(__linux__) && defined(SYS_getdents64)
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        if (!buf) buf.reset(new char[bufSize]);
+        return true;
+#else
+        dir = opendir(path.c_str());
+        return dir != NULL;
+#endif
+    }
+
+    void close() {
+#if defined(__linux__) && defined(SYS_getdents64)
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#else
+        if (dir) closedir(dir);
+        dir = NULL;
+#endif
+    }
+
+    // Stat an entry of this directory; 'follow' resolves symlinks like 'ls'
+    bool statName(const char *name, struct stat &st, bool follow) const {
+        perf::count(perf::STATS);
+#if defined(__linux__) && defined(SYS_getdents64)
+        return fstatat(fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+#elif defined(_WIN32)
+        (void)follow;
+        return stat((dirPath + PATH_SEP + name).c_str(), &st) == 0;
+#else
+        return fstatat(dirfd(dir), name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+#endif
+    }
+
+    // Like nextBatch(), but every entry is also stat'ed in one IoBatch
+    // (following symlinks unless 'follow' is false): fn(name, type, st),
+    // st NULL if the stat failed
+    template <class Fn>
+    bool nextStatBatch(Fn fn, bool follow = true) {
+        names.clear();
+        offsets.clear();
+        types.clear();
+        if (!nextBatch([this](const char *name, EntryType type) {
+            offsets.push_back(names.size());
+            names.append(name, strlen(name) + 1);
+            types.push_back(type);
+        }))
+            return false;
+
+        size_t n = types.size();
+        sts.resize(n);
+        lsts.resize(n);
+        found.assign(n, 0);
+        perf::Scope timing(perf::PH_STAT);
+#ifdef _WIN32
+        for (size_t i = 0; i < n; ++i) found[i] = statName(names.data() + offsets[i], sts[i], follow);
+#else
+        int dfd = dirFd();
+        IoBatch batch;
+        for (size_t i = 0; i < n; ++i) batch.stat(dfd, names.data() + offsets[i], &sts[i], follow);
+        vector<size_t> unknown;
+        for (size_t i = 0; i < n; ++i)
+            if (types[i] == ENTRY_UNKNOWN && follow) {
+                unknown.push_back(i);
+                batch.stat(dfd, names.data() + offsets[i], &lsts[i], false);
+            }
+        batch.run();
+        for (size_t i = 0; i < n; ++i) found[i] = batch.result(i) == 0;
+        for (size_t k = 0; k < unknown.size(); ++k)
+            if (batch.result(n + k) == 0) types[unknown[k]] = typeFromMode(lsts[unknown[k]].st_mode);
+        if (!follow)
+            for (size_t i = 0; i < n; ++i)
+                if (found[i]) types[i] = typeFromMode(sts[i].st_mode);
+#endif
+        for (size_t i = 0; i < n; ++i)
+            fn(names.data() + offsets[i], types[i], found[i] ? &sts[i] : NULL);
+        return true;
+    }
+
+    // Call fn(name, type) for the next batch of entries; false once exhausted
+    template <class Fn>
+    bool nextBatch(Fn fn) {
+        perf::count(perf::DIR_READS);
+#if defined(__linux__) && defined(SYS_getdents64)
+        long n;
+        {
+            perf::Scope timing(perf::PH_READDIR);
+            n = syscall(SYS_getdents64, fd, buf.get(), bufSize);
+        }
+        if (n <= 0) return false;
+        for (long off = 0; off < n;) {
+            const RawDirent *d = (const RawDirent *)(buf.get() + off);
+            off += d->reclen;
+            if (isDots(d->name)) continue;
+            fn(d->name, typeFromDirent(d->type));
+        }
+        return true;
+#else
+        struct dirent *entry;
+        int count = 0;
+        while (count < 4096 && (entry = readdir(dir)) != NULL) {
+            if (isDots(entry->d_name)) continue;
+            EntryType type = ENTRY_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+            type = typeFromDirent(entry->d_type);
+#endif
+            fn(entry->d_name, type);
+            ++count;
+        }
+        return count > 0;
+#endif
+    }
+
+private:
+    size_t bufSize;
+    string dirPath;
+    string names;               // scratch for nextStatBatch()
+    vector<size_t> offsets;
+    vector<EntryType> types;
+    vector<struct stat> sts, lsts;
+    vector<char> found;
+
+#ifndef _WIN32
+    int dirFd() const {
+#if defined(__linux__) && defined(SYS_getdents64)
+        return fd;
+#else
+        return dirfd(dir);
+#endif
+    }
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    struct RawDirent {
+        uint64_t ino;
+        int64_t off;
+        unsigned short reclen;
+        unsigned char type;
+        char name[1];
+    };
+    int fd = -1;
+    unique_ptr<char[]> buf;
+#else
+    DIR *dir = NULL;
+#endif
+
+    static bool isDots(const char *n) {
+        return n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'));
+    }
+};
+
+/*-------------------------------------------------------------
+    Directory read-ahead for traversals
+    On a cold cache a walk spends most of its time waiting on
+    metadata misses, and the pool has only so many workers to
+    wait with. Each directory a walk discovers is also hinted
+    here; helper threads open and read it (and stat its entries
+    through an IoBatch, so through io_uring where it works) to
+    pull it into the kernel's caches before a worker gets there.
+    Hints are taken newest first: on a depth-first worker those
+    are the siblings it visits right after the current subtree.
+    A hint whose directory the walk has opened meanwhile is
+    dropped unread.
+    The number of helpers at work adapts to the latency they see
+    opening a directory and reading its first batch. Every
+    PREFETCH_EPOCH reads the window moves one step, and keeps
+    its direction while latency over helpers in flight (the time
+    per directory) goes down; a device that only queues more
+    requests up makes it turn back. It also shrinks while the walk
+    reaches most hinted directories first. Once reads look cached
+    a single helper takes one hint in PREFETCH_SAMPLE, enough to
+    notice the walk entering an uncached part of the tree. On
+    Linux a read counts as a miss if the helper blocked during it
+    (a voluntary context switch), which holds up on a busy CPU
+    where latency alone would not; elsewhere a miss is a read
+    slower than PREFETCH_WARM_US.
+-------------------------------------------------------------*/
+const unsigned PREFETCH_HELPERS = 16;           // most helpers at work at once
+const size_t PREFETCH_QUEUE = 4096;             // hints kept; the oldest are dropped
+const unsigned PREFETCH_EPOCH = 32;
+const double PREFETCH_WARM_US = 8;
+const unsigned PREFETCH_SAMPLE = 16;
+
+class Prefetcher {
+public:
+    static Prefetcher &instance() {
+        static Prefetcher p;
+        return p;
+    }
+
+    ~Prefetcher() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : helpers) t.join();
+    }
+
+    void hint(const string &dir, bool stat, shared_ptr<const atomic<bool>> reached) {
+        if (!enabled) return;
+        if (warm && ++sampler % PREFETCH_SAMPLE != 0) return;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (queue.size() >= PREFETCH_QUEUE) {
+                queue.pop_front();
+                ++dropped;
+            }
+            queue.push_back(Hint{ dir, stat, move(reached) });
+            if (helpers.size() < limit && helpers.size() <= active)
+                helpers.emplace_back(&Prefetcher::run, this);
+        }
+        cv.notify_one();
+    }
+
+    void setEnabled(bool on) {
+        enabled = on;
+        if (on) return;
+        lock_guard<mutex> lock(mtx);
+        queue.clear();
+    }
+
+    void report() {
+        lock_guard<mutex> lock(mtx);
+        char line[200];
+        snprintf(line, sizeof(line),
+                 "Prefetch: %s, %u of %u helpers, read latency %.0f us, %.0f%% misses%s\n"
+                 "  %lld directories read ahead, %lld reached first, %lld dropped\n",
+                 enabled ? "on" : "off", limit, PREFETCH_HELPERS, latency, misses * 100,
+                 warm ? " (cached, sampling)" : "", done, skipped, dropped);
+        cout << line;
+    }
+
+private:
+    struct Hint {
+        string dir;
+        bool stat;
+        shared_ptr<const atomic<bool>> reached;     // NULL: always read
+    };
+
+    mutex mtx;
+    condition_variable cv;
+    deque<Hint> queue;
+    vector<thread> helpers;
+    unsigned active = 0, limit = 2;
+    int step = 1;
+    double latency = 0;         // moving average, microseconds
+    double misses = 1;          // moving average of the share of reads that missed
+    double lastCost = 0;        // microseconds per directory in the last epoch
+    unsigned epochReads = 0, epochSkipped = 0;
+    double epochLatency = 0, epochInFlight = 0;
+    long long done = 0, skipped = 0, dropped = 0;
+    bool stopping = false;
+    atomic<bool> enabled{true}, warm{false};
+    atomic<unsigned> sampler{0};
+
+    Prefetcher() {}
+
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [&] { return stopping || (!queue.empty() && active < limit); });
+            if (stopping) return;
+            Hint h = move(queue.back());
+            queue.pop_back();
+            if (h.reached && h.reached->load()) {
+                ++skipped;
+                ++epochSkipped;
+                continue;
+            }
+            unsigned inFlight = ++active;
+            lock.unlock();
+            bool missed = false;
+            double us = read(h, missed);
+            lock.lock();
+            --active;
+            if (us >= 0) adapt(us, missed, inFlight);
+        }
+    }
+
+    // Times this thread gave up the CPU waiting, or -1 if unknown
+    static long waits() {
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+        struct rusage ru;
+        if (getrusage(RUSAGE_THREAD, &ru) == 0) return ru.ru_nvcsw;
+#endif
+        return -1;
+    }
+
+    // Pull one directory into the caches; returns the latency of opening
+    // it and reading its first batch, or -1. The stats are a second pass
+    // (over a now cached directory) so they stay out of the measurement.
+    static double read(const Hint &h, bool &missed) {
+        long before = waits();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        DirStream ds(DirStream::SMALL_BUFFER);
+        if (!ds.open(h.dir)) return -1;
+        bool more = ds.nextBatch([](const char *, EntryType) {});
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        missed = before < 0 ? us > PREFETCH_WARM_US : waits() != before;
+        while (more) more = ds.nextBatch([](const char *, EntryType) {});
+        if (h.stat && ds.open(h.dir))
+            while (ds.nextStatBatch([](const char *, EntryType, const struct stat *) {}, false)) {
+            }
+        return us;
+    }
+
+    // Called with the lock held after every directory read
+    void adapt(double us, bool missed, unsigned inFlight) {
+        ++done;
+        latency = done == 1 ? us : latency * 0.75 + us * 0.25;
+        misses = misses * 0.875 + (missed ? 0.125 : 0);
+        if (misses < 0.125) {
+            warm = true;
+            limit = 1;
+            step = 1;
+            lastCost = 0;
+            epochReads = epochSkipped = 0;
+            epochLatency = epochInFlight = 0;
+            return;
+        }
+        warm = false;
+
+        ++epochReads;
+        epochLatency += us;
+        epochInFlight += inFlight;
+        if (epochReads < PREFETCH_EPOCH) return;
+
+        double cost = epochLatency / epochInFlight;
+        if (epochSkipped > epochReads) step = -1;
+        else if (lastCost > 0 && cost > lastCost * 0.95) step = -step;
+        if (step > 0 && queue.size() <= active) step = 0;   // nothing waiting for more helpers
+        limit = (unsigned)max(1, min((int)PREFETCH_HELPERS, (int)limit + step));
+        if (step == 0) step = 1;
+        lastCost = cost;
+        epochReads = epochSkipped = 0;
+        epochLatency = epochInFlight = 0;
+
+        if (helpers.size() < limit) helpers.emplace_back(&Prefetcher::run, this);
+        cv.notify_all();
+    }
+};
+
+void prefetchDir(const string &dir, bool stat, shared_ptr<const atomic<bool>> reached) {
+    Prefetcher::instance().hint(dir, stat, move(reached));
+}
+
+/*-------------------------------------------------------------
+    Cached listing of one directory
+    Stored as parallel columns: all names in one arena, then one
+    array per field. Size and mtime columns are filled only when a
+    caller needed stat results; 'search' and completion are fine
+    with names and types. A size of -1 means stat failed.
+-------------------------------------------------------------*/
+struct DirListing {
+    static const uint8_t SHOWS_AS_DIR = 0x80;     // target is a directory
+
+    string arena;
+    vector<uint32_t> nameAt;
+    vector<uint8_t> kind;       // EntryType of the entry itself | SHOWS_AS_DIR
+    vector<int64_t> sizes, mtimes;
+    bool statted = false;
+    bool racy = false;          // directory changed in the second it was read
+
+    size_t count() const { return nameAt.size(); }
+    const char *name(size_t i) const { return arena.data() + nameAt[i]; }
+    EntryType type(size_t i) const { return (EntryType)(kind[i] & ~SHOWS_AS_DIR); }
+    bool showsAsDir(size_t i) const { return (kind[i] & SHOWS_AS_DIR) != 0; }
+
+    void add(const char *n, EntryType type, const struct stat *st) {
+        nameAt.push_back((uint32_t)arena.size());
+        arena.append(n, strlen(n) + 1);
+        uint8_t k = (uint8_t)type;
+        if (st && S_ISDIR(st->st_mode)) k |= SHOWS_AS_DIR;
+        else if (!st && type == ENTRY_DIR) k |= SHOWS_AS_DIR;
+        kind.push_back(k);
+        if (statted) {
+            sizes.push_back(st ? (int64_t)st->st_size : -1);
+            mtimes.push_back(st ? mtimeNs(*st) : 0);
+        }
+    }
+
+    size_t bytes() const {
+        return sizeof(*this) + 64 + arena.capacity() + nameAt.capacity() * 4 +
+               kind.capacity() + (sizes.capacity() + mtimes.capacity()) * 8;
+    }
+};
+
+/*-------------------------------------------------------------
+    In-process directory cache shared by ls, search and completion
+    Keyed on the directory's (dev, ino), so different spellings of
+    a path share one entry. A lookup costs one stat: the listing is
+    reused while the directory's mtime and ctime are unchanged.
+    That catches entries being added, removed or renamed, but not
+    a file inside growing, so commands here that rewrite a file in
+    place call forgetParent(). A listing read in the same second
+    its directory last changed is not trusted on the next lookup
+    (coarse timestamps could hide a second change). Least recently
+    used entries are dropped once the memory budget is exceeded.
+-------------------------------------------------------------*/
+struct DirKey {
+    FileId id;
+    int64_t mtime, ctime;
+};
+
+class DirCache {
+public:
+    static DirCache &instance() {
+        static DirCache cache;
+        return cache;
+    }
+
+    // Stat 'path' and fill in its cache key; false if it is not a directory
+    static bool probe(const string &path, DirKey &key) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            return false;
+        }
+#ifdef _WIN32
+        // st_ino is always 0 here; the absolute path stands in for it
+        char full[MAX_PATH];
+        if (!_fullpath(full, path.c_str(), MAX_PATH)) return false;
+        key.id.ino = hash<string>()(full);
+#else
+        key.id.ino = (uint64_t)st.st_ino;
+#endif
+        key.id.dev = (uint64_t)st.st_dev;
+        key.mtime = mtimeNs(st);
+        key.ctime = ctimeNs(st);
+        return true;
+    }
+
+    shared_ptr<const DirListing> find(const DirKey &key, bool needStat) {
+        lock_guard<mutex> lock(mtx);
+        auto it = slots.find(key.id);
+        if (it == slots.end()) {
+            ++misses;
+            return NULL;
+        }
+        Slot &s = it->second;
+        if (s.mtime != key.mtime || s.ctime != key.ctime || s.listing->racy) {
+            dropLocked(it);
+            ++misses;
+            return NULL;
+        }
+        if (needStat && !s.listing->statted) {
+            ++misses;
+            return NULL;
+        }
+        order.splice(order.begin(), order, s.pos);
+        ++hits;
+        return s.listing;
+    }
+
+    // 'readStart' is the wall-clock second the directory read began
+    void store(const DirKey &key, shared_ptr<DirListing> listing, time_t readStart) {
+        listing->racy = key.mtime / 1000000000LL >= (int64_t)readStart;
+        size_t size = listing->bytes();
+
+        lock_guard<mutex> lock(mtx);
+        auto old = slots.find(key.id);
+        if (old != slots.end()) dropLocked(old);
+        if (size > budget) return;
+
+        order.push_front(key.id);
+        Slot s = { listing, order.begin(), key.mtime, key.ctime, size };
+        slots[key.id] = s;
+        used += size;
+        while (used > budget && !order.empty()) {
+            ++evictions;
+            dropLocked(slots.find(order.back()));
+        }
+    }
+
+    // Cached listing of 'path', read from disk on a miss; NULL with errno on error
+    shared_ptr<const DirListing> get(const string &path, bool needStat) {
+        DirKey key;
+        if (!probe(path, key)) return NULL;
+        shared_ptr<const DirListing> hit = find(key, needStat);
+        if (hit) return hit;
+
+        time_t start = time(NULL);
+        DirStream ds(DirStream::SMALL_BUFFER);
+        if (!ds.open(path)) return NULL;
+
+        shared_ptr<DirListing> l = make_shared<DirListing>();
+        l->statted = needStat;
+        if (needStat) {
+            while (ds.nextStatBatch([&](const char *name, EntryType type, const struct stat *st) {
+                l->add(name, type, st);
+            })) {
+            }
+        } else {
+            while (ds.nextBatch([&](const char *name, EntryType type) {
+                struct stat st;
+                if (type == ENTRY_UNKNOWN && ds.statName(name, st, false))
+                    type = typeFromMode(st.st_mode);
+                l->add(name, type, NULL);
+            })) {
+            }
+        }
+        store(key, l, start);
+        return l;
+    }
+
+    void forget(const string &dir) {
+        DirKey key;
+        if (!probe(dir, key)) return;
+        lock_guard<mutex> lock(mtx);
+        auto it = slots.find(key.id);
+        if (it != slots.end()) dropLocked(it);
+    }
+
+    // Drop the cached listing of the directory holding 'path'
+    void forgetParent(const string &path) {
+        size_t slash = path.find_last_of("/\\");
+        if (slash == string::npos) forget(".");
+        else forget(slash == 0 ? path.substr(0, 1) : path.substr(0, slash));
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(mtx);
+        slots.clear();
+        order.clear();
+        used = 0;
+    }
+
+    void setBudget(size_t bytes) {
+        lock_guard<mutex> lock(mtx);
+        budget = bytes;
+        while (used > budget && !order.empty()) {
+            ++evictions;
+            dropLocked(slots.find(order.back()));
+        }
+    }
+
+    void report() {
+        lock_guard<mutex> lock(mtx);
+        size_t entries = 0;
+        for (const auto &kv : slots) entries += kv.second.listing->count();
+        cout << "Directory cache: " << slots.size() << " directories, " << entries
+             << " entries, " << used << " of " << budget << " bytes\n"
+             << "  " << hits << " hits, " << misses << " misses, "
+             << evictions << " evictions\n";
+    }
+
+private:
+    struct Slot {
+        shared_ptr<DirListing> listing;
+        list<FileId>::iterator pos;
+        int64_t mtime, ctime;
+        size_t size;
+    };
+
+    mutex mtx;
+    unordered_map<FileId, Slot, FileIdHash> slots;
+    list<FileId> order;         // most recently used first
+    size_t used = 0, budget = 64 << 20;
+    long long hits = 0, misses = 0, evictions = 0;
+
+    void dropLocked(unordered_map<FileId, Slot, FileIdHash>::iterator it) {
+        used -= it->second.size;
+        order.erase(it->second.pos);
+        slots.erase(it);
+    }
+};
+
+/*-------------------------------------------------------------
+    Options for the plain (non-recursive) 'ls'
+-------------------------------------------------------------*/
+enum ListSort { SORT_NONE, SORT_NAME, SORT_SIZE, SORT_MTIME };
+
+struct ListOptions {
+    size_t limit = 0;       // 0 = no limit
+    size_t page = 0;        // lines per page, 0 = no paging
+    ListSort sort = SORT_NONE;
+    size_t memory = 0;      // --mem: sort within this much memory, 0 = all in memory
+};
+
+/*-------------------------------------------------------------
+    Pause between pages when a person is reading (stdin is a tty)
+    Returns false if the user asked to stop.
+-------------------------------------------------------------*/
+bool nextPage(OutputWriter &w, size_t shown) {
+    w.put("-- ");
+    w.putNum((long long)shown);
+    w.put(" entries so far --\n");
+    w.flush();
+    if (!isatty(0)) return true;
+
+    cout << "-- more (Enter to continue, q to stop) -- " << flush;
+    string answer;
+    if (!getline(cin, answer)) return false;
+    return answer.empty() || (answer[0] != 'q' && answer[0] != 'Q');
+}
+
+/*-------------------------------------------------------------
+    List all files and folders in a directory
+    A fresh listing in the directory cache is printed without
+    touching the entries. Otherwise unsorted listings stream:
+    each getdents batch is stat'ed and written straight out, and
+    --limit stops reading early. Sorted listings collect columns
+    in a DirListing, and with --limit only the top k are ordered
+    (partial_sort). A complete read is kept in the cache. With
+    --mem an uncached listing streams into an ExternalSorter
+    instead and is not cached, so a directory of any size sorts
+    within the cap.
+-------------------------------------------------------------*/
+void listFiles(const string &path = ".", const ListOptions &opts = ListOptions()) {
+    DirCache &cache = DirCache::instance();
+    DirKey key;
+    if (!DirCache::probe(path, key)) {
+        printError("ls");
+        return;
+    }
+
+    shared_ptr<const DirListing> cached = cache.find(key, true);
+    shared_ptr<DirListing> fresh;
+    DirStream ds;
+    time_t readStart = time(NULL);
+    if (!cached && !ds.open(path)) {
+        printError("ls");
+        return;
+    }
+
+    OutputWriter w;
+    w.put("Contents of ");
+    w.put(path);
+    w.put(":\n");
+
+    size_t shown = 0, sinceBreak = 0;
+    bool stop = false;
+
+    if (!cached) {
+        fresh = make_shared<DirListing>();
+        fresh->statted = true;
+    }
+
+    if (!cached && opts.sort == SORT_NONE) {
+        while (!stop && ds.nextStatBatch([&](const char *name, EntryType type,
+                                             const struct stat *st) {
+            if (stop) return;
+            fresh->add(name, type, st);
+            if (!st) return;
+
+            w.putEntry(S_ISDIR(st->st_mode), name, (long long)st->st_size);
+            ++shown;
+            if (opts.limit && shown >= opts.limit) stop = true;
+            if (opts.page && ++sinceBreak >= opts.page && !stop) {
+                sinceBreak = 0;
+                if (!nextPage(w, shown)) stop = true;
+            }
+        })) {
+            w.flush();      // stream each batch as soon as it is formatted
+        }
+        if (!stop) cache.store(key, fresh, readStart);
+    } else if (!cached && opts.memory) {
+        // Record: sort key (big-endian, so bytes compare like numbers), name,
+        // NUL, then the dir flag and the size for printing
+        ExternalSorter sorter(opts.memory);
+        ListSort by = opts.sort;
+        string rec;
+        while (ds.nextStatBatch([&](const char *name, EntryType, const struct stat *st) {
+            if (!st) return;
+            rec.clear();
+            if (by != SORT_NAME) {
+                uint64_t k = (by == SORT_SIZE) ? (uint64_t)st->st_size
+                                               : (uint64_t)mtimeNs(*st) ^ (1ULL << 63);
+                k = ~k;     // largest / newest first
+                for (int b = 56; b >= 0; b -= 8) rec += (char)(k >> b);
+            }
+            rec += name;
+            rec += '\0';
+            rec += S_ISDIR(st->st_mode) ? '1' : '0';
+            long long size = (long long)st->st_size;
+            rec.append((const char *)&size, sizeof(size));
+            sorter.add(rec.data(), rec.size());
+        })) {
+        }
+
+        size_t skip = (by == SORT_NAME) ? 0 : 8;
+        bool ok = sorter.merge([&](const char *p, size_t n) {
+            const char *name = p + skip;
+            size_t len = strlen(name);
+            long long size;
+            memcpy(&size, p + n - sizeof(size), sizeof(size));
+            w.putEntry(name[len + 1] == '1', name, size);
+            ++shown;
+            if (opts.limit && shown >= opts.limit) return false;
+            if (opts.page && ++sinceBreak >= opts.page && shown < sorter.count()) {
+                sinceBreak = 0;
+                if (!nextPage(w, shown)) return false;
+            }
+            return true;
+        });
+        if (!ok) cerr << "ls: could not write or read back a temporary sort run\n";
+        if (shown < sorter.count()) {
+            w.put("-- ");
+            w.putNum((long long)shown);
+            w.put(" of ");
+            w.putNum((long long)sorter.count());
+            w.put(" entries shown --\n");
+        }
+    } else {
+        if (!cached) {
+            while (ds.nextStatBatch([&](const char *name, EntryType type,
+                                        const struct stat *st) {
+                fresh->add(name, type, st);
+            })) {
+            }
+            cache.store(key, fresh, readStart);
+        }
+        const DirListing &l = cached ? *cached : *fresh;
+
+        vector<uint32_t> order;
+        order.reserve(l.count());
+        for (size_t i = 0; i < l.count(); ++i)
+            if (l.sizes[i] >= 0) order.push_back((uint32_t)i);
+
+        ListSort by = opts.sort;
+        auto less = [&l, by](uint32_t a, uint32_t b) {
+            switch (by) {
+            case SORT_SIZE:
+                if (l.sizes[a] != l.sizes[b]) return l.sizes[a] > l.sizes[b];
+                break;
+            case SORT_MTIME:
+                if (l.mtimes[a] != l.mtimes[b]) return l.mtimes[a] > l.mtimes[b];
+                break;
+            default:
+                break;
+            }
+            return strcmp(l.name(a), l.name(b)) < 0;
+        };
+
+        size_t count = order.size();
+        if (by != SORT_NONE) {
+            if (opts.limit && opts.limit < count)
+                partial_sort(order.begin(), order.begin() + opts.limit, order.end(), less);
+            else
+                sort(order.begin(), order.end(), less);
+        }
+        if (opts.limit && opts.limit < count) count = opts.limit;
+
+        for (size_t i = 0; i < count && !stop; ++i) {
+            uint32_t e = order[i];
+            w.putEntry(l.showsAsDir(e), l.name(e), (long long)l.sizes[e]);
+            ++shown;
+            if (opts.page && ++sinceBreak >= opts.page && i + 1 < count) {
+                sinceBreak = 0;
+                if (!nextPage(w, shown)) stop = true;
+            }
+        }
+        if (by != SORT_NONE && count < order.size()) {
+            w.put("-- ");
+            w.putNum((long long)count);
+            w.put(" of ");
+            w.putNum((long long)order.size());
+            w.put(" entries shown --\n");
+        }
+    }
+
+    w.flush();
+    perf::count(perf::ENTRIES, shown);
+    logAction("Listed contents of: " + path);
+}
+
+/*-------------------------------------------------------------
+    List a directory and all of its subdirectories (ls -R)
+    Each directory is printed as one block once it has been read;
+    'ordered' prints the blocks in walk order instead.
+-------------------------------------------------------------*/
+void listRecursive(const string &path = ".", bool ordered = false) {
+    if (!isDirectory(path)) {
+        listFiles(path);
+        return;
+    }
+
+    struct Lister : WalkPolicy<WALK_STAT> {
+        static string &block() {
+            static thread_local string b;
+            return b;
+        }
+        void enterDir(const string &dir, int) const {
+            block() = "Contents of " + dir + ":\n";
+        }
+        bool entry(const WalkEntry &e) const {
+            if (e.st) formatEntry(*e.st, e.name, block());
+            return true;
+        }
+        void leaveDir(const string &, int) const {
+            block() += '\n';
+            output->put(walkSlot(), block());
+        }
+        void error(const string &dir, int err) const {
+            lock_guard<mutex> lock(consoleMutex);
+            cerr << "ls: " << dir << ": " << strerror(err) << "\n";
+        }
+    };
+
+    ResultWriter out(ordered);
+    Lister v;
+    v.output = &out;
+    walkTree(path, v);
+    out.finish();
+    logAction("Listed contents of: " + path + " (recursive)");
+}
+
+/*-------------------------------------------------------------
+    Absolute form of a path that may not exist (yet / any more)
+    Only the parent is resolved, so a symlink names itself rather
+    than its target.
+-------------------------------------------------------------*/
+string absolutePath(const string &path) {
+    char buf[4096];
+#ifdef _WIN32
+    if (_fullpath(buf, path.c_str(), sizeof(buf))) return buf;
+    return path;
+#else
+    string p = path;
+    while (p.size() > 1 && p.back() == PATH_SEP) p.pop_back();
+    size_t cut = p.find_last_of(PATH_SEP);
+    string parent = (cut == string::npos) ? "." : (cut == 0 ? "/" : p.substr(0, cut));
+    string name = (cut == string::npos) ? p : p.substr(cut + 1);
+
+    if (name.empty() || name == "." || name == "..")
+        return realpath(p.c_str(), buf) ? string(buf) : path;
+    if (!realpath(parent.c_str(), buf)) return path;
+
+    string abs = buf;
+    if (abs.back() != PATH_SEP) abs += PATH_SEP;
+    return abs + name;
+#endif
+}
+
+/*-------------------------------------------------------------
+    Shared working directory (server mode)
+    The process has one working directory but a server serves
+    clients started in different ones. A session enters the gate
+    with its client's directory for as long as it runs; sessions
+    in the same directory run side by side, one in another
+    directory waits until the current ones have left (and holds
+    back newcomers meanwhile) and then moves the process there.
+-------------------------------------------------------------*/
+class CwdGate {
+public:
+    static CwdGate &instance() {
+        static CwdGate gate;
+        return gate;
+    }
+
+    // Wait until the process can be in 'dir' (absolute) and stay there
+    bool enter(const string &dir) {
+        unique_lock<mutex> lock(mtx);
+        auto admit = [&] {
+            if (active == 0) return true;
+            auto it = waiting.find(current);
+            return dir == current && waiters == (it == waiting.end() ? 0 : it->second);
+        };
+        if (!admit()) {
+            ++waiters;
+            ++waiting[dir];
+            cv.wait(lock, admit);
+            --waiters;
+            if (--waiting[dir] == 0) waiting.erase(dir);
+        }
+        if (dir != current) {
+            if (chdir(dir.c_str()) != 0) {
+                int err = errno;
+                if (active == 0) cv.notify_all();
+                errno = err;
+                return false;
+            }
+            current = dir;
+            cv.notify_all();        // others bound for the same directory may join
+        }
+        ++active;
+        session() = &current;
+        return true;
+    }
+
+    void leave() {
+        session() = NULL;
+        lock_guard<mutex> lock(mtx);
+        if (--active == 0) cv.notify_all();
+    }
+
+    // Directory of the session running on this thread, NULL outside one
+    // (while a session is inside, the process stays in that directory)
+    static const string *inside() { return session(); }
+
+    // 'cd' within a session: leave and enter again elsewhere
+    bool move(const string &path) {
+        string from = *session();
+        string to = absolutePath(path);
+        if (!isDirectory(to)) {
+            errno = ENOENT;
+            return false;
+        }
+        leave();
+        if (enter(to)) return true;
+        int err = errno;
+        enter(from);
+        errno = err;
+        return false;
+    }
+
+private:
+    mutex mtx;
+    condition_variable cv;
+    string current;
+    int active = 0, waiters = 0;
+    unordered_map<string, int> waiting;     // waiters by directory
+
+    static string *&session() {
+        static thread_local string *s = NULL;
+        return s;
+    }
+};
+
+/*-------------------------------------------------------------
+    Change current working directory
+-------------------------------------------------------------*/
+void changeDir(const string &path) {
+    if (CwdGate::inside()) {
+        if (CwdGate::instance().move(path)) {
+            cout << "Changed directory to: " << path << endl;
+            logAction("Changed directory to: " + path);
+        } else {
+            printError("cd");
+        }
+        return;
+    }
+    if (chdir(path.c_str()) == 0) {
+        cout << "Changed directory to: " << path << endl;
+        logAction("Changed directory to: " + path);
+    } else {
+        printError("cd");
+    }
+}
+
+
+
+
+
+/*-------------------------------------------------------------
+    Print current working directory path
+-------------------------------------------------------------*/
+void printPwd() {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)))
+        cout << cwd << endl;
+    else
+        printError("pwd");
+
+    logAction("Checked current directory.");
+}
+
+/*-------------------------------------------------------------
+    Read-only memory mapping of a whole file
+-------------------------------------------------------------*/
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+
+    bool open(const string &path, bool sequential = false) {
+        close();
+#ifdef _WIN32
+        (void)sequential;
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            close();
+            return false;
+        }
+        len = (size_t)size.QuadPart;
+        if (len == 0) return true;
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) ptr = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!ptr) {
+            close();
+            return false;
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+        if (len > 0) {
+            void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                len = 0;
+                return false;
+            }
+            ptr = (const char *)p;
+#ifdef MADV_SEQUENTIAL
+            if (sequential) madvise(p, len, MADV_SEQUENTIAL);
+#endif
+        }
+        ::close(fd);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr) munmap((void *)ptr, len);
+#endif
+        ptr = NULL;
+        len = 0;
+    }
+
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    const char *ptr = NULL;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+/*-------------------------------------------------------------
+    Human-readable size (1023B, 1.5K, 20.0M, ...)
+-------------------------------------------------------------*/
+string humanSize(long long bytes) {
+    const char *units = "BKMGTPE";
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024 && u < 6) {
+        v /= 1024;
+        ++u;
+    }
+    char buf[32];
+    if (u == 0) snprintf(buf, sizeof(buf), "%lldB", bytes);
+    else snprintf(buf, sizeof(buf), "%.1f%c", v, units[u]);
+    return buf;
+}
+
+/*-------------------------------------------------------------
+    Throughput throttle (--bwlimit, --iops-limit)
+    Two token buckets per limited command, shared by every worker
+    doing its copy, rm or grep work (currentThrottle() follows the
+    command into pool tasks), so overlapping commands and sessions
+    each keep their own limits. A caller reserves its bytes and operations
+    before doing the I/O and sleeps off any debt outside the
+    lock, so a limit holds no matter how many threads are busy.
+    Up to THROTTLE_BURST seconds of unused allowance carry over.
+    An operation is a file opened, created or unlinked; loops over
+    a file's data take bytes only (throttle(n, 0)), so a large
+    file costs one operation like a small one.
+    A command without limits has no throttle; throttle() is then
+    one thread-local load.
+-------------------------------------------------------------*/
+const double THROTTLE_BURST = 0.25;
+
+class Throttle {
+public:
+    // Bytes and operations per second; 0 leaves that one unlimited
+    Throttle(double bytesPerSec, double opsPerSec) {
+        bytes.rate = bytesPerSec;
+        ops.rate = opsPerSec;
+    }
+
+    // Block until 'n' bytes and 'k' operations fit under the limits
+    void take(uint64_t n, uint64_t k = 1) {
+        double wait;
+        {
+            lock_guard<mutex> lock(mtx);
+            double now = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            wait = max(bytes.reserve((double)n, now), ops.reserve((double)k, now));
+        }
+        if (wait > 0) this_thread::sleep_for(chrono::duration<double>(wait));
+    }
+
+private:
+    // 'due' is when everything reserved so far has been paid for
+    struct Bucket {
+        double rate = 0, due = 0;
+
+        double reserve(double n, double now) {
+            if (rate <= 0 || n <= 0) return 0;
+            due = max(due, now - THROTTLE_BURST) + n / rate;
+            return due - now;
+        }
+    };
+
+    mutex mtx;
+    Bucket bytes, ops;
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    Throttle(const Throttle &) = delete;
+    Throttle &operator=(const Throttle &) = delete;
+};
+
+inline void throttle(uint64_t bytes, uint64_t ops = 1) {
+    if (Throttle *t = currentThrottle()) t->take(bytes, ops);
+}
+
+/*-------------------------------------------------------------
+    Progress reporting for long-running commands
+    Reads the per-thread perf counters, which the engines update
+    anyway, so reporting adds nothing to the hot paths. A reporter
+    thread redraws one status line on stderr at a fixed rate (a
+    line per second when stderr is not a terminal): bytes and files
+    done, their rates over the last interval, and an ETA once the
+    command has announced its total through plan()/planned().
+-------------------------------------------------------------*/
+const int PROGRESS_TTY_MS = 250;
+const int PROGRESS_LOG_MS = 1000;
+const int PROGRESS_DELAY_MS = 500;     // quick commands never draw anything
+
+class Progress {
+public:
+    // 'bytes' may be COUNTER_COUNT for commands that only count files
+    Progress(const char *label, perf::Counter bytes, perf::Counter items)
+        : name(label), byteCounter(bytes), itemCounter(items) {
+#ifdef _WIN32
+        tty = _isatty(_fileno(stderr)) != 0;
+#else
+        tty = isatty(2) != 0;
+#endif
+        base = perf::Registry::instance().total();
+        current().store(this, memory_order_release);
+        reporter = thread(&Progress::run, this);
+    }
+
+    ~Progress() {
+        current().store(NULL, memory_order_release);
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_one();
+        reporter.join();
+    }
+
+    // Work discovered by the command (no-op when nothing is reporting)
+    static void plan(long long bytes, long long items = 0) {
+        Progress *p = current().load(memory_order_acquire);
+        if (!p) return;
+        p->totalBytes += bytes;
+        p->totalItems += items;
+    }
+
+    // Nothing more will be discovered, so the totals are final
+    static void planned() {
+        Progress *p = current().load(memory_order_acquire);
+        if (p) p->known = true;
+    }
+
+private:
+    const char *name;
+    perf::Counter byteCounter, itemCounter;
+    bool tty = false;
+    perf::Snapshot base;
+    atomic<long long> totalBytes{0}, totalItems{0};
+    atomic<bool> known{false};
+
+    mutex mtx;
+    condition_variable wake;
+    bool stopping = false;
+    thread reporter;
+
+    static atomic<Progress *> &current() {
+        static atomic<Progress *> p{NULL};
+        return p;
+    }
+
+    uint64_t done(const perf::Snapshot &now, perf::Counter c) const {
+        return c == perf::COUNTER_COUNT ? 0 : now.counts[c] - base.counts[c];
+    }
+
+    void run() {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        chrono::steady_clock::time_point last = start;
+        uint64_t lastBytes = 0, lastItems = 0;
+        bool drawn = false;
+        int period = tty ? PROGRESS_TTY_MS : PROGRESS_LOG_MS;
+
+        unique_lock<mutex> lock(mtx);
+        wake.wait_for(lock, chrono::milliseconds(PROGRESS_DELAY_MS), [this] { return stopping; });
+        while (!stopping) {
+            lock.unlock();
+            perf::Snapshot now = perf::Registry::instance().total();
+            chrono::steady_clock::time_point t = chrono::steady_clock::now();
+            double dt = chrono::duration<double>(t - last).count();
+            double elapsed = chrono::duration<double>(t - start).count();
+            uint64_t b = done(now, byteCounter), n = done(now, itemCounter);
+            draw(b, n, dt > 0 ? (b - lastBytes) / dt : 0, dt > 0 ? (n - lastItems) / dt : 0,
+                 elapsed);
+            drawn = true;
+            last = t;
+            lastBytes = b;
+            lastItems = n;
+            lock.lock();
+            wake.wait_for(lock, chrono::milliseconds(period), [this] { return stopping; });
+        }
+
+        if (drawn && tty) {
+            lock_guard<mutex> console(consoleMutex);
+            cerr << "\r\033[K" << flush;
+        }
+    }
+
+    void draw(uint64_t bytes, uint64_t items, double byteRate, double itemRate, double elapsed) {
+        string line = tty ? "\r" : "";
+        line += name;
+        line += ':';
+        char part[96];
+
+        long long total = totalBytes.load();
+        bool byBytes = byteCounter != perf::COUNTER_COUNT;
+        if (byBytes) {
+            line += ' ';
+            line += humanSize((long long)bytes);
+            if (total > 0) {
+                line += " / ";
+                line += humanSize(total);
+                if (!known) line += '+';
+            }
+            snprintf(part, sizeof(part), "  %s/s", humanSize((long long)byteRate).c_str());
+            line += part;
+        }
+        snprintf(part, sizeof(part), "%s%llu files  %.0f files/s", byBytes ? "  " : " ",
+                 (unsigned long long)items, itemRate);
+        line += part;
+
+        // ETA from the average rate, which is steadier than the last interval
+        long long left = byBytes ? total - (long long)bytes : totalItems.load() - (long long)items;
+        double rate = elapsed > 0 ? (byBytes ? bytes : items) / elapsed : 0;
+        if (known && left >= 0 && rate > 0 && (byBytes ? total : totalItems.load()) > 0) {
+            long long eta = (long long)(left / rate + 0.5);
+            snprintf(part, sizeof(part), "  %.0f%%  ETA %lld:%02lld:%02lld",
+                     100.0 * (byBytes ? (double)bytes / total
+                                      : (double)items / totalItems.load()),
+                     eta / 3600, eta / 60 % 60, eta % 60);
+            line += part;
+        }
+        line += tty ? "\033[K" : "\n";
+
+        lock_guard<mutex> console(consoleMutex);
+        cerr << line << flush;
+    }
+
+    Progress(const Progress &) = delete;
+    Progress &operator=(const Progress &) = delete;
+};
+
+/*-------------------------------------------------------------
+    Throttle and progress options of cp, mv, rm, grep and dupes
+      --bwlimit RATE[K|M|G]   bytes per second
+      --iops-limit N          file operations per second
+      --progress / --no-progress
+    Progress is on by default when stderr is a terminal (for grep
+    only when its matches are not going to that terminal too), but
+    not for background jobs.
+    The limits hold for that command only: its own thread and the
+    pool tasks it submits.
+-------------------------------------------------------------*/
+struct TransferOptions {
+    double bwlimit = 0, iops = 0;
+    int progress = -1;      // -1 decides from the terminal
+};
+
+// Remove the options above from 'args'; false on a malformed value
+bool takeTransferOptions(vector<string> &args, TransferOptions &opts) {
+    vector<string> rest;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const string &a = args[i];
+        if (a == "--bwlimit" || a == "--iops-limit") {
+            double v;
+            if (i + 1 >= args.size() || !parseScaled(args[i + 1], v) || v <= 0) return false;
+            (a == "--bwlimit" ? opts.bwlimit : opts.iops) = v;
+            ++i;
+        } else if (a == "--progress") {
+            opts.progress = 1;
+        } else if (a == "--no-progress") {
+            opts.progress = 0;
+        } else {
+            rest.push_back(a);
+        }
+    }
+    args.swap(rest);
+    return true;
+}
+
+class TransferScope {
+public:
+    TransferScope(const string &cmd, const TransferOptions &opts) : saved(currentThrottle()) {
+        if (opts.bwlimit > 0 || opts.iops > 0) {
+            limits.reset(new Throttle(opts.bwlimit, opts.iops));
+            currentThrottle() = limits.get();
+        }
+
+        bool show = opts.progress == 1;
+        if (opts.progress < 0 && !OutputRouter::capturing()) {
+#ifdef _WIN32
+            show = _isatty(_fileno(stderr)) && (cmd != "grep" || !_isatty(_fileno(stdout)));
+#else
+            show = isatty(2) && (cmd != "grep" || !isatty(1));
+#endif
+        }
+        if (!show) return;
+        if (cmd == "rm")
+            progress.reset(new Progress("rm", perf::COUNTER_COUNT, perf::UNLINKS));
+        else if (cmd == "grep" || cmd == "dupes" || cmd == "pack")
+            progress.reset(new Progress(cmd == "grep" ? "grep" : cmd == "pack" ? "pack" : "dupes",
+                                        perf::BYTES_READ, perf::FILES));
+        else if (cmd == "unpack")
+            progress.reset(new Progress("unpack", perf::BYTES_WRITTEN, perf::FILES));
+        else
+            progress.reset(new Progress(cmd == "mv" ? "mv" : cmd == "sync" ? "sync" : "cp",
+                                        perf::BYTES_WRITTEN, perf::FILES));
+    }
+
+    ~TransferScope() {
+        progress.reset();
+        currentThrottle() = saved;
+    }
+
+private:
+    Throttle *saved;
+    unique_ptr<Throttle> limits;
+    unique_ptr<Progress> progress;
+};
+
+/*-------------------------------------------------------------
+    Copy engine
+    Tries the cheapest mechanism the platform offers and falls
+    through to the next one when it is unsupported:
+      reflink (FICLONE)  - shares extents, no data is moved
+      copy_file_range    - in-kernel copy, may be offloaded
+      sendfile           - in-kernel copy through the page cache
+      buffered           - 1 MiB aligned read/write loop
+-------------------------------------------------------------*/
+enum CopyMethod { COPY_REFLINK, COPY_RANGE, COPY_SENDFILE, COPY_BUFFERED };
+
+struct CopyStats {
+    long long bytes = 0;
+    double seconds = 0;
+    CopyMethod method = COPY_BUFFERED;
+
+    double mbPerSec() const {
+        return seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0;
+    }
+};
+
+const char *copyMethodName(CopyMethod m) {
+    switch (m) {
+    case COPY_REFLINK:  return "reflink";
+    case COPY_RANGE:    return "copy_file_range";
+    case COPY_SENDFILE: return "sendfile";
+    default:            return "buffered";
+    }
+}
+
+const size_t COPY_BUFFER_SIZE = 1 << 20;
+const off_t COPY_CHUNK = 8 << 20;       // in-kernel copies, so progress and limits keep up
+
+#ifndef _WIN32
+// Errors meaning "this mechanism can't do this pair of files", not real I/O failures
+bool copyUnsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == ENOTTY || err == EBADF ||
+           err == EPERM;
+}
+
+bool writeAll(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        perf::count(perf::WRITES);
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+inline void countCopied(uint64_t n) {
+    perf::count(perf::BYTES_READ, n);
+    perf::count(perf::BYTES_WRITTEN, n);
+}
+
+// Copy 'size' bytes from 'in' to 'out', picking the fastest available path
+bool copyFileData(int in, int out, off_t size, CopyStats &stats) {
+    off_t off = 0;
+
+#ifdef FICLONE
+    perf::count(perf::COPY_CALLS);
+    if (ioctl(out, FICLONE, in) == 0) {
+        stats.method = COPY_REFLINK;
+        stats.bytes = size;
+        countCopied((uint64_t)size);
+        return true;
+    }
+#endif
+
+#ifdef SYS_copy_file_range
+    stats.method = COPY_RANGE;
+    while (off < size) {
+        loff_t inOff = off, outOff = off;
+        size_t chunk = (size_t)min(size - off, COPY_CHUNK);
+        throttle(chunk, 0);
+        perf::count(perf::COPY_CALLS);
+        long n = syscall(SYS_copy_file_range, in, &inOff, out, &outOff, chunk, 0u);
+        if (n > 0) {
+            off += n;
+            countCopied((uint64_t)n);
+            continue;
+        }
+        if (n == 0) break;
+        if (errno == EINTR) continue;
+        if (!copyUnsupported(errno)) return false;
+        break;
+    }
+#endif
+
+#ifdef __linux__
+    if (off < size) {
+        stats.method = COPY_SENDFILE;
+        while (off < size) {
+            size_t chunk = (size_t)min(size - off, COPY_CHUNK);
+            throttle(chunk, 0);
+            perf::count(perf::COPY_CALLS);
+            ssize_t n = sendfile(out, in, &off, chunk);
+            if (n > 0) {
+                countCopied((uint64_t)n);
+                continue;
+            }
+            if (n == 0) break;
+            if (errno == EINTR) continue;
+            if (!copyUnsupported(errno)) return false;
+            break;
+        }
+    }
+#endif
+
+    if (off < size || size == 0) {
+        // Also covers files whose st_size lies (procfs and friends)
+        if (off == 0) stats.method = COPY_BUFFERED;
+        if (lseek(in, off, SEEK_SET) < 0 || lseek(out, off, SEEK_SET) < 0)
+            return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(in, off, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        void *mem = NULL;
+        if (posix_memalign(&mem, 4096, COPY_BUFFER_SIZE) != 0) {
+            errno = ENOMEM;
+            return false;
+        }
+        char *buffer = (char *)mem;
+
+        bool ok = true;
+        while (true) {
+            perf::count(perf::READS);
+            ssize_t n = read(in, buffer, COPY_BUFFER_SIZE);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                ok = false;
+                break;
+            }
+            if (n == 0) break;
+            throttle((uint64_t)n, 0);
+            if (!writeAll(out, buffer, (size_t)n)) {
+                ok = false;
+                break;
+            }
+            off += n;
+            countCopied((uint64_t)n);
+        }
+        free(buffer);
+        if (!ok) return false;
+    }
+
+    stats.bytes = off;
+    return true;
+}
+#endif
+
+/*-------------------------------------------------------------
+    Copy one file's data, permission bits and modification time
+    (no logging; shared by cp and cp -r)
+-------------------------------------------------------------*/
+bool copyFileContents(const string &src, const string &dest, CopyStats &stats) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    perf::Scope timing(perf::PH_COPY);
+    perf::count(perf::OPENS, 2);
+    throttle(0);
+
+#ifdef _WIN32
+    FILE *in = fopen(src.c_str(), "rb");
+    if (!in) return false;
+
+    FILE *out = fopen(dest.c_str(), "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+
+    vector<char> buffer(COPY_BUFFER_SIZE);
+    size_t n;
+    bool ok = true;
+    while (ok && (n = fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+        throttle(n, 0);
+        ok = fwrite(buffer.data(), 1, n, out) == n;
+        stats.bytes += n;
+        perf::count(perf::BYTES_READ, n);
+        perf::count(perf::BYTES_WRITTEN, n);
+    }
+    fclose(in);
+    if (fclose(out) != 0) ok = false;
+    if (!ok) return false;
+
+    struct stat st;
+    if (stat(src.c_str(), &st) == 0) {
+        struct _utimbuf times;
+        times.actime = st.st_atime;
+        times.modtime = st.st_mtime;
+        _utime(dest.c_str(), &times);
+        chmod(dest.c_str(), st.st_mode & 0777);
+    }
+#else
+    int in = open(src.c_str(), O_RDONLY);
+    if (in < 0) return false;
+
+    struct stat st;
+    if (fstat(in, &st) != 0 || S_ISDIR(st.st_mode)) {
+        if (S_ISDIR(st.st_mode)) errno = EISDIR;
+        close(in);
+        return false;
+    }
+
+    // Open without O_TRUNC first so copying a file onto itself can't wipe it
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT, st.st_mode & 07777);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    struct stat dst;
+    bool ok = fstat(out, &dst) == 0;
+    if (ok && dst.st_dev == st.st_dev && dst.st_ino == st.st_ino) {
+        errno = EINVAL;
+        ok = false;
+    }
+    if (ok) ok = ftruncate(out, 0) == 0;
+    if (ok) ok = copyFileData(in, out, st.st_size, stats);
+
+    if (ok) {
+        fchmod(out, st.st_mode & 07777);
+        struct timespec times[2];
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        futimens(out, times);
+    }
+
+    int err = errno;
+    close(in);
+    if (close(out) != 0 && ok) {
+        err = errno;
+        ok = false;
+    }
+    errno = err;
+    if (!ok) return false;
+#endif
+
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    perf::count(perf::FILES);
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Copy a file from one location to another
+-------------------------------------------------------------*/
+bool copyFile(const string &src, const string &dest, CopyStats *result = NULL) {
+    struct stat st;
+    if (stat(src.c_str(), &st) == 0) {
+        Progress::plan((long long)st.st_size, 1);
+        Progress::planned();
+    }
+
+    CopyStats stats;
+    if (!copyFileContents(src, dest, stats)) return false;
+    if (result) *result = stats;
+
+    DirCache::instance().forgetParent(dest);
+    logAction("Copied file: " + src + " -> " + dest);
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Create a directory with the given permission bits
+-------------------------------------------------------------*/
+bool createDirectory(const string &path, mode_t mode) {
+#ifdef _WIN32
+    (void)mode;
+    return CreateDirectoryA(path.c_str(), NULL) ||
+           GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path.c_str(), mode) == 0 || errno == EEXIST;
+#endif
+}
+
+/*-------------------------------------------------------------
+    Compare two files byte for byte
+-------------------------------------------------------------*/
+bool sameContents(const string &a, const string &b) {
+    MappedFile ma, mb;
+    if (!ma.open(a, true) || !mb.open(b, true) || ma.size() != mb.size()) return false;
+    perf::count(perf::BYTES_READ, 2 * (uint64_t)ma.size());
+    return ma.size() == 0 || memcmp(ma.data(), mb.data(), ma.size()) == 0;
+}
+
+/*-------------------------------------------------------------
+    Recursive copy scheduler (cp -r)
+    The walk creates directories itself, so a directory always
+    exists before any of its children are queued. File copies go
+    to a separate bounded pool; walkers block once too many bytes
+    are queued, and small files travel in batches so one task
+    covers many open/close round trips. With io_uring a batch is
+    copied in four submissions (open sources, read, create
+    targets, write) instead of one round trip per call.
+-------------------------------------------------------------*/
+class TreeCopier {
+public:
+    TreeCopier() : copiers(max(2u, thread::hardware_concurrency())) {}
+
+    // Queue one file; may block while the outstanding-byte cap is reached
+    void add(const string &src, const string &dest, const struct stat &st) {
+        long long size = (long long)st.st_size;
+        long long cost = max(size, 4096LL);
+        Progress::plan(size, 1);
+        {
+            unique_lock<mutex> lock(mtx);
+            room.wait(lock, [&] {
+                return outstanding == 0 || outstanding + cost <= MAX_OUTSTANDING;
+            });
+            outstanding += cost;
+            ++inFlight;
+        }
+
+        if (size >= SMALL_FILE) {
+            Batch one;
+            one.push_back(Job{src, dest, cost, st});
+            submit(move(one));
+            return;
+        }
+
+        Batch ready;
+        {
+            lock_guard<mutex> lock(batchMtx);
+            batch.push_back(Job{src, dest, cost, st});
+            batchBytes += size;
+            if (batch.size() >= BATCH_FILES || batchBytes >= BATCH_BYTES) {
+                ready.swap(batch);
+                batchBytes = 0;
+            }
+        }
+        if (!ready.empty()) submit(move(ready));
+    }
+
+    // Flush the partial batch and wait for every queued copy
+    void finish() {
+        Batch rest;
+        {
+            lock_guard<mutex> lock(batchMtx);
+            rest.swap(batch);
+            batchBytes = 0;
+        }
+        if (!rest.empty()) submit(move(rest));
+
+        unique_lock<mutex> lock(mtx);
+        room.wait(lock, [&] { return inFlight == 0; });
+    }
+
+    void fail(const string &path, int err) { fail(path, strerror(err)); }
+
+    void fail(const string &path, const char *why) {
+        ++failures;
+        lock_guard<mutex> lock(consoleMutex);
+        cerr << "cp: " << path << ": " << why << "\n";
+    }
+
+    // Check every finished copy against its source before counting it
+    // (mv deletes the sources afterwards); 'content' also compares data
+    void verifyCopies(bool content) {
+        verify = true;
+        compare = content;
+    }
+
+    bool verifying() const { return verify; }
+
+    atomic<long long> files{0}, dirs{0}, bytes{0}, failures{0}, skipped{0};
+
+private:
+    struct Job {
+        string src, dest;
+        long long cost;
+        struct stat st;
+    };
+    typedef vector<Job> Batch;
+
+    static const long long SMALL_FILE = 256 * 1024;
+    static const long long MAX_OUTSTANDING = 256LL * 1024 * 1024;
+    static const size_t BATCH_FILES = 64;
+    static const long long BATCH_BYTES = 1 << 20;
+
+    WorkPool copiers;
+
+    mutex mtx;
+    condition_variable room;
+    long long outstanding = 0;
+    long long inFlight = 0;
+
+    mutex batchMtx;
+    Batch batch;
+    long long batchBytes = 0;
+
+    bool verify = false, compare = false;
+
+    void submit(Batch jobs) {
+        shared_ptr<Batch> work = make_shared<Batch>(move(jobs));
+        copiers.submit([this, work] {
+#ifndef _WIN32
+            if (work->size() > 1 && IoBatch::async()) {
+                copyBatch(*work);
+                return;
+            }
+#endif
+            for (const Job &job : *work) copyOne(job);
+        });
+    }
+
+    void copyOne(const Job &job) {
+        CopyStats stats;
+        if (!copyFileContents(job.src, job.dest, stats)) {
+            fail(job.src, errno);
+        } else if (const char *why = check(job)) {
+            fail(job.src, why);
+        } else {
+            ++files;
+            bytes += stats.bytes;
+        }
+        release(job);
+    }
+
+    // NULL when the copy matches: the source still has the size and
+    // mtime it was queued with and the target got both
+    const char *check(const Job &job) const {
+        if (!verify) return NULL;
+        struct stat now, out;
+        if (stat(job.src.c_str(), &now) != 0) return "source vanished during copy";
+        if (now.st_size != job.st.st_size || mtimeNs(now) != mtimeNs(job.st))
+            return "source changed during copy";
+        if (stat(job.dest.c_str(), &out) != 0 || out.st_size != job.st.st_size ||
+            mtimeNs(out) != mtimeNs(job.st))
+            return "copy does not match the source";
+        if (compare && !sameContents(job.src, job.dest)) return "copy differs from the source";
+        return NULL;
+    }
+
+    void release(const Job &job) {
+        lock_guard<mutex> lock(mtx);
+        outstanding -= job.cost;
+        --inFlight;
+        room.notify_all();
+    }
+
+#ifndef _WIN32
+    // Whole small files through IoBatch rounds; anything unusual (a file
+    // that changed size, a target that is the source, any error) is redone
+    // by copyOne(), which also reports the error
+    void copyBatch(const Batch &jobs) {
+        perf::Scope timing(perf::PH_COPY);
+        static thread_local vector<char> buffer;
+        size_t n = jobs.size();
+        vector<size_t> at(n);
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            at[i] = total;
+            total += (size_t)jobs[i].st.st_size + 1;    // one spare byte notices growth
+        }
+        if (buffer.size() < total) buffer.resize(total);
+
+        vector<int> in(n, -1), out(n, -1);
+        vector<char> ok(n, 1);
+        vector<size_t> got(n, 0);
+        vector<size_t> slot(n);
+        IoBatch io;
+
+        throttle(0, n);
+        for (size_t i = 0; i < n; ++i) slot[i] = io.open(AT_FDCWD, jobs[i].src.c_str(), O_RDONLY);
+        io.run();
+        for (size_t i = 0; i < n; ++i) {
+            in[i] = (int)io.result(slot[i]);
+            if (in[i] < 0) ok[i] = 0;
+        }
+
+        io.clear();
+        for (size_t i = 0; i < n; ++i)
+            if (ok[i])
+                slot[i] = io.read(in[i], buffer.data() + at[i], (size_t)jobs[i].st.st_size + 1, 0);
+        io.run();
+        for (size_t i = 0; i < n; ++i) {
+            if (!ok[i]) continue;
+            long r = io.result(slot[i]);
+            if (r != (long)jobs[i].st.st_size) ok[i] = 0;
+            else got[i] = (size_t)r;
+        }
+
+        // Created without O_TRUNC, so a target that is the source survives
+        io.clear();
+        for (size_t i = 0; i < n; ++i)
+            if (ok[i])
+                slot[i] = io.open(AT_FDCWD, jobs[i].dest.c_str(), O_WRONLY | O_CREAT,
+                                  jobs[i].st.st_mode & 07777);
+        io.run();
+        for (size_t i = 0; i < n; ++i) {
+            if (!ok[i]) continue;
+            out[i] = (int)io.result(slot[i]);
+            struct stat dst;
+            if (out[i] < 0 || fstat(out[i], &dst) != 0 ||
+                (dst.st_dev == jobs[i].st.st_dev && dst.st_ino == jobs[i].st.st_ino) ||
+                (dst.st_size > 0 && ftruncate(out[i], 0) != 0))
+                ok[i] = 0;
+        }
+
+        size_t writes = 0, written = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (ok[i] && got[i] > 0) {
+                ++writes;
+                written += got[i];
+            }
+        throttle(written, writes);
+
+        io.clear();
+        for (size_t i = 0; i < n; ++i)
+            if (ok[i] && got[i] > 0) slot[i] = io.write(out[i], buffer.data() + at[i], got[i], 0);
+        io.run();
+        for (size_t i = 0; i < n; ++i) {
+            if (!ok[i] || got[i] == 0) continue;
+            if (io.result(slot[i]) != (long)got[i]) ok[i] = 0;
+        }
+
+        io.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (ok[i]) {
+                fchmod(out[i], jobs[i].st.st_mode & 07777);
+                struct timespec times[2];
+                times[0] = jobs[i].st.st_atim;
+                times[1] = jobs[i].st.st_mtim;
+                futimens(out[i], times);
+            }
+            if (in[i] >= 0) io.close(in[i]);
+            slot[i] = out[i] >= 0 ? io.close(out[i]) : 0;
+        }
+        io.run();
+
+        for (size_t i = 0; i < n; ++i) {
+            if (ok[i] && io.result(slot[i]) == 0 && !check(jobs[i])) {
+                ++files;
+                bytes += (long long)got[i];
+                perf::count(perf::FILES);
+                release(jobs[i]);
+            } else {
+                copyOne(jobs[i]);
+            }
+        }
+    }
+#endif
+};
+
+/*-------------------------------------------------------------
+    Copy everything under 'src' into the existing directory 'root'
+    With 'resume', a file whose target already has its size and
+    mtime is skipped, and existing links are not errors, so an
+    interrupted copy carries on where it stopped.
+-------------------------------------------------------------*/
+void copyTree(const string &src, const string &root, TreeCopier &copier, bool resume) {
+    struct Copy : WalkPolicy<WALK_STAT> {
+        const string &src, &root;
+        TreeCopier &copier;
+        bool resume;
+        Copy(const string &s, const string &r, TreeCopier &c, bool again)
+            : src(s), root(r), copier(c), resume(again) {}
+
+        bool entry(const WalkEntry &e) const {
+            string target = root + e.path.substr(src.size());
+            if (!e.st) {
+                copier.fail(e.path, errno);
+                return false;
+            }
+
+            switch (e.type) {
+            case ENTRY_DIR:
+                if (!createDirectory(target, (e.st->st_mode & 07777) | 0700)) {
+                    copier.fail(target, errno);
+                    return false;
+                }
+                ++copier.dirs;
+                return true;
+            case ENTRY_FILE:
+                if (resume) {
+                    struct stat out;
+                    if (stat(target.c_str(), &out) == 0 && out.st_size == e.st->st_size &&
+                        mtimeNs(out) == mtimeNs(*e.st)) {
+                        ++copier.skipped;
+                        return false;
+                    }
+                }
+                copier.add(e.path, target, *e.st);
+                return false;
+#ifndef _WIN32
+            case ENTRY_LINK: {
+                char link[4096];
+                ssize_t n = readlink(e.path.c_str(), link, sizeof(link) - 1);
+                if (n < 0) {
+                    copier.fail(e.path, errno);
+                    return false;
+                }
+                link[n] = '\0';
+                if (symlink(link, target.c_str()) != 0 && !(resume && errno == EEXIST))
+                    copier.fail(target, errno);
+                else
+                    ++copier.files;
+                return false;
+            }
+#endif
+            default:
+                if (copier.verifying()) {
+                    // mv would delete what it could not copy
+                    copier.fail(e.path, "special file cannot be copied");
+                    return false;
+                }
+                lock_guard<mutex> lock(consoleMutex);
+                cerr << "cp: skipping special file " << e.path << "\n";
+                return false;
+            }
+        }
+        void error(const string &dir, int err) const { copier.fail(dir, err); }
+    };
+
+    walkTree(src, Copy(src, root, copier, resume));
+    Progress::planned();
+    copier.finish();
+}
+
+/*-------------------------------------------------------------
+    Copy a folder and everything under it (cp -r)
+    Like cp, copying into an existing directory places the tree
+    inside it under the source's name.
+-------------------------------------------------------------*/
+bool copyRecursive(const string &src, const string &dest) {
+    struct stat st;
+    if (stat(src.c_str(), &st) != 0) {
+        printError("cp");
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        string target = isDirectory(dest)
+                            ? dest + PATH_SEP + src.substr(src.find_last_of("/\\") + 1)
+                            : dest;
+        if (!copyFile(src, target)) {
+            printError("cp");
+            return false;
+        }
+        cout << "Copied: " << src << " -> " << target << endl;
+        return true;
+    }
+
+    string root = dest;
+    if (isDirectory(dest)) {
+        string base = src;
+        while (base.size() > 1 && (base.back() == '/' || base.back() == PATH_SEP))
+            base.pop_back();
+        root = dest + PATH_SEP + base.substr(base.find_last_of("/\\") + 1);
+    }
+    if (!createDirectory(root, (st.st_mode & 07777) | 0700)) {
+        printError("cp");
+        return false;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    TreeCopier copier;
+    copyTree(src, root, copier, false);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[160];
+    snprintf(summary, sizeof(summary),
+             "%lld files, %lld dirs, %lld bytes in %.3f s (%.1f MB/s), %lld failed",
+             copier.files.load(), copier.dirs.load() + 1, copier.bytes.load(), seconds,
+             seconds > 0 ? copier.bytes.load() / seconds / (1024.0 * 1024.0) : 0.0,
+             copier.failures.load());
+    cout << "Copied: " << src << " -> " << root << " (" << summary << ")" << endl;
+    logAction("Copied directory: " + src + " -> " + root + " (" + summary + ")");
+    return copier.failures == 0;
+}
+
+/*-------------------------------------------------------------
+    ASCII case folding for the matchers
+-------------------------------------------------------------*/
+inline unsigned char foldByte(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + 32) : c;
+}
+
+/*-------------------------------------------------------------
+    Literal substring finder
+    Candidate positions come from a SIMD filter on the pattern's
+    first and last bytes (SSE2/AVX2 on x86, NEON on ARM), and
+    only those are compared in full. For case-insensitive search
+    the filter ORs 0x20 into letters, which can only add
+    candidates, never lose one.
+-------------------------------------------------------------*/
+class LiteralFinder {
+public:
+    LiteralFinder() {}
+
+    LiteralFinder(const string &needle, bool ignoreCase) : icase(ignoreCase) {
+        pat = needle;
+        if (icase)
+            for (char &c : pat) c = (char)foldByte((unsigned char)c);
+        if (!pat.empty()) {
+            first = (unsigned char)pat[0];
+            last = (unsigned char)pat[pat.size() - 1];
+            firstMask = (icase && isalpha(first)) ? 0x20 : 0;
+            lastMask = (icase && isalpha(last)) ? 0x20 : 0;
+        }
+    }
+
+    size_t size() const { return pat.size(); }
+
+    // Offset of the first match in [hay, hay + n), or -1
+    long find(const char *hay, size_t n) const {
+        size_t m = pat.size();
+        if (m == 0) return 0;
+        if (n < m) return -1;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (avx2) return findAVX2(hay, n);
+#endif
+#if defined(__SSE2__)
+        return findSSE2(hay, n);
+#elif defined(__ARM_NEON)
+        return findNEON(hay, n);
+#else
+        return findScalar(hay, n, 0);
+#endif
+    }
+
+private:
+    string pat;
+    bool icase = false;
+    unsigned char first = 0, last = 0;
+    unsigned char firstMask = 0, lastMask = 0;
+
+    bool confirm(const char *p) const {
+        size_t m = pat.size();
+        if (!icase) return memcmp(p, pat.data(), m) == 0;
+        for (size_t i = 0; i < m; ++i)
+            if (foldByte((unsigned char)p[i]) != (unsigned char)pat[i]) return false;
+        return true;
+    }
+
+    long findScalar(const char *s, size_t n, size_t from) const {
+        size_t m = pat.size();
+        for (size_t i = from; i + m <= n; ++i) {
+            if ((((unsigned char)s[i] | firstMask)) == first &&
+                (((unsigned char)s[i + m - 1] | lastMask)) == last && confirm(s + i))
+                return (long)i;
+        }
+        return -1;
+    }
+
+#if defined(__SSE2__)
+    long findSSE2(const char *s, size_t n) const {
+        size_t m = pat.size();
+        const __m128i F = _mm_set1_epi8((char)first), L = _mm_set1_epi8((char)last);
+        const __m128i FM = _mm_set1_epi8((char)firstMask), LM = _mm_set1_epi8((char)lastMask);
+
+        size_t i = 0;
+        for (; i + m - 1 + 16 <= n; i += 16) {
+            __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i)), FM);
+            __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i + m - 1)), LM);
+            unsigned mask = (unsigned)_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, F), _mm_cmpeq_epi8(b, L)));
+            while (mask) {
+                unsigned bit = (unsigned)__builtin_ctz(mask);
+                if (confirm(s + i + bit)) return (long)(i + bit);
+                mask &= mask - 1;
+            }
+        }
+        return findScalar(s, n, i);
+    }
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __attribute__((target("avx2")))
+    long findAVX2(const char *s, size_t n) const {
+        size_t m = pat.size();
+        const __m256i F = _mm256_set1_epi8((char)first), L = _mm256_set1_epi8((char)last);
+        const __m256i FM = _mm256_set1_epi8((char)firstMask), LM = _mm256_set1_epi8((char)lastMask);
+
+        size_t i = 0;
+        for (; i + m - 1 + 32 <= n; i += 32) {
+            __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i)), FM);
+            __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i + m - 1)), LM);
+            unsigned mask = (unsigned)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, F), _mm256_cmpeq_epi8(b, L)));
+            while (mask) {
+                unsigned bit = (unsigned)__builtin_ctz(mask);
+                if (confirm(s + i + bit)) return (long)(i + bit);
+                mask &= mask - 1;
+            }
+        }
+        return findScalar(s, n, i);
+    }
+#endif
+
+#if defined(__ARM_NEON)
+    long findNEON(const char *s, size_t n) const {
+        size_t m = pat.size();
+        const uint8x16_t F = vdupq_n_u8(first), L = vdupq_n_u8(last);
+        const uint8x16_t FM = vdupq_n_u8(firstMask), LM = vdupq_n_u8(lastMask);
+
+        size_t i = 0;
+        for (; i + m - 1 + 16 <= n; i += 16) {
+            uint8x16_t a = vorrq_u8(vld1q_u8((const uint8_t *)(s + i)), FM);
+            uint8x16_t b = vorrq_u8(vld1q_u8((const uint8_t *)(s + i + m - 1)), LM);
+            uint8x16_t eq = vandq_u8(vceqq_u8(a, F), vceqq_u8(b, L));
+            // Narrow to 4 bits per byte so the mask fits in one 64-bit word
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            while (mask) {
+                unsigned bit = (unsigned)__builtin_ctzll(mask) / 4;
+                if (confirm(s + i + bit)) return (long)(i + bit);
+                mask &= ~(0xfULL << (bit * 4));
+            }
+        }
+        return findScalar(s, n, i);
+    }
+#endif
+};
+
+/*-------------------------------------------------------------
+    Aho-Corasick automaton over several literals
+    Built as a dense 256-way transition table, so scanning is one
+    table lookup per byte no matter how many patterns there are.
+-------------------------------------------------------------*/
+class MultiMatcher {
+public:
+    MultiMatcher() {}
+
+    MultiMatcher(const vector<string> &patterns, bool ignoreCase) : icase(ignoreCase) {
+        next.assign(256, -1);
+        accept.assign(1, 0);
+        for (const string &p : patterns) {
+            int state = 0;
+            for (unsigned char c : p) {
+                if (icase) c = foldByte(c);
+                int &to = next[state * 256 + c];
+                if (to < 0) {
+                    to = (int)accept.size();
+                    accept.push_back(0);
+                    next.resize(next.size() + 256, -1);
+                }
+                state = next[state * 256 + c];
+            }
+            accept[state] = 1;
+        }
+
+        // Breadth-first: fill missing transitions from the failure links
+        vector<int> fail(accept.size(), 0), queue;
+        for (int c = 0; c < 256; ++c) {
+            int &to = next[c];
+            if (to < 0) to = 0;
+            else queue.push_back(to);
+        }
+        for (size_t qi = 0; qi < queue.size(); ++qi) {
+            int s = queue[qi];
+            accept[s] |= accept[fail[s]];
+            for (int c = 0; c < 256; ++c) {
+                int &to = next[s * 256 + c];
+                if (to < 0) {
+                    to = next[fail[s] * 256 + c];
+                } else {
+                    fail[to] = next[fail[s] * 256 + c];
+                    queue.push_back(to);
+                }
+            }
+        }
+    }
+
+    bool empty() const { return accept.empty(); }
+
+    // True if any pattern occurs in [s, s + n)
+    bool matchAny(const char *s, size_t n) const {
+        if (accept[0]) return true;     // an empty pattern matches everything
+        int state = 0;
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char)s[i];
+            state = next[state * 256 + (icase ? foldByte(c) : c)];
+            if (accept[state]) return true;
+        }
+        return false;
+    }
+
+private:
+    vector<int> next;
+    vector<char> accept;
+    bool icase = false;
+};
+
+/*-------------------------------------------------------------
+    Shell-style glob match of a whole name (* ? [abc] [a-z] [!x])
+-------------------------------------------------------------*/
+bool globMatch(const char *p, const char *s, bool icase) {
+    const char *starP = NULL, *starS = NULL;
+
+    while (*s) {
+        unsigned char c = icase ? foldByte((unsigned char)*s) : (unsigned char)*s;
+
+        if (*p == '*') {
+            starP = ++p;
+            starS = s;
+            continue;
+        }
+
+        bool ok = false;
+        const char *after = p + 1;
+        if (*p == '?') {
+            ok = true;
+        } else if (*p == '[') {
+            const char *q = p + 1;
+            bool negate = (*q == '!' || *q == '^');
+            if (negate) ++q;
+            bool hit = false;
+            // A ']' right after the opening bracket is a literal
+            do {
+                unsigned char lo = (unsigned char)*q, hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    hi = (unsigned char)q[2];
+                    q += 2;
+                }
+                if (c >= lo && c <= hi) hit = true;
+                ++q;
+            } while (*q && *q != ']');
+            if (*q == ']') {
+                ok = (hit != negate);
+                after = q + 1;
+            } else {
+                ok = (c == '[');    // unterminated: treat '[' literally
+            }
+        } else if (*p) {
+            ok = ((unsigned char)*p == c);
+        }
+
+        if (ok) {
+            p = after;
+            ++s;
+        } else if (starP) {
+            p = starP;
+            s = ++starS;
+        } else {
+            return false;
+        }
+    }
+
+    while (*p == '*') ++p;
+    return *p == '\0';
+}
+
+/*-------------------------------------------------------------
+    Precompiled name pattern(s) for search
+    A pattern containing * ? or [ is a glob over the whole name;
+    anything else matches as a substring. One literal uses the
+    SIMD finder, several share one Aho-Corasick automaton. A
+    name matches if any pattern does. Matching works directly on
+    the NUL-terminated name and never allocates.
+-------------------------------------------------------------*/
+class NameMatcher {
+public:
+    NameMatcher(const vector<string> &patterns, bool ignoreCase) : icase(ignoreCase) {
+        vector<string> literals;
+        for (const string &p : patterns) {
+            if (p.find_first_of("*?[") != string::npos) {
+                string g = p;
+                if (icase)
+                    for (char &c : g) c = (char)foldByte((unsigned char)c);
+                globs.push_back(g);
+            } else {
+                literals.push_back(p);
+            }
+        }
+
+        if (literals.size() == 1) {
+            single = LiteralFinder(literals[0], icase);
+            singleText = literals[0];
+            haveSingle = true;
+        } else if (literals.size() > 1) {
+            multi = MultiMatcher(literals, icase);
+        }
+    }
+
+    bool match(const char *name) const {
+        if (haveSingle) {
+            if (single.find(name, strlen(name)) >= 0) return true;
+        } else if (!multi.empty()) {
+            if (multi.matchAny(name, strlen(name))) return true;
+        }
+        for (const string &g : globs)
+            if (globMatch(g.c_str(), name, icase)) return true;
+        return false;
+    }
+
+    // The pattern when it is exactly one case-sensitive substring, else NULL
+    const string *literal() const {
+        return (haveSingle && globs.empty() && !icase) ? &singleText : NULL;
+    }
+
+private:
+    bool icase;
+    vector<string> globs;
+    LiteralFinder single;
+    string singleText;
+    bool haveSingle = false;
+    MultiMatcher multi;
+};
+
+/*-------------------------------------------------------------
+    Replace 'dest' with 'src' in one step
+-------------------------------------------------------------*/
+bool replaceFile(const string &src, const string &dest) {
+#ifdef _WIN32
+    return MoveFileExA(src.c_str(), dest.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(src.c_str(), dest.c_str()) == 0;
+#endif
+}
+
+/*-------------------------------------------------------------
+    Persistent filename index (.explorer_index)
+    Layout, every section 8-byte aligned and read through mmap:
+      Header
+      arena     - interned names, NUL terminated
+      names     - NameRec per distinct name, sorted by name
+      entries   - Entry per file/dir (parent index + name id)
+      meta      - Meta (size, mtime) per entry, in entry order
+      byName    - entry ids grouped by name id
+      trigrams  - Trigram per distinct 3-byte key, sorted by key
+      postings  - name ids for every trigram
+      dirs      - DirStamp per directory, sorted by entry id
+    A directory's mtime changes whenever an entry is created,
+    removed or renamed in it, so comparing the stamps against
+    the filesystem tells whether the index is still current;
+    every stamp is checked unless 'index watch' runs, in chunks
+    spread over the pool (batched stats where io_uring is up).
+    The meta columns are as of the last build or update (a file
+    rewritten in place leaves its directory's mtime alone), and
+    are kept current by 'index watch' between updates.
+-------------------------------------------------------------*/
+const char *INDEX_FILE = ".explorer_index";
+const uint32_t INDEX_CHECK_CHUNK = 256;     // directory stamps per check task
+
+namespace index_format {
+
+const char MAGIC[8] = { 'F', 'E', 'I', 'D', 'X', '0', '2', '\0' };
+const uint32_t NONE = 0xffffffffu;
+
+struct Header {
+    char magic[8];
+    uint32_t entryCount, nameCount, trigramCount, dirCount;
+    int64_t builtAt;
+    uint64_t arenaOffset, arenaSize;
+    uint64_t namesOffset, entriesOffset, byNameOffset;
+    uint64_t trigramsOffset, postingsOffset, postingCount;
+    uint64_t dirsOffset;
+    uint64_t metaOffset;
+};
+
+struct NameRec { uint32_t offset, length, first, count; };
+struct Entry { uint32_t parent, name, type; };
+struct Trigram { uint32_t key, first, count; };
+struct DirStamp { uint32_t entry, pad; int64_t mtime; };
+struct Meta { int64_t size, mtime; };     // -1 when the entry could not be stat'ed
+
+inline uint32_t trigramKey(const char *p) {
+    return ((uint32_t)(unsigned char)p[0] << 16) |
+           ((uint32_t)(unsigned char)p[1] << 8) |
+           (uint32_t)(unsigned char)p[2];
+}
+
+} // namespace index_format
+
+/*-------------------------------------------------------------
+    Collects entries in memory and writes the index file
+-------------------------------------------------------------*/
+class IndexBuilder {
+public:
+    uint32_t add(uint32_t parent, const char *name, EntryType type,
+                 int64_t size = -1, int64_t mtime = -1) {
+        auto it = nameIds.find(name);
+        uint32_t nameId;
+        if (it == nameIds.end()) {
+            nameId = (uint32_t)names.size();
+            names.push_back(name);
+            nameIds.emplace(names.back(), nameId);
+        } else {
+            nameId = it->second;
+        }
+
+        index_format::Entry e = { parent, nameId, (uint32_t)type };
+        index_format::Meta m = { size, mtime };
+        entries.push_back(e);
+        metas.push_back(m);
+        return (uint32_t)(entries.size() - 1);
+    }
+
+    void stampDir(uint32_t entry, int64_t mtime) {
+        index_format::DirStamp d = { entry, 0, mtime };
+        dirs.push_back(d);
+    }
+
+    size_t entryCount() const { return entries.size(); }
+    size_t dirCount() const { return dirs.size(); }
+
+    // Rewrite the root's mtime in place (does not touch the directory)
+    bool patchRootStamp(const string &file, int64_t mtime) const {
+        FILE *f = fopen(file.c_str(), "r+b");
+        if (!f) return false;
+        index_format::DirStamp d = { 0, 0, mtime };
+        bool ok = fseek(f, (long)dirsOffset, SEEK_SET) == 0 &&
+                  fwrite(&d, sizeof(d), 1, f) == 1;
+        return fclose(f) == 0 && ok;
+    }
+
+    bool write(const string &file) {
+        using namespace index_format;
+
+        // Renumber names in sorted order so the name table is binary-searchable
+        vector<uint32_t> order(names.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        sort(order.begin(), order.end(),
+             [&](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+        vector<uint32_t> remap(names.size());
+        for (uint32_t i = 0; i < order.size(); ++i) remap[order[i]] = i;
+        for (Entry &e : entries) e.name = remap[e.name];
+
+        string arena;
+        vector<NameRec> recs(names.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            const string &n = names[order[i]];
+            recs[i].offset = (uint32_t)arena.size();
+            recs[i].length = (uint32_t)n.size();
+            recs[i].count = 0;
+            arena += n;
+            arena += '\0';
+        }
+
+        // Counting sort of entry ids by name
+        for (const Entry &e : entries) recs[e.name].count++;
+        uint32_t run = 0;
+        for (NameRec &r : recs) {
+            r.first = run;
+            run += r.count;
+        }
+        vector<uint32_t> byName(entries.size());
+        vector<uint32_t> fill(recs.size(), 0);
+        for (uint32_t id = 0; id < entries.size(); ++id) {
+            uint32_t n = entries[id].name;
+            byName[recs[n].first + fill[n]++] = id;
+        }
+
+        // (trigram key, name id) pairs, deduplicated per name
+        vector<uint64_t> pairs;
+        for (uint32_t i = 0; i < recs.size(); ++i) {
+            const char *p = arena.data() + recs[i].offset;
+            for (uint32_t k = 0; k + 3 <= recs[i].length; ++k)
+                pairs.push_back(((uint64_t)trigramKey(p + k) << 32) | i);
+        }
+        sort(pairs.begin(), pairs.end());
+        pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+        vector<Trigram> grams;
+        vector<uint32_t> postings(pairs.size());
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            uint32_t key = (uint32_t)(pairs[i] >> 32);
+            if (grams.empty() || grams.back().key != key) {
+                Trigram g = { key, (uint32_t)i, 0 };
+                grams.push_back(g);
+            }
+            grams.back().count++;
+            postings[i] = (uint32_t)pairs[i];
+        }
+
+        sort(dirs.begin(), dirs.end(),
+             [](const DirStamp &a, const DirStamp &b) { return a.entry < b.entry; });
+
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.entryCount = (uint32_t)entries.size();
+        h.nameCount = (uint32_t)recs.size();
+        h.trigramCount = (uint32_t)grams.size();
+        h.dirCount = (uint32_t)dirs.size();
+        h.builtAt = (int64_t)time(NULL);
+
+        uint64_t off = align(sizeof(Header));
+        h.arenaOffset = off;    off = align(off + arena.size());
+        h.arenaSize = arena.size();
+        h.namesOffset = off;    off = align(off + recs.size() * sizeof(NameRec));
+        h.entriesOffset = off;  off = align(off + entries.size() * sizeof(Entry));
+        h.metaOffset = off;     off = align(off + metas.size() * sizeof(Meta));
+        h.byNameOffset = off;   off = align(off + byName.size() * sizeof(uint32_t));
+        h.trigramsOffset = off; off = align(off + grams.size() * sizeof(Trigram));
+        h.postingsOffset = off; off = align(off + postings.size() * sizeof(uint32_t));
+        h.postingCount = postings.size();
+        h.dirsOffset = off;
+        dirsOffset = off;
+
+        string tmp = file + ".tmp";
+        FILE *out = fopen(tmp.c_str(), "wb");
+        if (!out) return false;
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+        pos = 0;
+        bool ok = put(out, &h, sizeof(h)) &&
+                  put(out, arena.data(), arena.size()) &&
+                  put(out, recs.data(), recs.size() * sizeof(NameRec)) &&
+                  put(out, entries.data(), entries.size() * sizeof(Entry)) &&
+                  put(out, metas.data(), metas.size() * sizeof(Meta)) &&
+                  put(out, byName.data(), byName.size() * sizeof(uint32_t)) &&
+                  put(out, grams.data(), grams.size() * sizeof(Trigram)) &&
+                  put(out, postings.data(), postings.size() * sizeof(uint32_t)) &&
+                  put(out, dirs.data(), dirs.size() * sizeof(DirStamp));
+        if (fclose(out) != 0) ok = false;
+        if (!ok || !replaceFile(tmp, file)) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    unordered_map<string, uint32_t> nameIds;
+    vector<string> names;
+    vector<index_format::Entry> entries;
+    vector<index_format::Meta> metas;
+    vector<index_format::DirStamp> dirs;
+    uint64_t pos = 0;
+    uint64_t dirsOffset = 0;
+
+    static uint64_t align(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+    // Write one section followed by padding up to the next 8-byte boundary
+    bool put(FILE *out, const void *data, size_t n) {
+        static const char zeros[8] = { 0 };
+        if (n && fwrite(data, 1, n, out) != n) return false;
+        pos += n;
+        size_t pad = (size_t)(align(pos) - pos);
+        if (pad && fwrite(zeros, 1, pad, out) != pad) return false;
+        pos += pad;
+        return true;
+    }
+};
+
+/*-------------------------------------------------------------
+    Read side of the index, straight out of the mapping
+-------------------------------------------------------------*/
+class SearchIndex {
+public:
+    bool open(const string &file) {
+        using namespace index_format;
+        if (!map.open(file) || map.size() < sizeof(Header)) return false;
+
+        h = (const Header *)map.data();
+        if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0) return false;
+        if (!fits(h->arenaOffset, h->arenaSize, 1) ||
+            !fits(h->namesOffset, h->nameCount, sizeof(NameRec)) ||
+            !fits(h->entriesOffset, h->entryCount, sizeof(Entry)) ||
+            !fits(h->metaOffset, h->entryCount, sizeof(Meta)) ||
+            !fits(h->byNameOffset, h->entryCount, sizeof(uint32_t)) ||
+            !fits(h->trigramsOffset, h->trigramCount, sizeof(Trigram)) ||
+            !fits(h->postingsOffset, h->postingCount, sizeof(uint32_t)) ||
+            !fits(h->dirsOffset, h->dirCount, sizeof(DirStamp)) ||
+            h->entryCount == 0)
+            return false;
+
+        arena = map.data() + h->arenaOffset;
+        names = (const NameRec *)(map.data() + h->namesOffset);
+        entries = (const Entry *)(map.data() + h->entriesOffset);
+        metas = (const Meta *)(map.data() + h->metaOffset);
+        byName = (const uint32_t *)(map.data() + h->byNameOffset);
+        grams = (const Trigram *)(map.data() + h->trigramsOffset);
+        postings = (const uint32_t *)(map.data() + h->postingsOffset);
+        dirs = (const DirStamp *)(map.data() + h->dirsOffset);
+        return true;
+    }
+
+    void close() {
+        map.close();
+        h = NULL;
+        childStart.clear();
+        childList.clear();
+    }
+
+    uint32_t entryCount() const { return h->entryCount; }
+    const index_format::Entry &entry(uint32_t id) const { return entries[id]; }
+    const index_format::Meta &meta(uint32_t id) const { return metas[id]; }
+    const char *nameOf(uint32_t id) const { return arena + names[entries[id].name].offset; }
+
+    // Recorded mtime of a directory entry, or -1 if it has none
+    int64_t dirMtime(uint32_t id) const {
+        const index_format::DirStamp *end = dirs + h->dirCount;
+        const index_format::DirStamp *d = lower_bound(dirs, end, id,
+            [](const index_format::DirStamp &s, uint32_t v) { return s.entry < v; });
+        return (d != end && d->entry == id) ? d->mtime : -1;
+    }
+
+    // Children of every entry as a compact offset table (built on demand)
+    const vector<uint32_t> &childOffsets() const {
+        if (childStart.empty()) {
+            childStart.assign(h->entryCount + 1, 0);
+            for (uint32_t id = 1; id < h->entryCount; ++id)
+                childStart[entries[id].parent + 1]++;
+            for (uint32_t i = 1; i <= h->entryCount; ++i)
+                childStart[i] += childStart[i - 1];
+            childList.resize(h->entryCount);
+            vector<uint32_t> fill(childStart.begin(), childStart.end() - 1);
+            for (uint32_t id = 1; id < h->entryCount; ++id)
+                childList[fill[entries[id].parent]++] = id;
+        }
+        return childStart;
+    }
+    const uint32_t *children(uint32_t id, uint32_t &count) const {
+        const vector<uint32_t> &start = childOffsets();
+        count = start[id + 1] - start[id];
+        return childList.data() + start[id];
+    }
+
+    string pathOf(uint32_t id, const string &root) const {
+        uint32_t chain[256];
+        vector<uint32_t> deep;
+        size_t n = 0;
+        for (uint32_t cur = id; cur != 0; cur = entries[cur].parent) {
+            if (n < 256) chain[n++] = cur;
+            else deep.push_back(cur);
+        }
+
+        string path = root;
+        for (size_t i = deep.size(); i-- > 0;) {
+            path += PATH_SEP;
+            path += nameOf(deep[i]);
+        }
+        for (size_t i = n; i-- > 0;) {
+            path += PATH_SEP;
+            path += nameOf(chain[i]);
+        }
+        return path;
+    }
+
+    // True when no directory in the tree has changed since the index was written
+    bool isCurrent(const string &root) const {
+        atomic<bool> stale(false);
+        TaskGroup group(WorkPool::shared());
+        for (uint32_t first = 0; first < h->dirCount; first += INDEX_CHECK_CHUNK) {
+            uint32_t last = min(h->dirCount, first + INDEX_CHECK_CHUNK);
+            group.run([this, &root, &stale, first, last] {
+                if (!stale.load() && !stampsMatch(root, first, last)) stale = true;
+            });
+        }
+        group.wait();
+        return !stale.load();
+    }
+
+    // Call fn(entryId) for every entry whose name matches
+    template <class Fn>
+    void find(const NameMatcher &matcher, Fn fn) const {
+        const string *lit = matcher.literal();
+        if (!lit || lit->size() < 3) {
+            // Distinct names are far fewer than entries, so scan those
+            for (uint32_t n = 0; n < h->nameCount; ++n)
+                if (matcher.match(arena + names[n].offset))
+                    emitName(n, fn);
+            return;
+        }
+
+        // Candidates come from the rarest trigram; the matcher confirms the rest
+        const index_format::Trigram *best = NULL;
+        for (size_t k = 0; k + 3 <= lit->size(); ++k) {
+            const index_format::Trigram *g = findTrigram(index_format::trigramKey(lit->data() + k));
+            if (!g) return;
+            if (!best || g->count < best->count) best = g;
+        }
+        for (uint32_t i = 0; i < best->count; ++i) {
+            uint32_t n = postings[best->first + i];
+            if (matcher.match(arena + names[n].offset))
+                emitName(n, fn);
+        }
+    }
+
+private:
+    MappedFile map;
+    const index_format::Header *h = NULL;
+    const char *arena = NULL;
+    const index_format::NameRec *names = NULL;
+    const index_format::Entry *entries = NULL;
+    const index_format::Meta *metas = NULL;
+    const uint32_t *byName = NULL;
+    const index_format::Trigram *grams = NULL;
+    const uint32_t *postings = NULL;
+    const index_format::DirStamp *dirs = NULL;
+
+    mutable vector<uint32_t> childStart, childList;
+
+    bool fits(uint64_t off, uint64_t count, uint64_t size) const {
+        return off <= map.size() && count <= (map.size() - off) / size;
+    }
+
+    const index_format::Trigram *findTrigram(uint32_t key) const {
+        const index_format::Trigram *end = grams + h->trigramCount;
+        const index_format::Trigram *g = lower_bound(grams, end, key,
+            [](const index_format::Trigram &t, uint32_t k) { return t.key < k; });
+        return (g != end && g->key == key) ? g : NULL;
+    }
+
+    // Compare the stamps dirs[first, last) against the filesystem
+    bool stampsMatch(const string &root, uint32_t first, uint32_t last) const {
+        vector<string> paths;
+        vector<struct stat> sts(last - first);
+        for (uint32_t i = first; i < last; ++i) paths.push_back(pathOf(dirs[i].entry, root));
+#ifndef _WIN32
+        if (paths.size() > 1 && IoBatch::async()) {
+            IoBatch io;
+            for (size_t k = 0; k < paths.size(); ++k) io.stat(AT_FDCWD, paths[k].c_str(), &sts[k], true);
+            io.run();
+            for (size_t k = 0; k < paths.size(); ++k)
+                if (io.result(k) != 0 || mtimeNs(sts[k]) != dirs[first + k].mtime) return false;
+            return true;
+        }
+#endif
+        for (size_t k = 0; k < paths.size(); ++k) {
+            perf::count(perf::STATS);
+            if (stat(paths[k].c_str(), &sts[k]) != 0 || mtimeNs(sts[k]) != dirs[first + k].mtime)
+                return false;
+        }
+        return true;
+    }
+
+    template <class Fn>
+    void emitName(uint32_t n, Fn &fn) const {
+        for (uint32_t i = 0; i < names[n].count; ++i) {
+            uint32_t id = byName[names[n].first + i];
+            if (id != 0) fn(id);
+        }
+    }
+};
+
+/*-------------------------------------------------------------
+    Write the index file for 'root'
+    Writing the file bumps the root directory's own mtime, so the
+    root's stamp (always the first DirStamp) is patched afterwards
+    unless something else changed the root in the meantime.
+-------------------------------------------------------------*/
+bool commitIndex(IndexBuilder &builder, const string &root, int64_t rootMtime) {
+    string file = root + PATH_SEP + INDEX_FILE;
+    struct stat st;
+    bool rootUnchanged = stat(root.c_str(), &st) == 0 && mtimeNs(st) == rootMtime;
+    if (!builder.write(file)) return false;
+
+    if (rootUnchanged && stat(root.c_str(), &st) == 0)
+        builder.patchRootStamp(file, mtimeNs(st));
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Build or refresh the index for 'root'
+    With a previous index, directories whose mtime is unchanged
+    reuse their recorded children instead of being read again;
+    the children are still stat'ed (through the directory handle)
+    so their size and mtime columns are current. 'quiet' keeps
+    the summary off the console (the watcher rebuilds in the
+    background); it is still logged.
+-------------------------------------------------------------*/
+bool buildIndex(const string &root, bool update, bool quiet = false) {
+    using index_format::NONE;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string file = root + PATH_SEP + INDEX_FILE;
+
+    SearchIndex old;
+    bool haveOld = update && old.open(file);
+    if (update && !haveOld && !quiet)
+        cout << "No usable index found, building a new one.\n";
+
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printError("index");
+        return false;
+    }
+
+    struct Pending {
+        string path;
+        uint32_t id, oldId;
+        int64_t mtime;
+    };
+
+    IndexBuilder builder;
+    int64_t rootMtime = mtimeNs(st);
+    vector<Pending> stack;
+    stack.push_back(Pending{ root, builder.add(NONE, "", ENTRY_DIR, (int64_t)st.st_size, rootMtime),
+                             haveOld ? 0 : NONE, rootMtime });
+
+    size_t scanned = 0, reused = 0;
+    while (!stack.empty()) {
+        Pending p = move(stack.back());
+        stack.pop_back();
+        builder.stampDir(p.id, p.mtime);
+
+        DIR *dir = opendir(p.path.c_str());
+        if (!dir) continue;
+
+        if (p.oldId != NONE && old.dirMtime(p.oldId) == p.mtime) {
+            ++reused;
+            PathBuilder child(p.path);
+            uint32_t count;
+            const uint32_t *kids = old.children(p.oldId, count);
+            for (uint32_t i = 0; i < count; ++i) {
+                const index_format::Entry &e = old.entry(kids[i]);
+                const char *name = old.nameOf(kids[i]);
+                size_t mark = child.push(name);
+                bool haveStat = statEntry(dir, name, child.str(), st);
+                uint32_t id = haveStat
+                    ? builder.add(p.id, name, (EntryType)e.type, (int64_t)st.st_size, mtimeNs(st))
+                    : builder.add(p.id, name, (EntryType)e.type);
+
+                if (e.type == ENTRY_DIR && haveStat && S_ISDIR(st.st_mode))
+                    stack.push_back(Pending{ child.str(), id, kids[i], mtimeNs(st) });
+                child.pop(mark);
+            }
+            closedir(dir);
+            continue;
+        }
+
+        ++scanned;
+
+        // Old children of a changed directory, so unchanged subtrees can still be reused
+        unordered_map<string, uint32_t> oldKids;
+        if (p.oldId != NONE) {
+            uint32_t count;
+            const uint32_t *kids = old.children(p.oldId, count);
+            for (uint32_t i = 0; i < count; ++i) oldKids.emplace(old.nameOf(kids[i]), kids[i]);
+        }
+
+        PathBuilder child(p.path);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            if (p.id == 0 && strncmp(name, INDEX_FILE, strlen(INDEX_FILE)) == 0) continue;
+
+            size_t mark = child.push(name);
+            EntryType type = ENTRY_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+            type = typeFromDirent(entry->d_type);
+#endif
+            bool haveStat = statEntry(dir, name, child.str(), st);
+            if (haveStat) type = typeFromMode(st.st_mode);
+
+            uint32_t id = haveStat ? builder.add(p.id, name, type, (int64_t)st.st_size, mtimeNs(st))
+                                   : builder.add(p.id, name, type);
+            if (type == ENTRY_DIR && haveStat) {
+                auto it = oldKids.find(name);
+                uint32_t oldId = (it != oldKids.end() && old.entry(it->second).type == ENTRY_DIR)
+                                     ? it->second : NONE;
+                stack.push_back(Pending{ child.str(), id, oldId, mtimeNs(st) });
+            }
+            child.pop(mark);
+        }
+        closedir(dir);
+    }
+
+    old.close();    // Windows can't replace a file that is still mapped
+    if (!commitIndex(builder, root, rootMtime)) {
+        printError("index");
+        return false;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[160];
+    snprintf(summary, sizeof(summary),
+             "%zu entries, %zu dirs (%zu read, %zu reused) in %.3f s",
+             builder.entryCount() - 1, builder.dirCount(), scanned, reused, seconds);
+    if (!quiet) cout << "Indexed " << root << ": " << summary << endl;
+    logAction("Indexed " + root + ": " + summary);
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Mutable, in-memory copy of an index
+    Nodes are never renumbered while loaded: a rename only
+    changes a node's parent and name, and a delete detaches the
+    node so its subtree is skipped when the index is written.
+-------------------------------------------------------------*/
+class LiveIndex {
+public:
+    static const uint32_t NONE = index_format::NONE;
+
+    bool load(const SearchIndex &idx) {
+        nodes.clear();
+        names.clear();
+        nameIds.clear();
+        childOf.clear();
+        dirty.clear();
+
+        uint32_t n = idx.entryCount();
+        nodes.reserve(n);
+        for (uint32_t id = 0; id < n; ++id) {
+            const index_format::Entry &e = idx.entry(id);
+            const index_format::Meta &m = idx.meta(id);
+            Node node = { id == 0 ? NONE : e.parent, intern(idx.nameOf(id)),
+                          (EntryType)e.type, idx.dirMtime(id), m.size, m.mtime };
+            nodes.push_back(node);
+            if (id != 0) childOf[key(node.parent, node.name)] = id;
+        }
+        return n > 0;
+    }
+
+    size_t size() const { return nodes.size(); }
+    bool empty() const { return nodes.empty(); }
+    bool isDir(uint32_t id) const { return nodes[id].type == ENTRY_DIR; }
+
+    // False for nodes cut off by an earlier delete
+    bool attached(uint32_t id) const {
+        while (id != 0) {
+            id = nodes[id].parent;
+            if (id == NONE) return false;
+        }
+        return true;
+    }
+
+    uint32_t child(uint32_t parent, const string &name) const {
+        auto n = nameIds.find(name);
+        if (n == nameIds.end()) return NONE;
+        auto it = childOf.find(key(parent, n->second));
+        return it == childOf.end() ? NONE : it->second;
+    }
+
+    // Node for a path given as components below the root
+    uint32_t lookup(const vector<string> &parts) const {
+        uint32_t id = 0;
+        for (const string &p : parts) {
+            id = child(id, p);
+            if (id == NONE) return NONE;
+        }
+        return id;
+    }
+
+    string pathOf(uint32_t id, const string &root) const {
+        vector<uint32_t> chain;
+        for (uint32_t cur = id; cur != 0 && cur != NONE; cur = nodes[cur].parent)
+            chain.push_back(cur);
+        string path = root;
+        for (size_t i = chain.size(); i-- > 0;) {
+            path += PATH_SEP;
+            path += names[nodes[chain[i]].name];
+        }
+        return path;
+    }
+
+    // Record (or replace) 'name' under 'parent'; new directories are scanned
+    uint32_t add(uint32_t parent, const string &name, const struct stat &st, const string &root,
+                 const function<void(uint32_t, const string &)> &onDir) {
+        erase(parent, name);
+        uint32_t id = (uint32_t)nodes.size();
+        EntryType type = typeFromMode(st.st_mode);
+        Node node = { parent, intern(name), type, -1, (int64_t)st.st_size, mtimeNs(st) };
+        nodes.push_back(node);
+        childOf[key(parent, node.name)] = id;
+        dirty.push_back(parent);
+        if (type == ENTRY_DIR) scan(id, root, onDir);
+        return id;
+    }
+
+    // New size and mtime for an entry changed in place; false if it is unknown
+    bool refresh(uint32_t parent, const string &name, const struct stat &st) {
+        uint32_t id = child(parent, name);
+        if (id == NONE) return false;
+        nodes[id].size = (int64_t)st.st_size;
+        nodes[id].modified = mtimeNs(st);
+        return true;
+    }
+
+    void erase(uint32_t parent, const string &name) {
+        uint32_t id = child(parent, name);
+        if (id == NONE) return;
+        childOf.erase(key(parent, nodes[id].name));
+        nodes[id].parent = NONE;
+        dirty.push_back(parent);
+    }
+
+    void move(uint32_t id, uint32_t newParent, const string &newName) {
+        if (id == 0 || id == NONE) return;
+        erase(newParent, newName);
+        childOf.erase(key(nodes[id].parent, nodes[id].name));
+        dirty.push_back(nodes[id].parent);
+
+        nodes[id].parent = newParent;
+        nodes[id].name = intern(newName);
+        childOf[key(newParent, nodes[id].name)] = id;
+        dirty.push_back(newParent);
+    }
+
+    // Something changed inside this directory; re-stamp it at the next write
+    void touch(uint32_t dir) { dirty.push_back(dir); }
+
+    // Re-stamp dirty directories and write the whole index for 'root'
+    bool write(const string &root) {
+        sort(dirty.begin(), dirty.end());
+        dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+        for (uint32_t d : dirty) {
+            struct stat st;
+            if (d < nodes.size() && stat(pathOf(d, root).c_str(), &st) == 0) {
+                nodes[d].mtime = nodes[d].modified = mtimeNs(st);
+                nodes[d].size = (int64_t)st.st_size;
+            }
+        }
+        dirty.clear();
+
+        // Child lists for reachable nodes only, as an offset table
+        vector<uint32_t> start(nodes.size() + 1, 0), list(childOf.size());
+        for (const auto &kv : childOf) start[nodes[kv.second].parent + 1]++;
+        for (size_t i = 1; i < start.size(); ++i) start[i] += start[i - 1];
+        vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for (const auto &kv : childOf) list[fill[nodes[kv.second].parent]++] = kv.second;
+
+        IndexBuilder builder;
+        vector<pair<uint32_t, uint32_t>> stack;   // (live id, new id)
+        stack.push_back(make_pair(0u, builder.add(NONE, "", ENTRY_DIR, nodes[0].size, nodes[0].modified)));
+        while (!stack.empty()) {
+            pair<uint32_t, uint32_t> cur = stack.back();
+            stack.pop_back();
+            if (nodes[cur.first].mtime >= 0) builder.stampDir(cur.second, nodes[cur.first].mtime);
+
+            for (uint32_t i = start[cur.first]; i < start[cur.first + 1]; ++i) {
+                const Node &c = nodes[list[i]];
+                uint32_t id = builder.add(cur.second, names[c.name].c_str(), c.type, c.size, c.modified);
+                if (c.type == ENTRY_DIR) stack.push_back(make_pair(list[i], id));
+            }
+        }
+        return commitIndex(builder, root, nodes[0].mtime);
+    }
+
+private:
+    struct Node {
+        uint32_t parent;
+        uint32_t name;
+        EntryType type;
+        int64_t mtime;      // directories only, -1 when unknown
+        int64_t size, modified;     // meta columns, -1 when unknown
+    };
+
+    vector<Node> nodes;
+    vector<string> names;
+    unordered_map<string, uint32_t> nameIds;
+    unordered_map<uint64_t, uint32_t> childOf;   // (parent, name id) -> node
+    vector<uint32_t> dirty;
+
+    static uint64_t key(uint32_t parent, uint32_t name) {
+        return ((uint64_t)parent << 32) | name;
+    }
+
+    uint32_t intern(const string &name) {
+        auto it = nameIds.find(name);
+        if (it != nameIds.end()) return it->second;
+        names.push_back(name);
+        nameIds.emplace(name, (uint32_t)(names.size() - 1));
+        return (uint32_t)(names.size() - 1);
+    }
+
+    // Read a directory that appeared after the index was loaded
+    void scan(uint32_t top, const string &root,
+              const function<void(uint32_t, const string &)> &onDir) {
+        vector<uint32_t> stack(1, top);
+        while (!stack.empty()) {
+            uint32_t id = stack.back();
+            stack.pop_back();
+
+            string path = pathOf(id, root);
+            if (onDir) onDir(id, path);
+            dirty.push_back(id);
+
+            DIR *dir = opendir(path.c_str());
+            if (!dir) continue;
+            PathBuilder full(path);
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL) {
+                const char *name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+                EntryType type = ENTRY_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+                type = typeFromDirent(entry->d_type);
+#endif
+                struct stat st;
+                size_t mark = full.push(name);
+                bool haveStat = statEntry(dir, name, full.str(), st);
+                if (haveStat) type = typeFromMode(st.st_mode);
+                full.pop(mark);
+
+                uint32_t cid = (uint32_t)nodes.size();
+                Node node = { id, intern(name), type, -1,
+                              haveStat ? (int64_t)st.st_size : -1, haveStat ? mtimeNs(st) : -1 };
+                nodes.push_back(node);
+                childOf[key(id, node.name)] = cid;
+                if (type == ENTRY_DIR) stack.push_back(cid);
+            }
+            closedir(dir);
+        }
+    }
+};
+
+/*-------------------------------------------------------------
+    Keeps one index current while the explorer runs
+    Changes come from two places: the explorer's own commands
+    (touch, mkdir, mv, rm) and, once 'index watch' is running,
+    the OS change feed (inotify / ReadDirectoryChangesW). Both
+    are applied to the in-memory LiveIndex at once; the file is
+    rewritten in batches, after a quiet period or before a
+    search reads it.
+-------------------------------------------------------------*/
+class IndexMaintainer {
+public:
+    static IndexMaintainer &instance() {
+        static IndexMaintainer maintainer;
+        return maintainer;
+    }
+
+    // Load the index for 'root' so later changes can be applied to it
+    bool attach(const string &root) {
+        string abs = absolutePath(root);
+        lock_guard<mutex> lock(mtx);
+        if (abs == rootAbs && !live.empty()) return true;
+        if (watching) return false;    // a watched index stays attached
+
+        SearchIndex idx;
+        if (!idx.open(abs + PATH_SEP + INDEX_FILE) || !live.load(idx)) {
+            rootAbs.clear();
+            return false;
+        }
+        rootAbs = abs;
+        pending = 0;
+        return true;
+    }
+
+    // Drop the loaded copy and read 'root''s index again
+    bool reload(const string &root) {
+        {
+            lock_guard<mutex> lock(mtx);
+            if (watching) return false;
+            live = LiveIndex();
+            rootAbs.clear();
+        }
+        return attach(root);
+    }
+
+    bool covers(const string &root) {
+        string abs = absolutePath(root);
+        lock_guard<mutex> lock(mtx);
+        return !live.empty() && abs == rootAbs;
+    }
+
+    // True when the OS change feed keeps the index for 'root' current
+    bool isWatching(const string &root) {
+        string abs = absolutePath(root);
+        lock_guard<mutex> lock(mtx);
+        return watching && abs == rootAbs;
+    }
+
+    void noteCreated(const string &path) {
+        lock_guard<mutex> lock(mtx);
+        if (feedCoversOwnChanges()) return;
+        uint32_t parent;
+        string name;
+        if (!resolve(path, parent, name)) return;
+
+        struct stat st;
+        string full = live.pathOf(parent, rootAbs) + PATH_SEP + name;
+#ifdef _WIN32
+        if (stat(full.c_str(), &st) != 0) return;
+#else
+        if (lstat(full.c_str(), &st) != 0) return;
+#endif
+        if (live.child(parent, name) != LiveIndex::NONE && !S_ISDIR(st.st_mode)) {
+            live.refresh(parent, name, st);     // e.g. touch on an existing file
+            live.touch(parent);
+        } else {
+            live.add(parent, name, st, rootAbs, watchHook());
+        }
+        changed();
+    }
+
+    void noteRemoved(const string &path) {
+        lock_guard<mutex> lock(mtx);
+        if (feedCoversOwnChanges()) return;
+        uint32_t parent;
+        string name;
+        if (!resolve(path, parent, name)) return;
+        live.erase(parent, name);
+        changed();
+    }
+
+    // Read 'path' back in from disk after a change that may have been
+    // partial (an rm that failed halfway): what is left replaces the entry
+    void noteRescan(const string &path) {
+        lock_guard<mutex> lock(mtx);
+        if (feedCoversOwnChanges()) return;
+        uint32_t parent;
+        string name;
+        if (!resolve(path, parent, name)) return;
+        live.erase(parent, name);
+
+        struct stat st;
+        string full = live.pathOf(parent, rootAbs) + PATH_SEP + name;
+#ifdef _WIN32
+        if (stat(full.c_str(), &st) == 0)
+#else
+        if (lstat(full.c_str(), &st) == 0)
+#endif
+            live.add(parent, name, st, rootAbs, watchHook());
+        changed();
+    }
+
+    // Size or mtime of an existing entry changed (the directory itself did not)
+    void noteModified(const string &path) {
+        lock_guard<mutex> lock(mtx);
+        if (feedCoversOwnChanges()) return;
+        uint32_t parent;
+        string name;
+        struct stat st;
+        if (!resolve(path, parent, name) || stat(path.c_str(), &st) != 0) return;
+        if (live.refresh(parent, name, st)) changed();
+    }
+
+    // 'dest' is the final path of the moved entry
+    void noteMoved(const string &src, const string &dest) {
+        lock_guard<mutex> lock(mtx);
+        if (feedCoversOwnChanges()) return;
+        uint32_t srcParent, destParent;
+        string srcName, destName;
+        bool haveSrc = resolve(src, srcParent, srcName);
+        bool haveDest = resolve(dest, destParent, destName);
+
+        uint32_t id = haveSrc ? live.child(srcParent, srcName) : LiveIndex::NONE;
+        if (haveDest && id != LiveIndex::NONE) {
+            live.move(id, destParent, destName);
+        } else {
+            if (haveSrc) live.erase(srcParent, srcName);
+            if (haveDest) {
+                struct stat st;
+                string full = live.pathOf(destParent, rootAbs) + PATH_SEP + destName;
+                if (stat(full.c_str(), &st) == 0)
+                    live.add(destParent, destName, st, rootAbs, watchHook());
+            }
+        }
+        changed();
+    }
+
+    // Write pending changes to disk now
+    void flush() {
+        lock_guard<mutex> lock(mtx);
+#ifdef __linux__
+        if (watching) drainEvents();
+#endif
+        flushLocked();
+    }
+
+    bool watch(const string &root);
+    void unwatch();
+
+    void shutdown() {
+        unwatch();
+        flush();
+    }
+
+private:
+    mutex mtx;
+    LiveIndex live;
+    string rootAbs;
+    size_t pending = 0;
+    chrono::steady_clock::time_point lastChange;
+
+    bool watching = false;
+    atomic<bool> stopWatch{false};
+    thread watcher;
+#ifdef _WIN32
+    HANDLE dirHandle = INVALID_HANDLE_VALUE;
+#elif defined(__linux__)
+    int notifyFd = -1;
+    unordered_map<int, uint32_t> wdNode;
+    vector<char> eventBuf;
+#endif
+
+    static const size_t BATCH_CHANGES = 1024;
+
+    IndexMaintainer() {}
+    ~IndexMaintainer() { shutdown(); }
+
+    // Split a path into its parent node and last component, if it is under the root
+    bool resolve(const string &path, uint32_t &parent, string &name) {
+        if (live.empty()) return false;
+        string abs = absolutePath(path);
+        if (abs.compare(0, rootAbs.size(), rootAbs) != 0) return false;
+        if (abs.size() <= rootAbs.size() + 1 || abs[rootAbs.size()] != PATH_SEP) return false;
+
+        vector<string> parts;
+        size_t pos = rootAbs.size() + 1;
+        while (pos <= abs.size()) {
+            size_t next = abs.find(PATH_SEP, pos);
+            if (next == string::npos) next = abs.size();
+            if (next > pos) parts.push_back(abs.substr(pos, next - pos));
+            pos = next + 1;
+        }
+        if (parts.empty() || parts.back() == INDEX_FILE) return false;
+
+        name = parts.back();
+        parts.pop_back();
+        parent = live.lookup(parts);
+        return parent != LiveIndex::NONE && live.isDir(parent);
+    }
+
+    // inotify reports the explorer's own changes too, and flush() drains
+    // it before a search, so applying them twice would only cost rescans
+    bool feedCoversOwnChanges() const {
+#ifdef __linux__
+        return watching;
+#else
+        return false;
+#endif
+    }
+
+    void changed() {
+        ++pending;
+        lastChange = chrono::steady_clock::now();
+        if (pending >= BATCH_CHANGES) flushLocked();
+    }
+
+    void flushLocked() {
+        if (pending == 0 || live.empty()) return;
+        if (live.write(rootAbs)) pending = 0;
+    }
+
+    // Events were lost: refresh the index from disk and reload it. Node
+    // ids change on a rebuild, so the watches are mapped onto the new ids.
+    void rebuildLocked() {
+        buildIndex(rootAbs, true, true);
+        SearchIndex idx;
+        if (idx.open(rootAbs + PATH_SEP + INDEX_FILE)) live.load(idx);
+        pending = 0;
+#ifdef __linux__
+        // Adding a watch on a directory that has one returns the same wd,
+        // so re-adding every directory rebuilds the map; wds left over
+        // belong to directories that are gone from the index
+        unordered_map<int, uint32_t> old;
+        old.swap(wdNode);
+        for (uint32_t id = 0; id < live.size(); ++id)
+            if (live.isDir(id) && live.attached(id)) addWatch(id, live.pathOf(id, rootAbs));
+        for (const auto &w : old)
+            if (!wdNode.count(w.first)) inotify_rm_watch(notifyFd, w.first);
+#endif
+    }
+
+    // Lets the watcher subscribe to directories discovered by a scan
+    function<void(uint32_t, const string &)> watchHook() {
+#ifdef __linux__
+        if (!watching) return nullptr;
+        return [this](uint32_t id, const string &path) { addWatch(id, path); };
+#else
+        return nullptr;     // ReadDirectoryChangesW already covers the subtree
+#endif
+    }
+
+#ifdef __linux__
+    void addWatch(uint32_t id, const string &path) {
+        int wd = inotify_add_watch(notifyFd, path.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+        if (wd >= 0) wdNode[wd] = id;
+    }
+
+    void applyEvents(const char *buf, size_t len);
+
+    void drainEvents() {
+        ssize_t n;
+        while ((n = read(notifyFd, eventBuf.data(), eventBuf.size())) > 0)
+            applyEvents(eventBuf.data(), (size_t)n);
+    }
+#endif
+    void run();
+};
+
+#ifdef _WIN32
+bool IndexMaintainer::watch(const string &root) {
+    if (!attach(root)) return false;
+    lock_guard<mutex> lock(mtx);
+    if (watching) return true;
+
+    dirHandle = CreateFileA(rootAbs.c_str(), FILE_LIST_DIRECTORY,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (dirHandle == INVALID_HANDLE_VALUE) return false;
+
+    watching = true;
+    stopWatch = false;
+    watcher = thread(&IndexMaintainer::run, this);
+    return true;
+}
+
+void IndexMaintainer::unwatch() {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!watching) return;
+        stopWatch = true;
+        CancelIoEx(dirHandle, NULL);
+    }
+    watcher.join();
+    lock_guard<mutex> lock(mtx);
+    CloseHandle(dirHandle);
+    dirHandle = INVALID_HANDLE_VALUE;
+    watching = false;
+}
+
+void IndexMaintainer::run() {
+    vector<DWORD> buffer(64 * 1024 / sizeof(DWORD));
+    string renameFrom;
+
+    while (!stopWatch) {
+        DWORD bytes = 0;
+        BOOL ok = ReadDirectoryChangesW(dirHandle, buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)),
+                                        TRUE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                        FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                        &bytes, NULL, NULL);
+        if (!ok || stopWatch) break;
+
+        if (bytes == 0) {
+            // Buffer overflow: the only safe answer is a full refresh
+            lock_guard<mutex> lock(mtx);
+            rebuildLocked();
+            continue;
+        }
+
+        const char *p = (const char *)buffer.data();
+        while (true) {
+            const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *)p;
+            char name[MAX_PATH * 3];
+            int n = WideCharToMultiByte(CP_ACP, 0, info->FileName,
+                                        (int)(info->FileNameLength / sizeof(WCHAR)),
+                                        name, sizeof(name) - 1, NULL, NULL);
+            name[n > 0 ? n : 0] = '\0';
+            string path = rootAbs + PATH_SEP + name;
+
+            switch (info->Action) {
+            case FILE_ACTION_ADDED:            noteCreated(path); break;
+            case FILE_ACTION_REMOVED:          noteRemoved(path); break;
+            case FILE_ACTION_MODIFIED:         noteModified(path); break;
+            case FILE_ACTION_RENAMED_OLD_NAME: renameFrom = path; break;
+            case FILE_ACTION_RENAMED_NEW_NAME:
+                if (renameFrom.empty()) noteCreated(path);
+                else noteMoved(renameFrom, path);
+                renameFrom.clear();
+                break;
+            }
+            if (info->NextEntryOffset == 0) break;
+            p += info->NextEntryOffset;
+        }
+
+        lock_guard<mutex> lock(mtx);
+        flushLocked();
+    }
+}
+#elif defined(__linux__)
+bool IndexMaintainer::watch(const string &root) {
+    if (!attach(root)) return false;
+    lock_guard<mutex> lock(mtx);
+    if (watching) return true;
+
+    notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifyFd < 0) return false;
+    eventBuf.resize(256 * 1024);
+
+    // Subscribe to every directory the index already knows (no crawl needed)
+    watching = true;
+    for (uint32_t id = 0; id < live.size(); ++id) {
+        if (!live.isDir(id)) continue;
+        if (live.attached(id)) addWatch(id, live.pathOf(id, rootAbs));
+    }
+
+    stopWatch = false;
+    watcher = thread(&IndexMaintainer::run, this);
+    return true;
+}
+
+void IndexMaintainer::unwatch() {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!watching) return;
+        stopWatch = true;
+    }
+    watcher.join();
+    lock_guard<mutex> lock(mtx);
+    close(notifyFd);
+    notifyFd = -1;
+    wdNode.clear();
+    watching = false;
+}
+
+void IndexMaintainer::applyEvents(const char *buf, size_t len) {
+    // MOVED_FROM/MOVED_TO pairs share a cookie; pair them up so a rename
+    // is a single node move instead of a delete plus a rescan
+    unordered_map<uint32_t, pair<uint32_t, string>> movedFrom;
+
+    for (size_t off = 0; off < len;) {
+        const struct inotify_event *ev = (const struct inotify_event *)(buf + off);
+        off += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            rebuildLocked();
+            return;
+        }
+        if (ev->mask & IN_IGNORED) {
+            wdNode.erase(ev->wd);
+            continue;
+        }
+
+        auto it = wdNode.find(ev->wd);
+        if (it == wdNode.end() || ev->len == 0) continue;
+        uint32_t dir = it->second;
+        string name = ev->name;
+        if (dir == 0 && name.compare(0, strlen(INDEX_FILE), INDEX_FILE) == 0) continue;
+
+        if (ev->mask & IN_MOVED_FROM) {
+            movedFrom[ev->cookie] = make_pair(dir, name);
+        } else if (ev->mask & IN_MOVED_TO) {
+            auto from = movedFrom.find(ev->cookie);
+            uint32_t id = (from != movedFrom.end())
+                              ? live.child(from->second.first, from->second.second)
+                              : LiveIndex::NONE;
+            if (id != LiveIndex::NONE) {
+                live.move(id, dir, name);
+                movedFrom.erase(from);
+            } else {
+                struct stat st;
+                string full = live.pathOf(dir, rootAbs) + PATH_SEP + name;
+                if (lstat(full.c_str(), &st) == 0)
+                    live.add(dir, name, st, rootAbs, watchHook());
+            }
+        } else if (ev->mask & IN_CREATE) {
+            struct stat st;
+            string full = live.pathOf(dir, rootAbs) + PATH_SEP + name;
+            if (lstat(full.c_str(), &st) == 0)
+                live.add(dir, name, st, rootAbs, watchHook());
+        } else if (ev->mask & IN_DELETE) {
+            live.erase(dir, name);
+        } else if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+            // Written in place: only the meta columns change
+            struct stat st;
+            string full = live.pathOf(dir, rootAbs) + PATH_SEP + name;
+            if (lstat(full.c_str(), &st) != 0 || !live.refresh(dir, name, st)) continue;
+        }
+        changed();
+    }
+
+    // Moved out of the tree
+    for (const auto &m : movedFrom) {
+        live.erase(m.second.first, m.second.second);
+        changed();
+    }
+}
+
+void IndexMaintainer::run() {
+    const chrono::milliseconds quiet(500);
+
+    while (!stopWatch) {
+        struct pollfd pfd = { notifyFd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, 200);
+
+        lock_guard<mutex> lock(mtx);
+        if (ready > 0) drainEvents();
+        if (pending > 0 && chrono::steady_clock::now() - lastChange >= quiet)
+            flushLocked();
+    }
+}
+#else
+bool IndexMaintainer::watch(const string &) { return false; }
+void IndexMaintainer::unwatch() {}
+void IndexMaintainer::run() {}
+#endif
+
+/*-------------------------------------------------------------
+    Answer a search from the index under 'root', if it is usable
+-------------------------------------------------------------*/
+bool searchIndexed(const NameMatcher &matcher, const string &label, const string &root,
+                   char end) {
+    IndexMaintainer &maintainer = IndexMaintainer::instance();
+    if (maintainer.covers(root)) maintainer.flush();
+
+    SearchIndex idx;
+    if (!idx.open(root + PATH_SEP + INDEX_FILE)) return false;
+    if (!maintainer.isWatching(root) && !idx.isCurrent(root)) {
+        (end == '\0' ? cerr : cout) << "(index is out of date, crawling instead; run 'index update')\n";
+        return false;
+    }
+
+    vector<uint32_t> hits;
+    idx.find(matcher, [&](uint32_t id) { hits.push_back(id); });
+    sort(hits.begin(), hits.end());
+
+    string out;
+    for (uint32_t id : hits) {
+        out += idx.pathOf(id, root);
+        out += end;
+    }
+    OutputRouter::send(OutputRouter::capturing(), out.data(), out.size());
+
+    logAction("Searched for: " + label + " in " + root + " (index)");
+    maintainer.attach(root);
+    return true;
+}
+
+/*-------------------------------------------------------------
+    index build|update|watch|unwatch [path]
+-------------------------------------------------------------*/
+void indexCommand(const vector<string> &args) {
+    string mode = args.size() > 1 ? args[1] : "";
+    string root = args.size() > 2 ? args[2] : ".";
+    IndexMaintainer &maintainer = IndexMaintainer::instance();
+
+    if (mode == "build" || mode == "update") {
+        // Node ids change on a rebuild, so a watch has to be re-armed
+        bool rewatch = maintainer.isWatching(root);
+        if (rewatch) maintainer.unwatch();
+        maintainer.flush();
+        if (buildIndex(root, mode == "update")) {
+            maintainer.reload(root);
+            if (rewatch) maintainer.watch(root);
+        }
+    } else if (mode == "watch") {
+        if (maintainer.watch(root)) {
+            cout << "Watching " << root << " for changes.\n";
+            logAction("Started index watch: " + root);
+        } else {
+            cout << "index: cannot watch " << root
+                 << " (build an index there first; watching is supported on Linux and Windows)\n";
+        }
+    } else if (mode == "unwatch") {
+        maintainer.unwatch();
+        maintainer.flush();
+        cout << "Stopped watching.\n";
+    } else {
+        cout << "Usage: index build|update|watch|unwatch [path]\n";
+    }
+}
+
+/*-------------------------------------------------------------
+    Recursive delete engine
+    On POSIX every directory is opened relative to its parent's
+    handle (openat) and its entries are removed with unlinkat, so
+    no path is ever resolved from the root again. Entry types come
+    from d_type. Sibling subtrees are separate pool tasks, and a
+    directory is removed from its parent once the last task in its
+    subtree finishes. A directory's handle stays open until then,
+    so subtrees deeper than RM_FD_DEPTH (or hitting the fd limit)
+    fall back to the path-based walk.
+-------------------------------------------------------------*/
+struct RemoveStats {
+    atomic<long long> files{0}, dirs{0}, failed{0};
+
+    void fail(const string &path, int err) {
+        ++failed;
+        lock_guard<mutex> lock(consoleMutex);
+        cerr << "rm: " << path << ": " << strerror(err) << "\n";
+    }
+};
+
+/*-------------------------------------------------------------
+    Path-based removal on the shared walker
+-------------------------------------------------------------*/
+void removeByWalk(const string &path, RemoveStats &stats) {
+    struct Remover : WalkPolicy<WALK_NO_PREFETCH> {
+        RemoveStats &stats;
+        explicit Remover(RemoveStats &s) : stats(s) {}
+
+        bool entry(const WalkEntry &e) const {
+            if (e.isDir()) return true;
+            throttle(0);
+            perf::count(perf::UNLINKS);
+            if (remove(e.path.c_str()) == 0) ++stats.files;
+            else stats.fail(e.path, errno);
+            return false;
+        }
+        void finishDir(const string &dir, int) const {
+            throttle(0);
+            perf::count(perf::UNLINKS);
+#ifdef _WIN32
+            int rc = _rmdir(dir.c_str());
+#else
+            int rc = rmdir(dir.c_str());
+#endif
+            if (rc == 0) ++stats.dirs;
+            else stats.fail(dir, errno);
+        }
+        void error(const string &dir, int err) const { stats.fail(dir, err); }
+    };
+
+    walkTree(path, Remover(stats));
+}
+
+#ifndef _WIN32
+namespace rm_detail {
+
+const int RM_FD_DEPTH = 64;
+
+struct Node {
+    DIR *dir = NULL;            // open until the whole subtree is gone
+    string path;                // for messages and the fallback only
+    string name;                // name inside the parent
+    int depth = 0;
+    bool gone = false;          // already removed by the fallback walk
+    shared_ptr<Node> parent;
+    atomic<int> pending{1};
+};
+
+struct State {
+    WorkPool &pool;
+    RemoveStats &stats;
+    atomic<bool> done{false};
+
+    State(WorkPool &p, RemoveStats &s) : pool(p), stats(s) {}
+};
+
+// Drop one reference and remove every directory whose subtree is now empty
+void finish(State &rs, shared_ptr<Node> node) {
+    while (node && --node->pending == 0) {
+        if (node->dir) closedir(node->dir);
+        node->dir = NULL;
+
+        shared_ptr<Node> parent = node->parent;
+        throttle(0);
+        perf::count(perf::UNLINKS);
+        if (!parent) {
+            if (rmdir(node->path.c_str()) == 0) ++rs.stats.dirs;
+            else rs.stats.fail(node->path, errno);
+
+            WorkPool &pool = rs.pool;
+            rs.done = true;
+            pool.wakeAll();
+            return;
+        }
+
+        if (!node->gone) {
+            if (unlinkat(dirfd(parent->dir), node->name.c_str(), AT_REMOVEDIR) == 0)
+                ++rs.stats.dirs;
+            else
+                rs.stats.fail(node->path, errno);
+        }
+        node = parent;
+    }
+}
+
+void clearDir(State &rs, shared_ptr<Node> node) {
+    perf::Scope timing(perf::PH_REMOVE);
+    perf::count(perf::DIR_OPENS);
+    perf::count(perf::DIR_READS);
+    if (!node->dir) {
+        int fd = openat(dirfd(node->parent->dir), node->name.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) node->dir = fdopendir(fd);
+        if (!node->dir) {
+            int err = errno;
+            if (fd >= 0) close(fd);
+            if (err == EMFILE || err == ENFILE) {
+                // Out of handles: the path-based walk removes this whole subtree
+                removeByWalk(node->path, rs.stats);
+                node->gone = true;
+            } else {
+                rs.stats.fail(node->path, err);
+            }
+            finish(rs, node);
+            return;
+        }
+    }
+
+    int fd = dirfd(node->dir);
+    struct dirent *entry;
+    while ((entry = readdir(node->dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        EntryType type = ENTRY_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+        type = typeFromDirent(entry->d_type);
+#endif
+        if (type == ENTRY_UNKNOWN) {
+            struct stat st;
+            perf::count(perf::STATS);
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                type = typeFromMode(st.st_mode);
+        }
+
+        perf::count(perf::ENTRIES);
+        if (type != ENTRY_DIR) {
+            throttle(0);
+            perf::count(perf::UNLINKS);
+            if (unlinkat(fd, name, 0) == 0) ++rs.stats.files;
+            else rs.stats.fail(node->path + PATH_SEP + name, errno);
+            continue;
+        }
+
+        string childPath = node->path + PATH_SEP + name;
+        if (node->depth + 1 >= RM_FD_DEPTH) {
+            removeByWalk(childPath, rs.stats);
+            continue;
+        }
+
+        shared_ptr<Node> child = make_shared<Node>();
+        child->path = move(childPath);
+        child->name = name;
+        child->depth = node->depth + 1;
+        child->parent = node;
+        ++node->pending;
+        rs.pool.submit([&rs, child] { clearDir(rs, child); });
+    }
+
+    // Entries are gone; the handle stays open for the child directories
+    finish(rs, node);
+}
+
+// Let this process hold as many directory handles as it is allowed to
+void raiseFdLimit() {
+    static once_flag once;
+    call_once(once, [] {
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    });
+}
+
+} // namespace rm_detail
+#endif
+
+/*-------------------------------------------------------------
+    Remove a file or a whole tree (no summary; shared by rm and mv)
+-------------------------------------------------------------*/
+void removeTree(const string &path, RemoveStats &stats) {
+#ifdef _WIN32
+    if (!isDirectory(path)) {
+        if (remove(path.c_str()) == 0) ++stats.files;
+        else stats.fail(path, errno);
+    } else {
+        removeByWalk(path, stats);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        // Not a directory (or a symlink to one): remove the entry itself
+        if (unlink(path.c_str()) == 0) ++stats.files;
+        else stats.fail(path, errno);
+    } else {
+        rm_detail::raiseFdLimit();
+        WorkPool &pool = WorkPool::shared();
+        rm_detail::State rs(pool, stats);
+
+        shared_ptr<rm_detail::Node> root = make_shared<rm_detail::Node>();
+        root->dir = dir;
+        root->path = path;
+        pool.submit([&rs, root] { rm_detail::clearDir(rs, root); });
+        pool.helpUntil([&rs] { return rs.done.load(); });
+    }
+#endif
+}
+
+/*-------------------------------------------------------------
+    Delete a file or folder (recursively)
+    Prints one summary and writes one log record per command,
+    and reports every path that could not be removed.
+-------------------------------------------------------------*/
+void removeRecursive(const string &path) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    RemoveStats stats;
+    removeTree(path, stats);
+    if (stats.failed == 0) IndexMaintainer::instance().noteRemoved(path);
+    else IndexMaintainer::instance().noteRescan(path);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[128];
+    snprintf(summary, sizeof(summary), "%lld files, %lld dirs in %.3f s, %lld failed",
+             stats.files.load(), stats.dirs.load(), seconds, stats.failed.load());
+    if (stats.files + stats.dirs > 0 || stats.failed == 0)
+        cout << "Removed: " << path << " (" << summary << ")" << endl;
+    logAction("Removed: " + path + " (" + summary + ")");
+}
+
+/*-------------------------------------------------------------
+    Search for a file by name (recursive)
+    Several patterns match if any of them does; see NameMatcher.
+    Uses the filename index when one is present and current
+    (index hits are in tree order already). --sort orders the
+    paths bytewise, under the --mem cap.
+-------------------------------------------------------------*/
+void searchFile(const vector<string> &patterns, bool icase, const string &path = ".",
+                const ResultFormat &fmt = ResultFormat()) {
+    NameMatcher matcher(patterns, icase);
+    string label;
+    for (const string &p : patterns) label += (label.empty() ? "" : " ") + p;
+    if (icase) label += " (ignoring case)";
+    char end = fmt.nul ? '\0' : '\n';
+    unique_ptr<SortedOutput> sorted;
+    if (fmt.sorted) sorted.reset(new SortedOutput(fmt.memory, end));
+
+    if (searchIndexed(matcher, label, path, end)) return;
+
+    // Without an index, read directories through the cache in parallel
+    TaskGroup tasks(WorkPool::shared());
+    ResultWriter out(fmt.ordered);
+    NameArena dirs;     // child directory paths, alive until the search ends
+    function<void(string_view, ResultSlot *, shared_ptr<atomic<bool>>)> scanDir =
+        [&](string_view dir, ResultSlot *slot, shared_ptr<atomic<bool>> opened) {
+        if (opened) *opened = true;
+        PathBuilder full(dir);
+        shared_ptr<const DirListing> l = DirCache::instance().get(full.str(), false);
+        if (!l) {
+            out.close(slot);
+            return;
+        }
+
+        perf::count(perf::ENTRIES, l->count());
+        string hits;
+        uint64_t matched = 0;
+        {
+            perf::Scope timing(perf::PH_MATCH);
+            for (size_t i = 0; i < l->count(); ++i) {
+                const char *name = l->name(i);
+                bool hit = matcher.match(name);
+                matched += hit;
+                if (!hit && l->type(i) != ENTRY_DIR) continue;
+
+                size_t mark = full.push(name);
+                if (hit) {
+                    hits.append(full.str());
+                    hits += end;
+                }
+                if (l->type(i) == ENTRY_DIR) {
+                    string_view child = dirs.store(full.view());
+                    ResultSlot *kid = out.child(slot);
+                    shared_ptr<atomic<bool>> reached = make_shared<atomic<bool>>(false);
+                    prefetchDir(full.str(), false, reached);
+                    tasks.run([&scanDir, child, kid, reached] { scanDir(child, kid, reached); });
+                }
+                full.pop(mark);
+            }
+        }
+        perf::count(perf::MATCHES, matched);
+        out.finish(slot, hits);
+        full.pop(dir.size());
+        logAction("Searched for: " + label + " in " + full.str());
+    };
+
+    ResultSlot *root = out.root();
+    tasks.run([&scanDir, &path, root] { scanDir(string_view(path), root, NULL); });
+    tasks.wait();
+    out.finish();
+}
+
+/*-------------------------------------------------------------
+    Filtered find
+    The tests are compiled into a query ordered by cost: depth
+    and -prune decide whether a directory is opened at all, the
+    type usually comes straight from d_type, a name is a glob
+    match, and only -size / -mtime need a stat, done once and
+    only for entries that passed everything cheaper. With an
+    index the same tests run over its columns instead: name and
+    type tests whenever the index is current, size and mtime
+    only while 'index watch' keeps those columns up to date.
+-------------------------------------------------------------*/
+namespace find_detail {
+
+enum TestKind { TEST_TYPE, TEST_NAME, TEST_SIZE, TEST_MTIME };
+
+struct Test {
+    TestKind kind;
+    int cmp = 0;            // -1 less than, 0 equal, 1 greater than 'value'
+    int64_t value = 0;      // in units
+    int64_t unit = 1;       // bytes (size) or seconds (age) per unit
+    unsigned types = 0;     // bit per EntryType
+    string glob;            // folded when icase
+    bool icase = false;
+
+    // Relative cost; a query runs its cheap tests first
+    int cost() const {
+        switch (kind) {
+        case TEST_TYPE: return 0;
+        case TEST_NAME: return 1;
+        default:        return 2;     // needs a stat
+        }
+    }
+    bool needsMeta() const { return kind == TEST_SIZE || kind == TEST_MTIME; }
+};
+
+// What the tests look at; size and mtime may be filled in on demand
+struct Candidate {
+    const char *name;
+    EntryType type;
+    bool haveMeta;
+    int64_t size, mtime;    // mtime in ns, -1 when unknown
+};
+
+struct Query {
+    vector<Test> tests;
+    vector<string> prune;   // directory globs that are neither reported nor opened
+    int minDepth = 0, maxDepth = INT_MAX;
+    int64_t now = 0;
+
+    void compile() {
+        stable_sort(tests.begin(), tests.end(),
+                    [](const Test &a, const Test &b) { return a.cost() < b.cost(); });
+        now = (int64_t)time(NULL);
+    }
+
+    bool needsMeta() const {
+        for (const Test &t : tests)
+            if (t.needsMeta()) return true;
+        return false;
+    }
+
+    bool pruned(const char *name) const {
+        for (const string &g : prune)
+            if (globMatch(g.c_str(), name, false)) return true;
+        return false;
+    }
+
+    // 'fetch' stats the candidate (type and meta); false if it cannot
+    template <class Fetch>
+    bool match(Candidate &c, Fetch fetch) const {
+        for (const Test &t : tests) {
+            bool needStat = t.needsMeta() || (t.kind == TEST_TYPE && c.type == ENTRY_UNKNOWN);
+            if (needStat && !c.haveMeta && !fetch(c)) return false;
+            if (!passes(t, c)) return false;
+        }
+        return true;
+    }
+
+private:
+    static bool compare(int cmp, int64_t have, int64_t want) {
+        return cmp < 0 ? have < want : cmp > 0 ? have > want : have == want;
+    }
+
+    bool passes(const Test &t, const Candidate &c) const {
+        switch (t.kind) {
+        case TEST_TYPE:
+            return (t.types >> c.type) & 1;
+        case TEST_NAME:
+            return globMatch(t.glob.c_str(), c.name, t.icase);
+        case TEST_SIZE:
+            // Rounded up to whole units, as find(1) does
+            return c.size >= 0 && compare(t.cmp, (c.size + t.unit - 1) / t.unit, t.value);
+        case TEST_MTIME:
+            return c.mtime >= 0 &&
+                   compare(t.cmp, (now - c.mtime / 1000000000LL) / t.unit, t.value);
+        }
+        return false;
+    }
+};
+
+// "+N", "-N" or "N" followed by an optional unit suffix
+bool parseNumber(const string &s, Test &t) {
+    const char *p = s.c_str();
+    if (*p == '+' || *p == '-') t.cmp = (*p++ == '+') ? 1 : -1;
+    if (!isdigit((unsigned char)*p)) return false;
+    char *end;
+    t.value = strtoll(p, &end, 10);
+    if (t.kind == TEST_SIZE) {
+        switch (*end) {
+        case '\0': case 'c': t.unit = 1; break;
+        case 'k': case 'K':  t.unit = 1LL << 10; break;
+        case 'M':            t.unit = 1LL << 20; break;
+        case 'G':            t.unit = 1LL << 30; break;
+        default: return false;
+        }
+        if (*end) ++end;
+    }
+    return *end == '\0';
+}
+
+bool parseTypes(const string &s, Test &t) {
+    for (char c : s) {
+        switch (c) {
+        case 'f': t.types |= 1u << ENTRY_FILE; break;
+        case 'd': t.types |= 1u << ENTRY_DIR; break;
+        case 'l': t.types |= 1u << ENTRY_LINK; break;
+        case ',': break;
+        default: return false;
+        }
+    }
+    return t.types != 0;
+}
+
+// find [path] tests...; false on anything it does not understand
+bool parse(const vector<string> &args, Query &q, string &root) {
+    size_t i = 1;
+    if (i < args.size() && args[i][0] != '-') root = args[i++];
+
+    for (; i < args.size(); ++i) {
+        const string &a = args[i];
+        if (i + 1 >= args.size()) return false;
+        const string &v = args[++i];
+        Test t;
+        if (a == "-name" || a == "-iname") {
+            t.kind = TEST_NAME;
+            t.icase = (a == "-iname");
+            t.glob = v;
+            if (t.icase)
+                for (char &c : t.glob) c = (char)foldByte((unsigned char)c);
+        } else if (a == "-type") {
+            t.kind = TEST_TYPE;
+            if (!parseTypes(v, t)) return false;
+        } else if (a == "-size") {
+            t.kind = TEST_SIZE;
+            if (!parseNumber(v, t)) return false;
+        } else if (a == "-mtime" || a == "-mmin") {
+            t.kind = TEST_MTIME;
+            t.unit = (a == "-mtime") ? 86400 : 60;
+            if (!parseNumber(v, t)) return false;
+        } else if (a == "-mindepth" || a == "-maxdepth") {
+            if (!isdigit((unsigned char)v[0])) return false;
+            (a == "-mindepth" ? q.minDepth : q.maxDepth) = atoi(v.c_str());
+            continue;
+        } else if (a == "-prune") {
+            q.prune.push_back(v);
+            continue;
+        } else {
+            return false;
+        }
+        q.tests.push_back(t);
+    }
+    q.compile();
+    return true;
+}
+
+// Last component of the starting point, which is what -name matches for it
+string baseName(string path) {
+    while (path.size() > 1 && (path.back() == '/' || path.back() == PATH_SEP)) path.pop_back();
+    size_t cut = path.find_last_of("/\\");
+    return cut == string::npos || cut + 1 == path.size() ? path : path.substr(cut + 1);
+}
+
+Candidate fromStat(const char *name, const struct stat &st) {
+    Candidate c = { name, typeFromMode(st.st_mode), true, (int64_t)st.st_size, mtimeNs(st) };
+    return c;
+}
+
+/*-------------------------------------------------------------
+    Run the query over the index under 'root', if it may
+    Output has the shape of the ordered crawl: a directory's
+    hits, then each subdirectory's in turn.
+-------------------------------------------------------------*/
+bool runIndexed(const Query &q, const string &root, char end) {
+    IndexMaintainer &maintainer = IndexMaintainer::instance();
+    if (maintainer.covers(root)) maintainer.flush();
+
+    SearchIndex idx;
+    if (!idx.open(root + PATH_SEP + INDEX_FILE)) return false;
+    if (!maintainer.isWatching(root)) {
+        if (q.needsMeta()) return false;    // the columns may be behind in-place writes
+        if (!idx.isCurrent(root)) {
+            (end == '\0' ? cerr : cout) << "(index is out of date, crawling instead; run 'index update')\n";
+            return false;
+        }
+    }
+
+    auto noFetch = [](Candidate &) { return false; };
+    string out;
+    string rootName = baseName(root);
+    const index_format::Meta &rm = idx.meta(0);
+    Candidate top = { rootName.c_str(), ENTRY_DIR, true, rm.size, rm.mtime };
+    if (q.minDepth == 0 && q.match(top, noFetch)) {
+        out += root;
+        out += end;
+    }
+
+    vector<pair<uint32_t, int>> stack;
+    if (q.maxDepth > 0) stack.push_back(make_pair(0u, 0));
+    vector<uint32_t> subdirs;
+    while (!stack.empty()) {
+        pair<uint32_t, int> cur = stack.back();
+        stack.pop_back();
+        int depth = cur.second + 1;
+
+        uint32_t count;
+        const uint32_t *kids = idx.children(cur.first, count);
+        subdirs.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t id = kids[i];
+            const index_format::Entry &e = idx.entry(id);
+            const index_format::Meta &m = idx.meta(id);
+            Candidate c = { idx.nameOf(id), (EntryType)e.type, true, m.size, m.mtime };
+            bool dir = (c.type == ENTRY_DIR);
+            if (dir && q.pruned(c.name)) continue;
+
+            if (depth >= q.minDepth && q.match(c, noFetch)) {
+                out += idx.pathOf(id, root);
+                out += end;
+            }
+            if (dir && depth < q.maxDepth) subdirs.push_back(id);
+        }
+        for (size_t i = subdirs.size(); i-- > 0;) stack.push_back(make_pair(subdirs[i], depth));
+
+        if (out.size() >= (1 << 20)) {
+            OutputRouter::send(OutputRouter::capturing(), out.data(), out.size());
+            out.clear();
+        }
+    }
+    OutputRouter::send(OutputRouter::capturing(), out.data(), out.size());
+    maintainer.attach(root);
+    return true;
+}
+
+} // namespace find_detail
+
+/*-------------------------------------------------------------
+    find [path] [tests...]
+    Every test must pass (they are ANDed). Without an index,
+    a parallel walk that never opens a pruned directory or one
+    at -maxdepth, and stats only what the cheap tests let by.
+-------------------------------------------------------------*/
+void findFiles(const find_detail::Query &q, const string &root, const string &label,
+               const ResultFormat &fmt = ResultFormat()) {
+    using namespace find_detail;
+    char end = fmt.nul ? '\0' : '\n';
+    unique_ptr<SortedOutput> sorted;
+    if (fmt.sorted) sorted.reset(new SortedOutput(fmt.memory, end));
+
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0) {
+        printError(("find: " + root).c_str());
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode) && runIndexed(q, root, end)) {
+        logAction("Found: " + label + " in " + root + " (index)");
+        return;
+    }
+
+    ResultWriter out(fmt.ordered);
+    string top;
+    string rootName = baseName(root);
+    Candidate c = fromStat(rootName.c_str(), st);
+    if (q.minDepth == 0 && q.match(c, [](Candidate &) { return false; })) {
+        top = root;
+        top += end;
+    }
+    out.put(out.root(), top);
+
+    struct Finder : WalkPolicy<> {
+        const Query &q;
+        char end;
+        Finder(const Query &query, char e) : q(query), end(e) {}
+
+        static string &block() {
+            static thread_local string b;
+            return b;
+        }
+        void enterDir(const string &, int) const { block().clear(); }
+        bool entry(const WalkEntry &e) const {
+            if (e.isDir() && q.pruned(e.name)) return false;
+            if (e.depth == 1 && strncmp(e.name, INDEX_FILE, strlen(INDEX_FILE)) == 0) return false;
+
+            if (e.depth >= q.minDepth) {
+                Candidate c = e.st ? fromStat(e.name, *e.st)
+                                   : Candidate{ e.name, e.type, false, -1, -1 };
+                bool hit = q.match(c, [&e](Candidate &m) {
+                    struct stat st;
+                    if (!statEntry(e.dir, e.name, e.path, st)) return false;
+                    m = fromStat(e.name, st);
+                    return true;
+                });
+                if (hit) {
+                    block() += e.path;
+                    block() += end;
+                }
+            }
+            return e.isDir() && e.depth < q.maxDepth;
+        }
+        void leaveDir(const string &, int) const { output->put(walkSlot(), block()); }
+        void error(const string &dir, int err) const {
+            lock_guard<mutex> lock(consoleMutex);
+            cerr << "find: " << dir << ": " << strerror(err) << "\n";
+        }
+    };
+
+    if (S_ISDIR(st.st_mode) && q.maxDepth > 0) {
+        Finder f(q, end);
+        f.output = &out;
+        walkTree(root, f);
+    }
+    out.finish();
+    logAction("Found: " + label + " in " + root);
+}
+
+/*-------------------------------------------------------------
+    Path completion
+    Lists the entries of the prefix's directory (from the
+    directory cache) whose names start with the last component.
+    Used by 'complete <prefix>' and by a line ending in a Tab.
+-------------------------------------------------------------*/
+void completePath(const string &prefix) {
+    size_t slash = prefix.find_last_of("/\\");
+    string dir = ".", lead, stem = prefix;
+    if (slash != string::npos) {
+        dir = slash == 0 ? prefix.substr(0, 1) : prefix.substr(0, slash);
+        lead = prefix.substr(0, slash + 1);
+        stem = prefix.substr(slash + 1);
+    }
+
+    shared_ptr<const DirListing> l = DirCache::instance().get(dir, false);
+    if (!l) {
+        printError("complete");
+        return;
+    }
+
+    vector<string> matches;
+    for (size_t i = 0; i < l->count(); ++i) {
+        const char *name = l->name(i);
+        if (name[0] == '.' && (stem.empty() || stem[0] != '.')) continue;
+        if (strncmp(name, stem.c_str(), stem.size()) != 0) continue;
+        string m = lead + name;
+        if (l->type(i) == ENTRY_DIR) m += PATH_SEP;
+        matches.push_back(move(m));
+    }
+    sort(matches.begin(), matches.end());
+
+    string out;
+    for (const string &m : matches) out += m + '\n';
+    if (matches.empty()) out = "(no matches)\n";
+    cout << out;
+}
+
+/*-------------------------------------------------------------
+    Directory cache settings and statistics
+    cache                    - show usage (and the read-ahead)
+    cache --budget <N[K|M|G]> - set the memory budget
+    cache --prefetch on|off  - directory read-ahead for walks
+    cache clear              - drop every cached listing
+-------------------------------------------------------------*/
+void cacheCommand(const vector<string> &args) {
+    DirCache &cache = DirCache::instance();
+    double n = 0;
+    if (args.size() == 1) {
+        cache.report();
+        Prefetcher::instance().report();
+    } else if (args[1] == "--prefetch" && args.size() > 2 &&
+               (args[2] == "on" || args[2] == "off")) {
+        Prefetcher::instance().setEnabled(args[2] == "on");
+        cout << "Directory read-ahead " << args[2] << "\n";
+    } else if (args[1] == "clear") {
+        cache.clear();
+        cout << "Directory cache cleared.\n";
+    } else if (args[1] == "--budget" && args.size() > 2 && parseScaled(args[2], n)) {
+        cache.setBudget((size_t)n);
+        cout << "Directory cache budget: " << (size_t)n << " bytes\n";
+    } else {
+        cout << "Usage: cache [clear | --budget <N[K|M|G]> | --prefetch on|off]\n";
+    }
+}
+
+/*-------------------------------------------------------------
+    Content search (grep)
+    Every file becomes its own task on the shared pool, so files
+    are scanned in parallel with the walk that finds them. Large
+    files are memory-mapped; small ones are read into a buffer
+    each worker keeps. A NUL byte in the first 8 KiB marks a file
+    as binary and skips it. Each file's matches are one block for
+    the ResultWriter, so the output for different files never
+    interleaves; with --ordered each file has a slot in walk order.
+-------------------------------------------------------------*/
+struct GrepStats {
+    atomic<long long> files{0}, matchedFiles{0}, matches{0}, binary{0}, bytes{0}, failed{0};
+    ResultWriter *out = NULL;
+    char pathEnd = ':';         // '\0' with -0
+};
+
+struct GrepTarget {
+    string path;
+    ResultSlot *slot;           // NULL unless ordered
+};
+
+const size_t GREP_MMAP_THRESHOLD = 1 << 20;
+const size_t GREP_BINARY_PROBE = 8192;
+
+// Append "path:line:text" for every line of [data, data + n) containing a match
+long long grepBuffer(const char *data, size_t n, const LiteralFinder &finder,
+                     const string &path, char pathEnd, string &out) {
+    long long hits = 0;
+    long long lineNo = 1;
+    size_t counted = 0;     // line numbers are known up to this offset
+    size_t pos = 0;
+
+    while (pos < n) {
+        long at = finder.find(data + pos, n - pos);
+        if (at < 0) break;
+        size_t hit = pos + (size_t)at;
+
+        const char *lineStart = data + hit;
+        while (lineStart > data && lineStart[-1] != '\n') --lineStart;
+        const char *lineEnd = (const char *)memchr(data + hit, '\n', n - hit);
+        if (!lineEnd) lineEnd = data + n;
+
+        for (const char *c = data + counted;
+             (c = (const char *)memchr(c, '\n', lineStart - c)) != NULL; ++c)
+            ++lineNo;
+        counted = (size_t)(lineStart - data);
+
+        out += path;
+        out += pathEnd;
+        out += to_string(lineNo);
+        out += ':';
+        out.append(lineStart, lineEnd);
+        out += '\n';
+        ++hits;
+
+        pos = (size_t)(lineEnd - data) + 1;
+    }
+    return hits;
+}
+
+// Count one file's bytes and hand its matching lines over as one block
+void grepData(const GrepTarget &t, const char *data, size_t n, const LiteralFinder &finder,
+              GrepStats &stats) {
+    static thread_local string out;
+
+    ++stats.files;
+    stats.bytes += (long long)n;
+    perf::count(perf::FILES);
+    out.clear();
+    if (n > 0 && memchr(data, '\0', min(n, GREP_BINARY_PROBE))) {
+        ++stats.binary;
+    } else if (n > 0) {
+        long long hits;
+        {
+            perf::Scope timing(perf::PH_MATCH);
+            hits = grepBuffer(data, n, finder, t.path, stats.pathEnd, out);
+        }
+        if (hits > 0) {
+            perf::count(perf::MATCHES, (uint64_t)hits);
+            stats.matches += hits;
+            ++stats.matchedFiles;
+        }
+    }
+    stats.out->finish(t.slot, out);
+}
+
+void grepFailed(const GrepTarget &t, GrepStats &stats) {
+    ++stats.failed;
+    stats.out->close(t.slot);
+}
+
+void grepFile(const GrepTarget &t, const LiteralFinder &finder, GrepStats &stats) {
+    static thread_local vector<char> buffer;
+    const string &path = t.path;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        grepFailed(t, stats);
+        return;
+    }
+
+    MappedFile map;
+    const char *data = NULL;
+    size_t n = 0;
+    throttle((uint64_t)st.st_size);
+
+    if ((size_t)st.st_size >= GREP_MMAP_THRESHOLD && map.open(path, true)) {
+        data = map.data();
+        n = map.size();
+        perf::count(perf::BYTES_READ, n);
+    } else {
+        perf::count(perf::OPENS);
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            grepFailed(t, stats);
+            return;
+        }
+        size_t want = (size_t)st.st_size + 1;
+        if (buffer.size() < want) buffer.resize(max(want, (size_t)64 * 1024));
+        size_t got;
+        while ((got = fread(buffer.data() + n, 1, buffer.size() - n, f)) > 0) {
+            perf::count(perf::READS);
+            n += got;
+            if (n == buffer.size()) buffer.resize(buffer.size() * 2);
+        }
+        fclose(f);
+        perf::count(perf::BYTES_READ, n);
+        data = buffer.data();
+    }
+
+    grepData(t, data, n, finder, stats);
+}
+
+#ifndef _WIN32
+const size_t GREP_BATCH_FILES = 64;
+const size_t GREP_BATCH_BYTES = 4 << 20;
+
+// Small files of one batch are stat'ed, opened, read and closed in
+// IoBatch rounds; large or unusual files go through grepFile()
+void grepBatch(const vector<GrepTarget> &files, const LiteralFinder &finder, GrepStats &stats) {
+    static thread_local vector<char> buffer;
+    size_t n = files.size();
+    if (n == 1 || !IoBatch::async()) {
+        for (const GrepTarget &f : files) grepFile(f, finder, stats);
+        return;
+    }
+
+    vector<struct stat> sts(n);
+    IoBatch io;
+    for (size_t i = 0; i < n; ++i) io.stat(AT_FDCWD, files[i].path.c_str(), &sts[i], true);
+    io.run();
+
+    vector<size_t> small;
+    for (size_t i = 0; i < n; ++i) {
+        if (io.result(i) != 0 || !S_ISREG(sts[i].st_mode)) grepFailed(files[i], stats);
+        else if ((size_t)sts[i].st_size >= GREP_MMAP_THRESHOLD) grepFile(files[i], finder, stats);
+        else small.push_back(i);
+    }
+
+    io.clear();
+    for (size_t i : small) io.open(AT_FDCWD, files[i].path.c_str(), O_RDONLY);
+    io.run();
+    vector<int> fds(small.size());
+    for (size_t k = 0; k < small.size(); ++k) fds[k] = (int)io.result(k);
+
+    // Read rounds bounded by GREP_BATCH_BYTES
+    for (size_t first = 0; first < small.size();) {
+        size_t last = first, total = 0;
+        vector<size_t> at;
+        while (last < small.size() &&
+               (last == first || total + sts[small[last]].st_size + 1 <= GREP_BATCH_BYTES)) {
+            at.push_back(total);
+            total += (size_t)sts[small[last]].st_size + 1;
+            ++last;
+        }
+        if (buffer.size() < total) buffer.resize(total);
+        throttle(total, last - first);
+
+        io.clear();
+        vector<size_t> slot(last - first, SIZE_MAX);
+        for (size_t k = first; k < last; ++k)
+            if (fds[k] >= 0)
+                slot[k - first] = io.read(fds[k], buffer.data() + at[k - first],
+                                          (size_t)sts[small[k]].st_size + 1, 0);
+        io.run();
+
+        for (size_t k = first; k < last; ++k) {
+            const GrepTarget &t = files[small[k]];
+            if (fds[k] < 0 || io.result(slot[k - first]) < 0) {
+                grepFailed(t, stats);
+                continue;
+            }
+            size_t got = (size_t)io.result(slot[k - first]);
+            if (got > (size_t)sts[small[k]].st_size) grepFile(t, finder, stats);   // grew
+            else grepData(t, buffer.data() + at[k - first], got, finder, stats);
+        }
+        first = last;
+    }
+
+    io.clear();
+    for (int fd : fds)
+        if (fd >= 0) io.close(fd);
+    io.run();
+}
+#endif
+
+/*-------------------------------------------------------------
+    grep [-i] <pattern> [path]
+-------------------------------------------------------------*/
+void grepContent(const string &pattern, bool icase, const string &path = ".",
+                 const ResultFormat &fmt = ResultFormat()) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    LiteralFinder finder(pattern, icase);
+    ResultWriter out(fmt.ordered);
+    GrepStats stats;
+    stats.out = &out;
+    if (fmt.nul) stats.pathEnd = '\0';
+
+    if (!isDirectory(path)) {
+        grepFile(GrepTarget{ path, out.child(out.root()) }, finder, stats);
+    } else {
+        TaskGroup scans(WorkPool::shared());
+#ifdef _WIN32
+        struct Scan : WalkPolicy<> {
+            TaskGroup &scans;
+            const LiteralFinder &finder;
+            GrepStats &stats;
+            Scan(TaskGroup &t, const LiteralFinder &f, GrepStats &s)
+                : scans(t), finder(f), stats(s) {}
+
+            bool entry(const WalkEntry &e) const {
+                if (e.type == ENTRY_FILE) {
+                    GrepTarget file{ e.path, output->child(walkSlot()) };
+                    const LiteralFinder *f = &finder;
+                    GrepStats *st = &stats;
+                    scans.run([file, f, st] { grepFile(file, *f, *st); });
+                }
+                return e.isDir();
+            }
+        };
+        Scan v(scans, finder, stats);
+        v.output = &out;
+        walkTree(path, v);
+#else
+        // Files are handed out in batches so their syscalls can be submitted together
+        struct Scan : WalkPolicy<> {
+            typedef shared_ptr<vector<GrepTarget>> Batch;
+            TaskGroup &scans;
+            const LiteralFinder &finder;
+            GrepStats &stats;
+            mutable mutex mtx;
+            mutable Batch batch = make_shared<vector<GrepTarget>>();
+            Scan(TaskGroup &t, const LiteralFinder &f, GrepStats &s)
+                : scans(t), finder(f), stats(s) {}
+
+            void send(Batch files) const {
+                const LiteralFinder *f = &finder;
+                GrepStats *st = &stats;
+                scans.run([files, f, st] { grepBatch(*files, *f, *st); });
+            }
+            bool entry(const WalkEntry &e) const {
+                if (e.type == ENTRY_FILE) {
+                    ResultSlot *slot = output->child(walkSlot());
+                    Batch full;
+                    {
+                        lock_guard<mutex> lock(mtx);
+                        batch->push_back(GrepTarget{ e.path, slot });
+                        if (batch->size() >= GREP_BATCH_FILES) {
+                            full = batch;
+                            batch = make_shared<vector<GrepTarget>>();
+                        }
+                    }
+                    if (full) send(full);
+                }
+                return e.isDir();
+            }
+        };
+        Scan v(scans, finder, stats);
+        v.output = &out;
+        walkTree(path, v);
+        if (!v.batch->empty()) v.send(v.batch);
+#endif
+        scans.wait();
+    }
+    out.finish();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[200];
+    snprintf(summary, sizeof(summary),
+             "%lld matches in %lld of %lld files (%lld binary skipped), %.1f MB in %.3f s",
+             stats.matches.load(), stats.matchedFiles.load(), stats.files.load(),
+             stats.binary.load(), stats.bytes.load() / (1024.0 * 1024.0), seconds);
+    // With -0 standard output carries nothing but results
+    (fmt.nul ? cerr : cout) << "-- " << summary << "\n";
+    logAction("Searched contents for: " + pattern + " in " + path + " (" + summary + ")");
+}
+
+/*-------------------------------------------------------------
+    XXH64 (streaming)
+    The 64-bit xxHash: four independent lanes of multiply-rotate
+    over 32-byte stripes, so the compiler keeps all four in flight
+    and it runs at memory speed without intrinsics. Reads words in
+    native byte order, which is fine for hashes that never leave
+    the process.
+-------------------------------------------------------------*/
+class XXH64 {
+public:
+    explicit XXH64(uint64_t seed = 0) : seed(seed) {
+        v[0] = seed + P1 + P2;
+        v[1] = seed + P2;
+        v[2] = seed;
+        v[3] = seed - P1;
+    }
+
+    void update(const void *data, size_t n) {
+        const unsigned char *p = (const unsigned char *)data, *end = p + n;
+        total += n;
+        if (used + n < sizeof(buf)) {
+            memcpy(buf + used, p, n);
+            used += n;
+            return;
+        }
+        if (used) {
+            size_t fill = sizeof(buf) - used;
+            memcpy(buf + used, p, fill);
+            stripe(buf);
+            p += fill;
+            used = 0;
+        }
+        for (; end - p >= 32; p += 32) stripe(p);
+        used = (size_t)(end - p);
+        memcpy(buf, p, used);
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; ++i) h = (h ^ round(0, v[i])) * P1 + P4;
+        } else {
+            h = seed + P5;
+        }
+        h += total;
+
+        const unsigned char *p = buf, *end = buf + used;
+        for (; end - p >= 8; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+        if (end - p >= 4) {
+            h = rotl(h ^ (uint64_t)read32(p) * P1, 23) * P2 + P3;
+            p += 4;
+        }
+        for (; p < end; ++p) h = rotl(h ^ *p * P5, 11) * P1;
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+
+private:
+    static const uint64_t P1 = 11400714785074694791ULL;
+    static const uint64_t P2 = 14029467366897019727ULL;
+    static const uint64_t P3 = 1609587929392839161ULL;
+    static const uint64_t P4 = 9650029242287828579ULL;
+    static const uint64_t P5 = 2870177450012600261ULL;
+
+    uint64_t seed;
+    uint64_t v[4];
+    uint64_t total = 0;
+    unsigned char buf[32];
+    size_t used = 0;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t acc, uint64_t in) { return rotl(acc + in * P2, 31) * P1; }
+
+    static uint64_t read64(const unsigned char *p) {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        return x;
+    }
+
+    static uint32_t read32(const unsigned char *p) {
+        uint32_t x;
+        memcpy(&x, p, sizeof(x));
+        return x;
+    }
+
+    void stripe(const unsigned char *p) {
+        v[0] = round(v[0], read64(p));
+        v[1] = round(v[1], read64(p + 8));
+        v[2] = round(v[2], read64(p + 16));
+        v[3] = round(v[3], read64(p + 24));
+    }
+};
+
+/*-------------------------------------------------------------
+    Duplicate finder (dupes)
+      dupes [--min SIZE] [--link | --reflink] [path]
+    Narrows candidates in stages so most files are never read:
+      1. size       - from the walk's stat; hard links to one
+                      inode count once
+      2. edges      - XXH64 of the first and last 4 KiB
+      3. full hash  - XXH64 of the whole file, only for files
+                      whose size and edges both collide
+    Stages 2 and 3 hash files in parallel on the shared pool.
+    --link replaces each duplicate with a hard link to the first
+    file of its group, --reflink with a clone of it (shared
+    extents, separate inodes); both re-compare the data first and
+    swap the file in with a rename.
+-------------------------------------------------------------*/
+const size_t DUPES_EDGE = 4096;
+const size_t DUPES_BATCH = 64;          // files per hashing task
+
+namespace dupes_detail {
+
+struct File {
+    string path;
+    long long size;
+    FileId id;
+    int64_t mtime;
+    uint64_t edge = 0, full = 0;
+    bool ok = true;
+    bool alias = false;     // another name of an inode already listed
+};
+
+struct Totals {
+    atomic<long long> hashed{0}, readFully{0}, failed{0};
+};
+
+// Read up to 'n' bytes at 'off'; the count read, or -1
+long readAt(FILE *f, long long off, char *buf, size_t n) {
+#ifdef _WIN32
+    if (_fseeki64(f, off, SEEK_SET) != 0) return -1;
+#else
+    if (fseeko(f, (off_t)off, SEEK_SET) != 0) return -1;
+#endif
+    perf::count(perf::READS);
+    return (long)fread(buf, 1, n, f);
+}
+
+// Edges hash; for files of up to two edges this is the whole file
+void hashEdges(File &file, Totals &totals) {
+    char buf[2 * DUPES_EDGE];
+    perf::count(perf::OPENS);
+    FILE *f = fopen(file.path.c_str(), "rb");
+    if (!f) {
+        file.ok = false;
+        return;
+    }
+    size_t head = (size_t)min<long long>(file.size, (long long)DUPES_EDGE);
+    size_t tail = (size_t)min<long long>(file.size - (long long)head, (long long)DUPES_EDGE);
+    throttle(head + tail);
+    bool ok = readAt(f, 0, buf, head) == (long)head &&
+              (!tail || readAt(f, file.size - (long long)tail, buf + head, tail) == (long)tail);
+    fclose(f);
+    if (!ok) {
+        file.ok = false;
+        return;
+    }
+
+    XXH64 h;
+    h.update(buf, head + tail);
+    file.edge = h.digest();
+    if (file.size <= (long long)(2 * DUPES_EDGE)) file.full = file.edge;
+    totals.hashed += (long long)(head + tail);
+    perf::count(perf::BYTES_READ, head + tail);
+    perf::count(perf::FILES);
+}
+
+void hashFull(File &file, Totals &totals) {
+    static thread_local vector<char> buffer;
+    if (buffer.empty()) buffer.resize(COPY_BUFFER_SIZE);
+
+    perf::count(perf::OPENS);
+    FILE *f = fopen(file.path.c_str(), "rb");
+    if (!f) {
+        file.ok = false;
+        return;
+    }
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(_WIN32)
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    throttle(0);
+    XXH64 h;
+    long long seen = 0;
+    size_t n;
+    for (;;) {
+        throttle(buffer.size(), 0);
+        perf::count(perf::READS);
+        if ((n = fread(buffer.data(), 1, buffer.size(), f)) == 0) break;
+        h.update(buffer.data(), n);
+        seen += (long long)n;
+    }
+    fclose(f);
+    perf::count(perf::BYTES_READ, (uint64_t)seen);
+    perf::count(perf::FILES);
+    totals.hashed += seen;
+    ++totals.readFully;
+    if (seen != file.size) {
+        file.ok = false;    // changed while we were looking
+        return;
+    }
+    file.full = h.digest();
+}
+
+// Run 'fn' on every listed file in parallel, DUPES_BATCH files per task
+void hashAll(vector<File> &files, const vector<size_t> &which, void (*fn)(File &, Totals &),
+             Totals &totals) {
+    TaskGroup tasks(WorkPool::shared());
+    for (size_t first = 0; first < which.size(); first += DUPES_BATCH) {
+        size_t last = min(which.size(), first + DUPES_BATCH);
+        tasks.run([&files, &which, fn, &totals, first, last] {
+            for (size_t k = first; k < last; ++k) fn(files[which[k]], totals);
+        });
+    }
+    tasks.wait();
+}
+
+// Runs of equal 'key' with at least two members in 'ids' (sorted by key)
+template <class Key>
+vector<pair<size_t, size_t>> runs(const vector<size_t> &ids, Key key) {
+    vector<pair<size_t, size_t>> out;
+    for (size_t i = 0; i < ids.size();) {
+        size_t j = i + 1;
+        while (j < ids.size() && key(ids[j]) == key(ids[i])) ++j;
+        if (j - i > 1) out.push_back(make_pair(i, j));
+        i = j;
+    }
+    return out;
+}
+
+// Put 'dup' back as a hard link or clone of 'keep', via a temporary name
+bool replaceDuplicate(const File &keep, const File &dup, bool reflink, string &why) {
+    struct stat now;
+    if (stat(dup.path.c_str(), &now) != 0 || (long long)now.st_size != dup.size ||
+        mtimeNs(now) != dup.mtime) {
+        why = "changed since the scan";
+        return false;
+    }
+    if (!sameContents(keep.path, dup.path)) {
+        why = "contents differ";
+        return false;
+    }
+
+    string tmp = dup.path + ".fe-dupe";
+#ifdef _WIN32
+    (void)reflink;
+    if (!CreateHardLinkA(tmp.c_str(), keep.path.c_str(), NULL)) {
+        why = "cannot create a hard link";
+        return false;
+    }
+#else
+    if (!reflink) {
+        if (link(keep.path.c_str(), tmp.c_str()) != 0) {
+            why = strerror(errno);
+            return false;
+        }
+    } else {
+#ifdef FICLONE
+        int in = open(keep.path.c_str(), O_RDONLY);
+        int out = in >= 0 ? open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, now.st_mode & 07777) : -1;
+        bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+        if (!ok) why = strerror(errno);
+        if (ok) {
+            // The clone keeps the duplicate's own metadata
+            fchmod(out, now.st_mode & 07777);
+            struct timespec times[2];
+            times[0] = now.st_atim;
+            times[1] = now.st_mtim;
+            futimens(out, times);
+        }
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+        if (!ok) {
+            unlink(tmp.c_str());
+            return false;
+        }
+#else
+        why = "reflinks are not supported here";
+        return false;
+#endif
+    }
+#endif
+    if (!replaceFile(tmp, dup.path)) {
+        why = strerror(errno);
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace dupes_detail
+
+void findDuplicates(const string &root, long long minSize, int replace) {
+    using namespace dupes_detail;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Stage 1: every regular file and its size
+    struct Collect : WalkPolicy<WALK_STAT> {
+        vector<File> &files;
+        long long minSize;
+        mutable mutex mtx;
+        Collect(vector<File> &f, long long m) : files(f), minSize(m) {}
+
+        bool entry(const WalkEntry &e) const {
+            if (e.type == ENTRY_FILE && e.st && (long long)e.st->st_size >= minSize) {
+                File f;
+                f.path = e.path;
+                f.size = (long long)e.st->st_size;
+                f.id = FileId{ (uint64_t)e.st->st_dev, (uint64_t)e.st->st_ino };
+                f.mtime = mtimeNs(*e.st);
+                lock_guard<mutex> lock(mtx);
+                files.push_back(move(f));
+            }
+            return e.isDir();
+        }
+    };
+    vector<File> files;
+    walkTree(root, Collect(files, minSize));
+    long long scanned = (long long)files.size();
+
+    vector<size_t> ids(files.size());
+    for (size_t i = 0; i < ids.size(); ++i) ids[i] = i;
+    sort(ids.begin(), ids.end(), [&](size_t a, size_t b) {
+        if (files[a].size != files[b].size) return files[a].size > files[b].size;
+        return files[a].path < files[b].path;
+    });
+
+    // Names of one inode share its storage: only the first takes part
+    vector<size_t> candidates;
+    for (const pair<size_t, size_t> &r : runs(ids, [&](size_t i) { return files[i].size; })) {
+        unordered_map<FileId, size_t, FileIdHash> seen;
+        vector<size_t> distinct;
+        for (size_t k = r.first; k < r.second; ++k) {
+            File &f = files[ids[k]];
+            if (seen.emplace(f.id, ids[k]).second) distinct.push_back(ids[k]);
+            else f.alias = true;
+        }
+        if (distinct.size() > 1) candidates.insert(candidates.end(), distinct.begin(), distinct.end());
+    }
+
+    // Stage 2: first and last 4 KiB
+    Totals totals;
+    hashAll(files, candidates, hashEdges, totals);
+    auto byEdge = [&](size_t a, size_t b) {
+        if (files[a].size != files[b].size) return files[a].size > files[b].size;
+        return files[a].edge < files[b].edge;
+    };
+    candidates.erase(remove_if(candidates.begin(), candidates.end(),
+                               [&](size_t i) { return !files[i].ok; }),
+                     candidates.end());
+    sort(candidates.begin(), candidates.end(), byEdge);
+
+    // Stage 3: full hashes where size and edges collide
+    vector<size_t> fullIds, whole;
+    for (const pair<size_t, size_t> &r : runs(candidates, [&](size_t i) {
+             return make_pair(files[i].size, files[i].edge);
+         })) {
+        for (size_t k = r.first; k < r.second; ++k) {
+            const File &f = files[candidates[k]];
+            if (f.size > (long long)(2 * DUPES_EDGE)) whole.push_back(candidates[k]);
+            fullIds.push_back(candidates[k]);
+        }
+    }
+    hashAll(files, whole, hashFull, totals);
+    fullIds.erase(remove_if(fullIds.begin(), fullIds.end(), [&](size_t i) { return !files[i].ok; }),
+                  fullIds.end());
+    sort(fullIds.begin(), fullIds.end(), [&](size_t a, size_t b) {
+        if (files[a].size != files[b].size) return files[a].size > files[b].size;
+        if (files[a].full != files[b].full) return files[a].full < files[b].full;
+        return files[a].path < files[b].path;
+    });
+
+    vector<pair<size_t, size_t>> groups = runs(fullIds, [&](size_t i) {
+        return make_pair(files[i].size, files[i].full);
+    });
+    // Most space to win first
+    stable_sort(groups.begin(), groups.end(),
+                [&](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+                    return files[fullIds[a.first]].size * (long long)(a.second - a.first - 1) >
+                           files[fullIds[b.first]].size * (long long)(b.second - b.first - 1);
+                });
+
+    OutputWriter w;
+    long long dupFiles = 0, reclaimable = 0, replaced = 0, failed = 0;
+    for (const pair<size_t, size_t> &g : groups) {
+        const File &keep = files[fullIds[g.first]];
+        long long extra = (long long)(g.second - g.first - 1);
+        dupFiles += extra;
+        reclaimable += extra * keep.size;
+
+        char head[128];
+        snprintf(head, sizeof(head), "%lld files x %s (%s reclaimable):\n",
+                 extra + 1, humanSize(keep.size).c_str(), humanSize(extra * keep.size).c_str());
+        w.put(head);
+        for (size_t k = g.first; k < g.second; ++k) {
+            const File &f = files[fullIds[k]];
+            w.put("    ", 4);
+            w.put(f.path);
+            if (replace && k > g.first) {
+                string why;
+                if (replaceDuplicate(keep, f, replace == 2, why)) {
+                    ++replaced;
+                    w.put(replace == 2 ? "  -> cloned" : "  -> linked");
+                } else {
+                    ++failed;
+                    w.put("  (kept: ");
+                    w.put(why);
+                    w.put(")");
+                }
+            }
+            w.put('\n');
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "%zu groups, %lld duplicate files, %s reclaimable; %lld files scanned, "
+             "%zu hashed, %lld read in full, %s read in %.3f s",
+             groups.size(), dupFiles, humanSize(reclaimable).c_str(), scanned, candidates.size(),
+             totals.readFully.load(), humanSize(totals.hashed.load()).c_str(), seconds);
+    w.put("-- ");
+    w.put(summary);
+    w.put('\n');
+    if (replace) {
+        snprintf(summary + strlen(summary), sizeof(summary) - strlen(summary),
+                 "; %lld replaced, %lld kept", replaced, failed);
+        w.putNum(replaced);
+        w.put(replace == 2 ? " duplicates cloned, " : " duplicates hard-linked, ");
+        w.putNum(failed);
+        w.put(" kept\n");
+        DirCache::instance().clear();
+    }
+    w.flush();
+    logAction("Found duplicates in: " + root + " (" + summary + ")");
+}
+
+/*-------------------------------------------------------------
+    Disk usage (du)
+    Sums allocated blocks and apparent sizes bottom-up over a
+    parallel traversal; a file with several hard links is counted
+    once per run. Each directory's own totals (its direct files
+    plus the names of its subdirectories) are cached by (dev, ino)
+    and reused while the directory's mtime and ctime are
+    unchanged, so an untouched subtree costs one stat per
+    directory and no readdir. A file rewritten in place does not
+    touch its directory's mtime; 'du --fresh' skips the cache.
+-------------------------------------------------------------*/
+struct DuTotals {
+    long long allocated = 0, apparent = 0, files = 0;
+};
+
+long long allocatedBytes(const struct stat &st) {
+#ifdef _WIN32
+    return ((long long)st.st_size + 4095) & ~4095LL;     // no st_blocks; assume 4 KiB clusters
+#else
+    return (long long)st.st_blocks * 512;
+#endif
+}
+
+struct DuLinked {
+    FileId id;
+    long long allocated, apparent;
+};
+
+struct DuCacheEntry {
+    int64_t mtime, ctime;
+    DuTotals own;               // direct non-directory entries with a single link
+    vector<string> subdirs;
+    vector<DuLinked> linked;    // direct entries with several links, deduplicated per run
+};
+
+class DuCache {
+public:
+    static DuCache &instance() {
+        static DuCache cache;
+        return cache;
+    }
+
+    shared_ptr<const DuCacheEntry> lookup(const FileId &id, int64_t mtime, int64_t ctime) {
+        lock_guard<mutex> lock(mtx);
+        auto it = entries.find(id);
+        if (it == entries.end() || it->second->mtime != mtime || it->second->ctime != ctime)
+            return nullptr;
+        return it->second;
+    }
+
+    void store(const FileId &id, shared_ptr<const DuCacheEntry> entry) {
+        lock_guard<mutex> lock(mtx);
+        entries[id] = entry;
+    }
+
+private:
+    mutex mtx;
+    unordered_map<FileId, shared_ptr<const DuCacheEntry>, FileIdHash> entries;
+};
+
+namespace du_detail {
+
+struct Node {
+    string path;
+    int depth = 0;
+    struct stat st;
+    shared_ptr<Node> parent;
+    atomic<int> pending{1};
+    atomic<bool> opened{false};
+    atomic<long long> allocated{0}, apparent{0}, files{0};
+};
+
+struct State {
+    WorkPool &pool;
+    int printDepth;
+    bool useCache;
+
+    mutex mtx;
+    unordered_map<FileId, char, FileIdHash> seenLinks;
+    vector<pair<string, DuTotals>> rows;
+    DuTotals total;
+
+    atomic<long long> dirsRead{0}, dirsCached{0}, errors{0};
+    atomic<bool> done{false};
+
+    State(WorkPool &p, int depth, bool cache) : pool(p), printDepth(depth), useCache(cache) {}
+};
+
+void addLinked(State &ds, Node &node, const DuLinked &l) {
+    {
+        lock_guard<mutex> lock(ds.mtx);
+        if (!ds.seenLinks.emplace(l.id, 1).second) return;
+    }
+    node.allocated += l.allocated;
+    node.apparent += l.apparent;
+    node.files++;
+}
+
+// Fold finished subtrees into their parents, bottom-up
+void finish(State &ds, shared_ptr<Node> node) {
+    while (node && --node->pending == 0) {
+        DuTotals t;
+        t.allocated = node->allocated;
+        t.apparent = node->apparent;
+        t.files = node->files;
+
+        shared_ptr<Node> parent = node->parent;
+        {
+            lock_guard<mutex> lock(ds.mtx);
+            if (node->depth <= ds.printDepth) ds.rows.push_back(make_pair(node->path, t));
+            if (!parent) ds.total = t;
+        }
+        if (!parent) {
+            WorkPool &pool = ds.pool;
+            ds.done = true;
+            pool.wakeAll();
+            return;
+        }
+
+        parent->allocated += t.allocated;
+        parent->apparent += t.apparent;
+        parent->files += t.files;
+        node = parent;
+    }
+}
+
+void scanDir(State &ds, shared_ptr<Node> node);
+
+void spawn(State &ds, const shared_ptr<Node> &parent, string path, const struct stat &st) {
+    shared_ptr<Node> child = make_shared<Node>();
+    child->path = move(path);
+    child->depth = parent->depth + 1;
+    child->st = st;
+    child->parent = parent;
+    prefetchDir(child->path, true, shared_ptr<const atomic<bool>>(child, &child->opened));
+    ++parent->pending;
+    ds.pool.submit([&ds, child] { scanDir(ds, child); });
+}
+
+void scanDir(State &ds, shared_ptr<Node> node) {
+    node->opened = true;
+    node->allocated += allocatedBytes(node->st);
+    node->apparent += node->st.st_size;
+
+    FileId id = { (uint64_t)node->st.st_dev, (uint64_t)node->st.st_ino };
+    int64_t mtime = mtimeNs(node->st), ctime = ctimeNs(node->st);
+#ifdef _WIN32
+    bool cacheable = false;     // no stable inode numbers
+#else
+    bool cacheable = ds.useCache;
+#endif
+
+    shared_ptr<const DuCacheEntry> cached;
+    if (cacheable) cached = DuCache::instance().lookup(id, mtime, ctime);
+    if (cached) {
+        ++ds.dirsCached;
+        node->allocated += cached->own.allocated;
+        node->apparent += cached->own.apparent;
+        node->files += cached->own.files;
+        for (const DuLinked &l : cached->linked) addLinked(ds, *node, l);
+
+        for (const string &name : cached->subdirs) {
+            string child = node->path + PATH_SEP + name;
+            struct stat st;
+#ifdef _WIN32
+            if (stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+#else
+            if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+#endif
+                spawn(ds, node, move(child), st);
+        }
+        finish(ds, node);
+        return;
+    }
+
+    DIR *dir = opendir(node->path.c_str());
+    if (!dir) {
+        ++ds.errors;
+        lock_guard<mutex> lock(consoleMutex);
+        cerr << "du: " << node->path << ": " << strerror(errno) << "\n";
+        finish(ds, node);
+        return;
+    }
+    ++ds.dirsRead;
+    perf::count(perf::DIR_OPENS);
+    perf::count(perf::DIR_READS);
+    perf::Scope timing(perf::PH_READDIR);
+
+    shared_ptr<DuCacheEntry> entry = make_shared<DuCacheEntry>();
+    entry->mtime = mtime;
+    entry->ctime = ctime;
+
+    PathBuilder child(node->path);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        size_t mark = child.push(name);
+        perf::count(perf::ENTRIES);
+        struct stat st;
+        bool ok = statEntry(dir, name, child.str(), st);
+        if (ok && S_ISDIR(st.st_mode)) spawn(ds, node, child.str(), st);
+        child.pop(mark);
+        if (!ok) {
+            ++ds.errors;
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            entry->subdirs.push_back(name);
+        } else if (st.st_nlink > 1) {
+            DuLinked l = { { (uint64_t)st.st_dev, (uint64_t)st.st_ino },
+                           allocatedBytes(st), (long long)st.st_size };
+            entry->linked.push_back(l);
+            addLinked(ds, *node, l);
+        } else {
+            entry->own.allocated += allocatedBytes(st);
+            entry->own.apparent += st.st_size;
+            entry->own.files++;
+        }
+    }
+    closedir(dir);
+
+    node->allocated += entry->own.allocated;
+    node->apparent += entry->own.apparent;
+    node->files += entry->own.files;
+    if (cacheable) DuCache::instance().store(id, entry);
+    finish(ds, node);
+}
+
+} // namespace du_detail
+
+/*-------------------------------------------------------------
+    du [-d depth] [--fresh] [path]
+    Prints every directory down to 'depth' (default 1), largest
+    first, followed by the total for 'path'.
+-------------------------------------------------------------*/
+void diskUsage(const string &path, int depth, bool fresh) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        printError("du");
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        cout << humanSize(allocatedBytes(st)) << "\t" << humanSize(st.st_size)
+             << "\t1\t" << path << endl;
+        return;
+    }
+
+    WorkPool &pool = WorkPool::shared();
+    du_detail::State ds(pool, depth, !fresh);
+    shared_ptr<du_detail::Node> root = make_shared<du_detail::Node>();
+    root->path = path;
+    root->st = st;
+    pool.submit([&ds, root] { du_detail::scanDir(ds, root); });
+    pool.helpUntil([&ds] { return ds.done.load(); });
+
+    sort(ds.rows.begin(), ds.rows.end(),
+         [](const pair<string, DuTotals> &a, const pair<string, DuTotals> &b) {
+             return a.second.allocated > b.second.allocated;
+         });
+
+    string out = "allocated\tapparent\tfiles\tpath\n";
+    for (const auto &row : ds.rows) {
+        if (row.first == path) continue;
+        out += humanSize(row.second.allocated) + "\t\t" + humanSize(row.second.apparent) +
+               "\t\t" + to_string(row.second.files) + "\t" + row.first + "\n";
+    }
+    out += humanSize(ds.total.allocated) + "\t\t" + humanSize(ds.total.apparent) + "\t\t" +
+           to_string(ds.total.files) + "\t" + path + " (total)\n";
+    cout << out;
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[160];
+    snprintf(summary, sizeof(summary),
+             "%lld bytes allocated, %lld apparent; %lld dirs read, %lld cached, in %.3f s",
+             ds.total.allocated, ds.total.apparent, ds.dirsRead.load(), ds.dirsCached.load(),
+             seconds);
+    cout << "-- " << summary << endl;
+    logAction("Disk usage of: " + path + " (" + summary + ")");
+}
+
+
+
+
+/*-------------------------------------------------------------
+    Create an empty file (similar to Linux 'touch')
+-------------------------------------------------------------*/
+void touchFile(const string &path) {
+    FILE *f = fopen(path.c_str(), "ab");
+    if (f) {
+        fclose(f);
+        cout << "File created/updated: " << path << endl;
+        IndexMaintainer::instance().noteCreated(path);
+        DirCache::instance().forgetParent(path);
+        logAction("Created or updated file: " + path);
+    } else {
+        printError("touch");
+    }
+}
+
+
+/*-------------------------------------------------------------
+    Create a new folder
+-------------------------------------------------------------*/
+void makeDir(const string &path) {
+#ifdef _WIN32
+    bool ok = CreateDirectoryA(path.c_str(), NULL) != 0;
+#else
+    bool ok = mkdir(path.c_str(), 0755) == 0;
+#endif
+    if (ok) {
+        cout << "Directory created: " << path << endl;
+        IndexMaintainer::instance().noteCreated(path);
+    } else {
+        printError("mkdir");
+    }
+    logAction("Created directory: " + path);
+}
+
+
+/*-------------------------------------------------------------
+    Move across filesystems (mv when rename() reports EXDEV)
+    The tree is copied by the parallel copy engine and every copy
+    is checked against its source (size and mtime, or all data
+    with --verify). The target filesystem is then flushed, and
+    only after that does the fd-based rm engine remove the
+    source. A journal next to the target (<dest>.mv-journal)
+    holds the source and the phase. Running the same mv again
+    after an interruption resumes: files already copied (same
+    size and mtime) are skipped, and a move that reached the
+    delete phase goes straight back to deleting.
+-------------------------------------------------------------*/
+namespace move_detail {
+
+const char *JOURNAL_MAGIC = "fe-move 1";
+
+string journalPath(const string &dest) {
+    string p = dest;
+    while (p.size() > 1 && (p.back() == '/' || p.back() == PATH_SEP)) p.pop_back();
+    return p + ".mv-journal";
+}
+
+// Source and phase ("copy" or "delete") of an unfinished move
+bool readJournal(const string &path, string &source, string &phase) {
+    ifstream in(path.c_str());
+    string magic;
+    return in && getline(in, magic) && magic == JOURNAL_MAGIC && getline(in, source) &&
+           getline(in, phase);
+}
+
+bool writeJournal(const string &path, const string &source, const string &phase) {
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp.c_str(), ios::trunc);
+        out << JOURNAL_MAGIC << '\n' << source << '\n' << phase << '\n';
+        out.flush();
+        if (!out) return false;
+    }
+    return replaceFile(tmp, path);
+}
+
+// Flush the target filesystem so no copy is lost once its source is gone
+void syncTarget(const string &dir) {
+#ifdef _WIN32
+    (void)dir;
+#else
+#ifdef __linux__
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        int rc = syncfs(fd);
+        close(fd);
+        if (rc == 0) return;
+    }
+#else
+    (void)dir;
+#endif
+    sync();
+#endif
+}
+
+string parentOf(const string &path) {
+    size_t cut = path.find_last_of("/\\");
+    return cut == string::npos ? "." : (cut == 0 ? path.substr(0, 1) : path.substr(0, cut));
+}
+
+void report(const string &src, const string &dest, const TreeCopier &copier,
+            chrono::steady_clock::time_point start) {
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[200];
+    snprintf(summary, sizeof(summary),
+             "across filesystems: %lld files, %lld dirs, %lld bytes in %.3f s (%.1f MB/s), "
+             "%lld already there",
+             copier.files.load(), copier.dirs.load(), copier.bytes.load(), seconds,
+             seconds > 0 ? copier.bytes.load() / seconds / (1024.0 * 1024.0) : 0.0,
+             copier.skipped.load());
+    cout << "Moved: " << src << " -> " << dest << " (" << summary << ")" << endl;
+    logAction("Moved/Renamed: " + src + " -> " + dest + " (" + summary + ")");
+}
+
+} // namespace move_detail
+
+bool moveAcross(const string &src, const string &dest, bool compare) {
+    using namespace move_detail;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    struct stat st;
+#ifdef _WIN32
+    if (stat(src.c_str(), &st) != 0) {
+#else
+    if (lstat(src.c_str(), &st) != 0) {
+#endif
+        printError("mv");
+        return false;
+    }
+
+    TreeCopier copier;
+    copier.verifyCopies(compare);
+
+#ifndef _WIN32
+    if (S_ISLNK(st.st_mode)) {
+        char link[4096];
+        ssize_t n = readlink(src.c_str(), link, sizeof(link) - 1);
+        if (n < 0) {
+            printError("mv");
+            return false;
+        }
+        link[n] = '\0';
+        unlink(dest.c_str());
+        if (symlink(link, dest.c_str()) != 0 || unlink(src.c_str()) != 0) {
+            printError("mv");
+            return false;
+        }
+        ++copier.files;
+        report(src, dest, copier, start);
+        return true;
+    }
+#endif
+
+    if (!S_ISDIR(st.st_mode)) {
+        Progress::plan((long long)st.st_size, 1);
+        Progress::planned();
+        copier.add(src, dest, st);
+        copier.finish();
+        if (copier.failures) return false;
+        syncTarget(parentOf(dest));
+        if (remove(src.c_str()) != 0) {
+            printError("mv");
+            return false;
+        }
+        report(src, dest, copier, start);
+        return true;
+    }
+
+    string journal = journalPath(dest);
+    string absSrc = absolutePath(src), recorded, phase;
+    bool resume = readJournal(journal, recorded, phase);
+    if (resume && recorded != absSrc) {
+        cerr << "mv: " << journal << " belongs to an unfinished move from " << recorded << "\n";
+        return false;
+    }
+
+    if (!resume) {
+        // Like rename(), only an empty directory may be replaced
+        struct stat dst;
+        if (stat(dest.c_str(), &dst) == 0) {
+#ifdef _WIN32
+            int rc = S_ISDIR(dst.st_mode) ? _rmdir(dest.c_str()) : (errno = ENOTDIR, -1);
+#else
+            int rc = S_ISDIR(dst.st_mode) ? rmdir(dest.c_str()) : (errno = ENOTDIR, -1);
+#endif
+            if (rc != 0) {
+                printError("mv");
+                return false;
+            }
+        }
+        if (!writeJournal(journal, absSrc, "copy")) {
+            printError("mv");
+            return false;
+        }
+        phase = "copy";
+    } else {
+        cout << "Resuming move: " << src << " -> " << dest << " (" << phase << " phase)" << endl;
+    }
+
+    if (phase != "delete") {
+        if (!createDirectory(dest, (st.st_mode & 07777) | 0700)) {
+            printError("mv");
+            return false;
+        }
+        ++copier.dirs;
+        copyTree(src, dest, copier, resume);
+        if (copier.failures) {
+            cerr << "mv: " << copier.failures.load() << " item(s) not copied; " << src
+                 << " is untouched. Run the same mv again to resume.\n";
+            return false;
+        }
+        syncTarget(dest);
+        if (!writeJournal(journal, absSrc, "delete")) {
+            printError("mv");
+            return false;
+        }
+    }
+
+    RemoveStats removed;
+    removeTree(src, removed);
+    if (removed.failed) {
+        cerr << "mv: " << removed.failed.load() << " source item(s) not removed. "
+             << "Run the same mv again to finish.\n";
+        return false;
+    }
+    remove(journal.c_str());
+    report(src, dest, copier, start);
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Move or rename a file
+    Falls back to copy-and-delete when the target is on another
+    filesystem; --verify compares the data of every copy.
+-------------------------------------------------------------*/
+void moveFile(const string &src, const string &dest, bool verify = false) {
+    if (rename(src.c_str(), dest.c_str()) == 0) {
+        cout << "Moved: " << src << " -> " << dest << endl;
+        IndexMaintainer::instance().noteMoved(src, dest);
+        logAction("Moved/Renamed: " + src + " -> " + dest);
+        return;
+    }
+    // A journal means an earlier cross-device move into 'dest' is unfinished
+    int err = errno;
+    bool resuming = access(move_detail::journalPath(dest).c_str(), F_OK) == 0;
+    if (err != EXDEV && !resuming) {
+        errno = err;
+        printError("mv");
+        return;
+    }
+
+    DirCache::instance().forgetParent(src);
+    DirCache::instance().forgetParent(dest);
+    if (moveAcross(src, dest, verify)) IndexMaintainer::instance().noteMoved(src, dest);
+}
+
+/*-------------------------------------------------------------
+    Incremental mirror (sync)
+      sync [--delete] [--dry-run] <src> <dest>
+    Makes 'dest' a copy of 'src' and touches only what differs.
+    Each directory pair is listed side by side (one batched lstat
+    per side) as its own pool task, so both trees are walked in
+    parallel. For each name:
+      only in src     - copied (new directories are recursed)
+      in both         - skipped when type, size and mtime match;
+                        changed small files are copied again,
+                        large ones go through deltaUpdate()
+      only in dest    - removed with --delete, otherwise left
+    Directory mtimes are not mirrored (cp -r does not either).
+-------------------------------------------------------------*/
+const long long SYNC_DELTA_MIN = 1 << 20;   // smaller files are simply copied
+const size_t SYNC_BLOCK = 64 * 1024;
+const size_t SYNC_LIST_BUFFER = 64 * 1024;
+
+namespace sync_detail {
+
+struct Entry {
+    string name;
+    EntryType type;
+    struct stat st;
+};
+
+// Every entry of 'dir' with its lstat, sorted by name
+bool listDir(const string &dir, vector<Entry> &out) {
+    out.clear();
+    DirStream ds(SYNC_LIST_BUFFER);
+    if (!ds.open(dir)) return false;
+    while (ds.nextStatBatch([&](const char *name, EntryType type, const struct stat *st) {
+        Entry e;
+        e.name = name;
+        e.type = st ? type : ENTRY_UNKNOWN;
+        if (st) e.st = *st;
+        else memset(&e.st, 0, sizeof(e.st));
+        out.push_back(move(e));
+    }, false)) {
+    }
+    sort(out.begin(), out.end(), [](const Entry &a, const Entry &b) { return a.name < b.name; });
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Block-level update of one large file
+    A rolling checksum (rsync's weak sum over SYNC_BLOCK bytes)
+    slides over the new data and looks for blocks of the old
+    file anywhere in it, so inserted or removed bytes only cost
+    the bytes themselves; candidates are confirmed with memcmp,
+    as both files are local. When every block found is still at
+    its old offset, only the changed spans are written, in place.
+    Otherwise the file is rebuilt beside the target from old
+    blocks and new spans and renamed over it. Both ways the data
+    moves through copy_file_range.
+-------------------------------------------------------------*/
+struct Piece {
+    long long at, len;      // range of the new file
+    long long from;         // offset in the old file, or -1 for new data
+};
+
+inline uint32_t weakSum(const unsigned char *p, size_t n, uint32_t &a, uint32_t &b) {
+    a = b = 0;
+    for (size_t i = 0; i < n; ++i) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Pieces that rebuild 'src' from 'old'; false once the new data would
+// exceed half the file, where a plain copy is just as good
+bool planDelta(const unsigned char *src, long long ns, const unsigned char *old, long long no,
+               vector<Piece> &plan) {
+    const size_t B = SYNC_BLOCK;
+    plan.clear();
+    long long blocks = no / (long long)B;
+    if (blocks == 0 || ns < (long long)B) return false;
+
+    unordered_multimap<uint32_t, long long> sums;
+    vector<uint64_t> filter(1 << 14);       // 2^20-bit presence filter over the sums
+    sums.reserve((size_t)blocks);
+    for (long long j = 0; j < blocks; ++j) {
+        uint32_t a, b, s = weakSum(old + j * B, B, a, b);
+        sums.emplace(s, j);
+        uint32_t bit = (s * 2654435761u) >> 12;
+        filter[bit >> 6] |= 1ULL << (bit & 63);
+    }
+
+    long long literal = 0, litStart = 0, p = 0;
+    uint32_t a, b;
+    weakSum(src, B, a, b);
+    while (p + (long long)B <= ns) {
+        uint32_t s = (a & 0xffff) | (b << 16);
+        uint32_t bit = (s * 2654435761u) >> 12;
+        long long match = -1;
+        if (filter[bit >> 6] & (1ULL << (bit & 63))) {
+            auto range = sums.equal_range(s);
+            for (auto it = range.first; it != range.second; ++it) {
+                long long j = it->second;
+                if (memcmp(src + p, old + j * B, B) != 0) continue;
+                match = j;
+                if (j * (long long)B == p) break;       // prefer the block in place
+            }
+        }
+        if (match >= 0) {
+            if (p > litStart) {
+                plan.push_back(Piece{ litStart, p - litStart, -1 });
+                literal += p - litStart;
+            }
+            if (!plan.empty() && plan.back().from >= 0 &&
+                plan.back().from + plan.back().len == match * (long long)B)
+                plan.back().len += B;
             else
-                cout << "Usage: touch <file>\n";
+                plan.push_back(Piece{ p, (long long)B, match * (long long)B });
+            p += B;
+            litStart = p;
+            if (p + (long long)B <= ns) weakSum(src + p, B, a, b);
+            continue;
+        }
+        if (literal + (p - litStart) > ns / 2) return false;
+        if (p + (long long)B < ns) {
+            uint32_t out = src[p], in = src[p + B];
+            a = a - out + in;
+            b = b - (uint32_t)B * out + a;
+        }
+        ++p;
+    }
+    if (ns > litStart) plan.push_back(Piece{ litStart, ns - litStart, -1 });
+    return true;
+}
+
+#ifndef _WIN32
+// Copy 'len' bytes between descriptors at the given offsets
+bool copyRange(int in, long long from, int out, long long to, long long len) {
+    while (len > 0) {
+        size_t chunk = (size_t)min<long long>(len, COPY_CHUNK);
+        throttle(chunk, 0);
+        perf::count(perf::COPY_CALLS);
+#ifdef SYS_copy_file_range
+        loff_t inOff = from, outOff = to;
+        long n = syscall(SYS_copy_file_range, in, &inOff, out, &outOff, chunk, 0u);
+#else
+        long n = -1;
+        errno = ENOSYS;
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && copyUnsupported(errno)) {
+            static thread_local vector<char> buffer;
+            if (buffer.empty()) buffer.resize(COPY_BUFFER_SIZE);
+            n = pread(in, buffer.data(), min(chunk, buffer.size()), from);
+            if (n > 0 && pwrite(out, buffer.data(), (size_t)n, to) != n) n = -1;
+        }
+        if (n <= 0) return false;
+        perf::count(perf::BYTES_WRITTEN, (uint64_t)n);
+        from += n;
+        to += n;
+        len -= n;
+    }
+    return true;
+}
+#endif
+
+// Update 'dest' to the contents of 'src'; written = bytes actually written.
+// False when a delta does not pay off or fails, so the caller copies.
+bool deltaUpdate(const string &src, const string &dest, const struct stat &st,
+                 long long &written) {
+#ifdef _WIN32
+    (void)src; (void)dest; (void)st; (void)written;
+    return false;
+#else
+    vector<Piece> plan;
+    {
+        MappedFile ms, md;
+        if (!ms.open(src, true) || !md.open(dest, true)) return false;
+        perf::count(perf::BYTES_READ, (uint64_t)(ms.size() + md.size()));
+        if ((long long)ms.size() != (long long)st.st_size ||
+            !planDelta((const unsigned char *)ms.data(), (long long)ms.size(),
+                       (const unsigned char *)md.data(), (long long)md.size(), plan))
+            return false;
+    }
+
+    bool inPlace = true;
+    for (const Piece &pc : plan)
+        if (pc.from >= 0 && pc.from != pc.at) inPlace = false;
+
+    throttle(0);
+    int in = open(src.c_str(), O_RDONLY);
+    if (in < 0) return false;
+    string tmp = dest + ".fe-sync";
+    int old = -1, out;
+    if (inPlace) {
+        out = open(dest.c_str(), O_WRONLY);
+    } else {
+        old = open(dest.c_str(), O_RDONLY);
+        out = old >= 0 ? open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777) : -1;
+    }
+
+    bool ok = out >= 0;
+    written = 0;
+    for (size_t i = 0; ok && i < plan.size(); ++i) {
+        const Piece &pc = plan[i];
+        if (pc.from >= 0 && inPlace) continue;      // unchanged in place
+        ok = pc.from >= 0 ? copyRange(old, pc.from, out, pc.at, pc.len)
+                          : copyRange(in, pc.at, out, pc.at, pc.len);
+        if (pc.from < 0) written += pc.len;
+    }
+    if (ok) ok = ftruncate(out, st.st_size) == 0;
+    if (ok) {
+        fchmod(out, st.st_mode & 07777);
+        struct timespec times[2];
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        futimens(out, times);
+    }
+    close(in);
+    if (old >= 0) close(old);
+    if (out >= 0 && close(out) != 0) ok = false;
+    if (!inPlace) {
+        if (ok) ok = replaceFile(tmp, dest);
+        if (!ok) remove(tmp.c_str());
+    }
+    return ok;
+#endif
+}
+
+struct Options {
+    bool remove = false;
+    bool dryRun = false;
+};
+
+struct Totals {
+    atomic<long long> added{0}, updated{0}, deltas{0}, unchanged{0}, deleted{0};
+    atomic<long long> deltaWritten{0}, deltaSize{0}, failed{0};
+};
+
+class Mirror {
+public:
+    Mirror(const Options &o) : opts(o), tasks(WorkPool::shared()) {}
+
+    void run(const string &src, const string &dest) {
+        syncDir(src, dest);
+        finish();
+    }
+
+    // Wait for the delta tasks and queued copies
+    void finish() {
+        tasks.wait();
+        Progress::planned();
+        copier.finish();
+    }
+
+    // One file, or a link, whose counterpart in 'dest' is 'other' (NULL if none)
+    void syncFile(const string &src, const string &dest, const Entry &e, const Entry *other) {
+        if (other && other->type == e.type && e.type == ENTRY_FILE &&
+            other->st.st_size == e.st.st_size && mtimeNs(other->st) == mtimeNs(e.st)) {
+            ++totals.unchanged;
+            if ((other->st.st_mode & 07777) != (e.st.st_mode & 07777) && !opts.dryRun)
+                chmod(dest.c_str(), e.st.st_mode & 07777);
+            return;
+        }
+#ifndef _WIN32
+        if (other && other->type == ENTRY_LINK && e.type == ENTRY_LINK &&
+            linkTarget(src) == linkTarget(dest)) {
+            ++totals.unchanged;
+            return;
+        }
+#endif
+        if (opts.dryRun) {
+            note(other ? "  ~ " : "  + ", src);
+            ++(other ? totals.updated : totals.added);
+            return;
+        }
+        if (other && other->type != e.type) removeOne(dest, *other, false);
+        ++(other && other->type == e.type ? totals.updated : totals.added);
+
+        if (e.type == ENTRY_LINK) {
+#ifndef _WIN32
+            string target = linkTarget(src);
+            unlink(dest.c_str());
+            if (target.empty() || symlink(target.c_str(), dest.c_str()) != 0) fail(dest, errno);
+#endif
+            return;
+        }
+
+        if (other && other->type == ENTRY_FILE && e.st.st_size >= SYNC_DELTA_MIN &&
+            other->st.st_size >= SYNC_DELTA_MIN) {
+            // The rolling search reads both files: run it beside the walk
+            struct stat st = e.st;
+            tasks.run([this, src, dest, st] {
+                long long written = 0;
+                if (deltaUpdate(src, dest, st, written)) {
+                    Progress::plan((long long)st.st_size, 1);
+                    ++totals.deltas;
+                    totals.deltaWritten += written;
+                    totals.deltaSize += (long long)st.st_size;
+                    perf::count(perf::FILES);
+                } else {
+                    copier.add(src, dest, st);
+                }
+            });
+            return;
+        }
+        copier.add(src, dest, e.st);
+    }
+
+    Totals totals;
+    TreeCopier copier;
+
+private:
+    Options opts;
+    TaskGroup tasks;
+
+    void fail(const string &path, int err) {
+        ++totals.failed;
+        lock_guard<mutex> lock(consoleMutex);
+        cerr << "sync: " << path << ": " << strerror(err) << "\n";
+    }
+
+    void note(const char *mark, const string &path) {
+        lock_guard<mutex> lock(consoleMutex);
+        cout << mark << path << "\n";
+    }
+
+#ifndef _WIN32
+    static string linkTarget(const string &path) {
+        char buf[4096];
+        ssize_t n = readlink(path.c_str(), buf, sizeof(buf) - 1);
+        return n < 0 ? string() : string(buf, (size_t)n);
+    }
+#endif
+
+    void removeOne(const string &path, const Entry &e, bool count) {
+        if (opts.dryRun) {
+            note("  - ", path);
+            ++totals.deleted;
+            return;
+        }
+        RemoveStats removed;
+        if (e.type == ENTRY_DIR) {
+            removeTree(path, removed);
+        } else {
+            throttle(0);
+            perf::count(perf::UNLINKS);
+            if (remove(path.c_str()) != 0) removed.fail(path, errno);
+        }
+        totals.failed += removed.failed.load();
+        if (count && removed.failed == 0) ++totals.deleted;
+    }
+
+    void syncDir(const string &src, const string &dest) {
+        vector<Entry> from, to;
+        if (!listDir(src, from)) {
+            fail(src, errno);
+            return;
+        }
+        if (!listDir(dest, to) && !opts.dryRun) {
+            fail(dest, errno);
+            return;
+        }
+
+        PathBuilder s(src), d(dest);
+        size_t j = 0;
+        for (size_t i = 0; i < from.size(); ++i) {
+            const Entry &e = from[i];
+            while (j < to.size() && to[j].name < e.name) extra(d, to[j++]);
+            const Entry *other = j < to.size() && to[j].name == e.name ? &to[j++] : NULL;
+
+            size_t sm = s.push(e.name), dm = d.push(e.name);
+            string childSrc = s.str(), childDest = d.str();
+            s.pop(sm);
+            d.pop(dm);
+
+            switch (e.type) {
+            case ENTRY_DIR:
+                if (other && other->type != ENTRY_DIR) removeOne(childDest, *other, false);
+                if (!other || other->type != ENTRY_DIR) {
+                    if (opts.dryRun) {
+                        note("  + ", childSrc + PATH_SEP);
+                        ++totals.added;
+                        if (other) continue;
+                    } else if (!createDirectory(childDest, (e.st.st_mode & 07777) | 0700)) {
+                        fail(childDest, errno);
+                        continue;
+                    } else {
+                        ++totals.added;
+                    }
+                }
+                tasks.run([this, childSrc, childDest] { syncDir(childSrc, childDest); });
+                break;
+            case ENTRY_FILE:
+            case ENTRY_LINK:
+                syncFile(childSrc, childDest, e, other);
+                break;
+            default:
+                if (e.type == ENTRY_UNKNOWN) fail(childSrc, ENOENT);
+                else note("  skipping special file ", childSrc);
+                break;
+            }
+        }
+        while (j < to.size()) extra(d, to[j++]);
+    }
+
+    // An entry only the destination has
+    void extra(PathBuilder &d, const Entry &e) {
+        if (!opts.remove) return;
+        size_t mark = d.push(e.name);
+        string path = d.str();
+        d.pop(mark);
+        removeOne(path, e, true);
+    }
+};
+
+} // namespace sync_detail
+
+void syncTrees(const string &src, const string &dest, const sync_detail::Options &opts) {
+    using namespace sync_detail;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    struct stat st;
+    if (stat(src.c_str(), &st) != 0) {
+        printError("sync");
+        return;
+    }
+    string absSrc = absolutePath(src), absDest = absolutePath(dest);
+    if (S_ISDIR(st.st_mode) &&
+        (absDest == absSrc || absDest.compare(0, absSrc.size() + 1, absSrc + PATH_SEP) == 0)) {
+        cerr << "sync: " << dest << " is inside " << src << "\n";
+        return;
+    }
+
+    Mirror mirror(opts);
+    if (S_ISDIR(st.st_mode)) {
+        if (!opts.dryRun && !createDirectory(dest, (st.st_mode & 07777) | 0700)) {
+            printError("sync");
+            return;
+        }
+        mirror.run(src, dest);
+    } else {
+        string target = isDirectory(dest)
+                            ? dest + PATH_SEP + src.substr(src.find_last_of("/\\") + 1)
+                            : dest;
+        Entry e, other;
+        e.name = target;
+        e.type = ENTRY_FILE;
+        e.st = st;
+        bool exists = stat(target.c_str(), &other.st) == 0;
+        other.type = exists ? typeFromMode(other.st.st_mode) : ENTRY_UNKNOWN;
+        mirror.syncFile(src, target, e, exists ? &other : NULL);
+        mirror.finish();
+    }
+
+    const Totals &t = mirror.totals;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "%s%lld new, %lld updated (%lld by delta, %s of %s written), %lld unchanged, "
+             "%lld deleted, %lld failed in %.3f s",
+             opts.dryRun ? "dry run: " : "", t.added.load(), t.updated.load(), t.deltas.load(),
+             humanSize(t.deltaWritten.load()).c_str(), humanSize(t.deltaSize.load()).c_str(),
+             t.unchanged.load(), t.deleted.load(),
+             t.failed.load() + mirror.copier.failures.load(), seconds);
+    cout << "Synced: " << src << " -> " << dest << " (" << summary << ")" << endl;
+    if (!opts.dryRun) {
+        DirCache::instance().clear();
+        logAction("Synced: " + src + " -> " + dest + " (" + summary + ")");
+    }
+}
+
+
+/*-------------------------------------------------------------
+    Archives (pack / unpack)
+      pack [--level N] <path> <out.tar | out.tar.zst>
+      unpack <archive> [dest]
+    The archive is a ustar stream (GNU long-name records for
+    paths that do not fit). With zstd the stream is cut into
+    ARCHIVE_CHUNK pieces compressed as independent frames, so
+    either direction can work on several chunks at once; the
+    concatenation is still an ordinary .zst that zstd and tar
+    read as usual.
+    pack walks the tree with walkTree and sorts the entries by
+    name. Pool tasks keep ARCHIVE_READ_AHEAD bytes of file reads
+    in flight ahead of the tar writer, and several chunks are
+    compressed at once behind it. unpack cuts the input at frame
+    boundaries (ZSTD_findFrameCompressedSize), decompresses
+    frames ahead of the tar reader, and hands file data to pool
+    tasks that write it with pwrite. Whichever of the disk and
+    the CPU is slower is the only thing left to wait on.
+    Archives from other tools (a frame without a content size, or
+    plain tar) are read sequentially instead.
+    The .zst side needs a build with FE_WITH_ZSTD (see the top).
+-------------------------------------------------------------*/
+const size_t ARCHIVE_CHUNK = 4 << 20;           // tar bytes per compressed frame
+const size_t ARCHIVE_PIECE = 4 << 20;           // largest single file read
+const size_t ARCHIVE_READ_AHEAD = 64 << 20;     // reads / writes in flight
+const int ARCHIVE_LEVEL = 3;
+
+namespace archive_detail {
+
+const size_t BLOCK = 512;
+
+struct Member {
+    string path;        // on disk
+    string name;        // in the archive, '/'-separated, no trailing '/'
+    string link;        // symlink target
+    EntryType type;
+    struct stat st;
+};
+
+struct Totals {
+    long long files = 0, dirs = 0, links = 0, skipped = 0, failed = 0;
+    long long data = 0, written = 0;
+};
+
+bool isZstdName(const string &path) {
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".zst") == 0;
+}
+
+#ifndef _WIN32
+// Target of the symlink at 'path'; false if it cannot be read
+bool readLink(const string &path, string &target) {
+    char link[4096];
+    ssize_t n = readlink(path.c_str(), link, sizeof(link) - 1);
+    if (n < 0) return false;
+    target.assign(link, (size_t)n);
+    return true;
+}
+#endif
+
+// Numeric header field: octal, or base-256 when it does not fit (GNU)
+void putNumber(char *field, size_t width, uint64_t v) {
+    if (v >> (3 * (width - 1))) {
+        memset(field, 0, width);
+        field[0] = (char)0x80;
+        for (size_t i = width - 1; i > 0 && v; --i, v >>= 8) field[i] = (char)(v & 0xff);
+        return;
+    }
+    snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)v);
+}
+
+uint64_t getNumber(const char *field, size_t width) {
+    uint64_t v = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        for (size_t i = 1; i < width; ++i) v = (v << 8) | (unsigned char)field[i];
+        return v;
+    }
+    size_t i = 0;
+    while (i < width && (field[i] == ' ' || field[i] == '\0')) ++i;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i) v = v * 8 + (uint64_t)(field[i] - '0');
+    return v;
+}
+
+void putHeaderBlock(string &out, const char *name, char type, const struct stat &st,
+                    uint64_t size, const char *link, const char *prefix) {
+    char h[BLOCK];
+    memset(h, 0, sizeof(h));
+    strncpy(h, name, 100);
+    putNumber(h + 100, 8, (uint64_t)(st.st_mode & 07777));
+#ifdef _WIN32
+    putNumber(h + 108, 8, 0);
+    putNumber(h + 116, 8, 0);
+#else
+    putNumber(h + 108, 8, (uint64_t)st.st_uid);
+    putNumber(h + 116, 8, (uint64_t)st.st_gid);
+#endif
+    putNumber(h + 124, 12, size);
+    putNumber(h + 136, 12, (uint64_t)max((long long)st.st_mtime, 0LL));
+    h[156] = type;
+    if (link) strncpy(h + 157, link, 100);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    if (prefix) strncpy(h + 345, prefix, 155);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < BLOCK; ++i) sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    out.append(h, BLOCK);
+}
+
+void padBlock(string &out) {
+    out.append((BLOCK - out.size() % BLOCK) % BLOCK, '\0');
+}
+
+// GNU 'L' / 'K' record carrying a name or link target too long for the header
+void putLongRecord(string &out, char type, const string &text) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    putHeaderBlock(out, "././@LongLink", type, st, text.size() + 1, NULL, NULL);
+    out.append(text.c_str(), text.size() + 1);
+    padBlock(out);
+}
+
+// The header(s) of one member
+void putHeader(string &out, const Member &m) {
+    string name = m.name;
+    char type = '0';
+    uint64_t size = 0;
+    if (m.type == ENTRY_DIR) {
+        name += '/';
+        type = '5';
+    } else if (m.type == ENTRY_LINK) {
+        type = '2';
+    } else {
+        size = (uint64_t)m.st.st_size;
+    }
+
+    if (m.link.size() > 100) putLongRecord(out, 'K', m.link);
+
+    // ustar splits a long path at a '/' into prefix (155) and name (100)
+    string prefix;
+    if (name.size() > 100) {
+        size_t cut = name.find('/', name.size() > 101 ? name.size() - 101 : 0);
+        if (cut != string::npos && cut <= 155 && cut > 0 && name.size() - cut - 1 <= 100 &&
+            cut + 1 < name.size()) {
+            prefix = name.substr(0, cut);
+            name = name.substr(cut + 1);
+        } else {
+            putLongRecord(out, 'L', name);
+        }
+    }
+    putHeaderBlock(out, name.c_str(), type, m.st, size, m.link.c_str(),
+                   prefix.empty() ? NULL : prefix.c_str());
+}
+
+/*-------------------------------------------------------------
+    Optional zstd, one thread-local context per pool worker
+-------------------------------------------------------------*/
+#ifdef FE_WITH_ZSTD
+bool compressChunk(const string &raw, string &packed, int level, string &error) {
+    static thread_local ZSTD_CCtx *ctx = ZSTD_createCCtx();
+    packed.resize(ZSTD_compressBound(raw.size()));
+    size_t n = ZSTD_compressCCtx(ctx, &packed[0], packed.size(), raw.data(), raw.size(), level);
+    if (ZSTD_isError(n)) {
+        error = ZSTD_getErrorName(n);
+        return false;
+    }
+    packed.resize(n);
+    return true;
+}
+
+// Decompress whole frames (any number, any sizes) into 'raw'
+bool decompressFrames(ZSTD_DCtx *ctx, const char *src, size_t n, string &raw, string &error) {
+    ZSTD_DCtx_reset(ctx, ZSTD_reset_session_only);
+    unsigned long long known = ZSTD_getFrameContentSize(src, n);
+    raw.clear();
+    raw.resize(known < ZSTD_CONTENTSIZE_ERROR && known > 0 ? (size_t)known : ZSTD_DStreamOutSize());
+
+    ZSTD_inBuffer in = { src, n, 0 };
+    size_t used = 0, r = 1;
+    while (in.pos < in.size || r != 0) {
+        if (used == raw.size()) raw.resize(raw.size() * 2);
+        size_t from = in.pos;
+        ZSTD_outBuffer out = { &raw[0], raw.size(), used };
+        r = ZSTD_decompressStream(ctx, &out, &in);
+        if (ZSTD_isError(r)) {
+            error = ZSTD_getErrorName(r);
+            return false;
+        }
+        if (r != 0 && in.pos == from && out.pos == used) {
+            error = "truncated frame";
+            return false;
+        }
+        used = out.pos;
+    }
+    raw.resize(used);
+    return true;
+}
+#endif
+
+/*-------------------------------------------------------------
+    Writes the tar stream: file reads ahead on the pool, chunks
+    compressed behind; everything leaves in order
+-------------------------------------------------------------*/
+class Packer {
+public:
+    Packer(FILE *output, bool compress, int level, WorkPool &p = WorkPool::shared())
+        : out(output), zstd(compress), zlevel(level), pool(p) {}
+
+    Totals totals;
+
+    bool run(const vector<Member> &members) {
+        size_t next = 0;
+        uint64_t nextOffset = 0;
+        size_t inFlight = 0;
+        deque<shared_ptr<Piece>> reads;
+        const Member *skipping = NULL;
+
+        while (true) {
+            // Keep the read window full
+            while (next < members.size() && inFlight < ARCHIVE_READ_AHEAD) {
+                const Member &m = members[next];
+                shared_ptr<Piece> p = make_shared<Piece>();
+                p->member = &m;
+                p->offset = nextOffset;
+                uint64_t size = m.type == ENTRY_FILE ? (uint64_t)m.st.st_size : 0;
+                p->length = (size_t)min<uint64_t>(ARCHIVE_PIECE, size - nextOffset);
+                reads.push_back(p);
+                nextOffset += p->length;
+                if (nextOffset >= size) {
+                    ++next;
+                    nextOffset = 0;
+                }
+                if (p->length == 0) {
+                    p->ready = true;
+                    continue;
+                }
+                inFlight += p->length;
+                WorkPool *wp = &pool;
+                pool.submit([p, wp] {
+                    readPiece(*p);
+                    p->ready = true;
+                    wp->wakeAll();
+                });
+            }
+            if (reads.empty()) break;
+
+            shared_ptr<Piece> p = reads.front();
+            reads.pop_front();
+            pool.helpUntil([&p] { return p->ready.load(); });
+            inFlight -= p->length;
+            if (!take(*p, skipping)) return false;
+        }
+
+        string end(2 * BLOCK, '\0');
+        if (!emit(end.data(), end.size())) return false;
+        if (!chunk.empty() && !sealChunk()) return false;
+        while (!chunks.empty())
+            if (!writeFront(true)) return false;
+        return true;
+    }
+
+private:
+    struct Piece {
+        const Member *member;
+        uint64_t offset;
+        size_t length;
+        string data;
+        int err = 0;
+        atomic<bool> ready{false};
+    };
+
+    struct Chunk {
+        string raw, packed;
+        string error;
+        bool ok = true;
+        atomic<bool> ready{false};
+    };
+
+    FILE *out;
+    bool zstd;
+    int zlevel;
+    WorkPool &pool;
+    string chunk;
+    deque<shared_ptr<Chunk>> chunks;
+
+    static void readPiece(Piece &p) {
+        p.data.resize(p.length);
+        size_t got = 0;
+#ifdef _WIN32
+        FILE *f = fopen(p.member->path.c_str(), "rb");
+        if (!f || _fseeki64(f, (long long)p.offset, SEEK_SET) != 0) {
+            p.err = errno;
+            if (f) fclose(f);
+            p.data.clear();
+            return;
+        }
+        got = fread(&p.data[0], 1, p.length, f);
+        fclose(f);
+#else
+        int fd = open(p.member->path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            p.err = errno;
+            p.data.clear();
+            return;
+        }
+        while (got < p.length) {
+            ssize_t n = pread(fd, &p.data[got], p.length - got, (off_t)(p.offset + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) p.err = errno;
+                break;
+            }
+            got += (size_t)n;
+        }
+        close(fd);
+#endif
+        p.data.resize(got);
+        throttle(got, p.offset == 0 ? 1 : 0);     // the file's op with its first piece
+        perf::count(perf::BYTES_READ, got);
+    }
+
+    // Add one piece to the stream (its member's header first)
+    bool take(Piece &p, const Member *&skipping) {
+        const Member &m = *p.member;
+        if (&m == skipping) return true;
+
+        string text;
+        if (p.offset == 0) {
+            if (m.type == ENTRY_FILE && p.length > 0 && p.data.empty()) {
+                // Could not be read at all: leave it out rather than store zeros
+                cerr << "pack: " << m.path << ": " << strerror(p.err ? p.err : EIO) << "\n";
+                ++totals.failed;
+                skipping = &m;
+                return true;
+            }
+            putHeader(text, m);
+            if (m.type == ENTRY_DIR) ++totals.dirs;
+            else if (m.type == ENTRY_LINK) ++totals.links;
+            else {
+                ++totals.files;
+                perf::count(perf::FILES);
+            }
+        }
+
+        if (p.data.size() < p.length) {
+            cerr << "pack: " << m.path << ": file changed as we read it (padded with zeros)\n";
+            ++totals.failed;
+            p.data.resize(p.length, '\0');
+        }
+        totals.data += (long long)p.data.size();
+        text += p.data;
+        string().swap(p.data);
+
+        if (m.type == ENTRY_FILE && p.offset + p.length >= (uint64_t)m.st.st_size)
+            text.append((BLOCK - (size_t)(m.st.st_size % BLOCK)) % BLOCK, '\0');
+        return emit(text.data(), text.size());
+    }
+
+    // Append tar bytes, sealing a chunk each time one fills up
+    bool emit(const char *s, size_t n) {
+        while (n > 0) {
+            size_t k = min(n, ARCHIVE_CHUNK - chunk.size());
+            chunk.append(s, k);
+            s += k;
+            n -= k;
+            if (chunk.size() == ARCHIVE_CHUNK && !sealChunk()) return false;
+        }
+        return true;
+    }
+
+    bool sealChunk() {
+        shared_ptr<Chunk> c = make_shared<Chunk>();
+        c->raw.swap(chunk);
+        chunk.reserve(ARCHIVE_CHUNK);
+        chunks.push_back(c);
+#ifdef FE_WITH_ZSTD
+        if (zstd) {
+            int level = zlevel;
+            WorkPool *wp = &pool;
+            pool.submit([c, level, wp] {
+                c->ok = compressChunk(c->raw, c->packed, level, c->error);
+                string().swap(c->raw);
+                c->ready = true;
+                wp->wakeAll();
+            });
+        } else
+#endif
+        {
+            c->packed.swap(c->raw);
+            c->ready = true;
+        }
+
+        // Write what is done; wait once too many chunks are outstanding
+        while (!chunks.empty() && chunks.front()->ready)
+            if (!writeFront(false)) return false;
+        if (chunks.size() > 2 * pool.size()) return writeFront(true);
+        return true;
+    }
+
+    bool writeFront(bool wait) {
+        shared_ptr<Chunk> c = chunks.front();
+        if (wait) pool.helpUntil([&c] { return c->ready.load(); });
+        chunks.pop_front();
+        if (!c->ok) {
+            cerr << "pack: compression failed: " << c->error << "\n";
+            return false;
+        }
+        if (fwrite(c->packed.data(), 1, c->packed.size(), out) != c->packed.size()) {
+            printError("pack");
+            return false;
+        }
+        totals.written += (long long)c->packed.size();
+        perf::count(perf::BYTES_WRITTEN, c->packed.size());
+        return true;
+    }
+};
+
+/*-------------------------------------------------------------
+    Reads a tar stream (plain or zstd) and recreates its members
+-------------------------------------------------------------*/
+class Unpacker {
+public:
+    Unpacker(FILE *input, const string &destDir, WorkPool &p = WorkPool::shared())
+        : in(input), dest(destDir), pool(p) {}
+
+    ~Unpacker() {
+        pool.helpUntil([this] { return writing.load() == 0 && decoding.load() == 0; });
+#ifdef FE_WITH_ZSTD
+        if (stream) ZSTD_freeDCtx(stream);
+#endif
+    }
+
+    Totals totals;
+
+    bool run() {
+        if (!detect()) return false;
+        bool ok = extract();
+        pool.helpUntil([this] { return writing.load() == 0; });
+
+        // Links last, so no later member can be written through one: hard
+        // links before any symlink exists (link() follows the components of
+        // its paths), then symlinks, then directory times, deepest first.
+        // A directory a symlink replaced, or one under such a link, is
+        // left alone: its times would land outside 'dest'
+        for (const Member &m : links)
+            if (m.type != ENTRY_LINK) makeLink(m);
+        for (const Member &m : links)
+            if (m.type == ENTRY_LINK) makeLink(m);
+        for (size_t i = dirs.size(); i-- > 0;)
+            if (stillDirectory(dirs[i].first)) setTimes(dirs[i].first, dirs[i].second);
+        return ok && !failed;
+    }
+
+private:
+    struct Chunk {
+        string packed, raw;
+        string error;
+        bool ok = true;
+        atomic<bool> ready{false};
+    };
+
+    // An extracted file; closed by whoever finishes its last write
+    struct OutFile {
+        string path;
+        int64_t mtime;
+        mode_t mode;
+        atomic<long> pending{1};
+        atomic<bool> failed{false};
+#ifdef _WIN32
+        FILE *f = NULL;
+        mutex mtx;
+#else
+        int fd = -1;
+#endif
+    };
+
+    FILE *in;
+    string dest;
+    WorkPool &pool;
+    bool zstd = false, sequential = false, eof = false, drained = false;
+    string input;               // compressed bytes not cut into frames yet
+    size_t inputPos = 0;
+    deque<shared_ptr<Chunk>> chunks;
+    shared_ptr<Chunk> cur;      // chunk the tar reader is in
+    size_t curPos = 0;
+    atomic<long> decoding{0};
+    atomic<size_t> writing{0};  // bytes handed to write tasks
+    atomic<bool> failed{false};
+    vector<Member> links;       // symlinks and hard links, made at the end
+    vector<pair<string, int64_t>> dirs;
+    string lastParent;
+#ifdef FE_WITH_ZSTD
+    ZSTD_DCtx *stream = NULL;   // sequential mode
+#endif
+
+    bool readInput(size_t n) {
+        if (eof) return false;
+        if (inputPos > 0) {
+            input.erase(0, inputPos);
+            inputPos = 0;
+        }
+        size_t old = input.size();
+        input.resize(old + n);
+        size_t got = fread(&input[old], 1, n, in);
+        input.resize(old + got);
+        perf::count(perf::BYTES_READ, got);
+        if (got == 0) eof = true;
+        return got > 0;
+    }
+
+    bool detect() {
+        readInput(ARCHIVE_CHUNK);
+        static const unsigned char magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+        zstd = input.size() >= 4 && memcmp(input.data(), magic, 4) == 0;
+#ifndef FE_WITH_ZSTD
+        if (zstd) {
+            cerr << "unpack: this archive is zstd-compressed; rebuild with -DFE_WITH_ZSTD -lzstd\n";
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    // Queue the next chunk of tar bytes; false at the end of the input
+    bool produce() {
+        shared_ptr<Chunk> c = make_shared<Chunk>();
+        if (!zstd) {
+            if (input.size() == inputPos && !readInput(ARCHIVE_CHUNK)) return false;
+            c->raw.assign(input, inputPos, string::npos);
+            input.clear();
+            inputPos = 0;
+            c->ready = true;
+            chunks.push_back(c);
+            return true;
+        }
+#ifdef FE_WITH_ZSTD
+        if (!sequential) {
+            // Frames of our own carry their size; cut them out and decode on the pool
+            while (true) {
+                const char *p = input.data() + inputPos;
+                size_t avail = input.size() - inputPos;
+                if (avail == 0 && !readInput(ARCHIVE_CHUNK)) return false;
+                p = input.data() + inputPos;
+                avail = input.size() - inputPos;
+
+                unsigned long long size = ZSTD_getFrameContentSize(p, avail);
+                if (size == ZSTD_CONTENTSIZE_UNKNOWN || (size != ZSTD_CONTENTSIZE_ERROR &&
+                                                         size > 4 * ARCHIVE_CHUNK)) {
+                    sequential = true;
+                    break;
+                }
+                size_t n = ZSTD_findFrameCompressedSize(p, avail);
+                if (ZSTD_isError(n)) {
+                    if (readInput(ARCHIVE_CHUNK)) continue;
+                    c->ok = false;
+                    c->error = ZSTD_getErrorName(n);
+                    c->ready = true;
+                    chunks.push_back(c);
+                    drained = true;
+                    return true;
+                }
+
+                c->packed.assign(p, n);
+                inputPos += n;
+                chunks.push_back(c);
+                ++decoding;
+                WorkPool *wp = &pool;
+                atomic<long> *count = &decoding;
+                pool.submit([c, wp, count] {
+                    static thread_local ZSTD_DCtx *ctx = ZSTD_createDCtx();
+                    c->ok = decompressFrames(ctx, c->packed.data(), c->packed.size(), c->raw,
+                                             c->error);
+                    string().swap(c->packed);
+                    c->ready = true;
+                    --*count;
+                    wp->wakeAll();
+                });
+                return true;
+            }
+        }
+
+        // Anything else streams through one context, a window at a time
+        if (!stream) stream = ZSTD_createDCtx();
+        c->raw.resize(ARCHIVE_CHUNK);
+        ZSTD_outBuffer out = { &c->raw[0], c->raw.size(), 0 };
+        while (out.pos < out.size) {
+            if (inputPos == input.size()) readInput(ARCHIVE_CHUNK);
+            ZSTD_inBuffer src = { input.data(), input.size(), inputPos };
+            size_t before = out.pos;
+            size_t r = ZSTD_decompressStream(stream, &out, &src);
+            bool moved = src.pos != inputPos || out.pos != before;
+            inputPos = src.pos;
+            if (ZSTD_isError(r)) {
+                c->ok = false;
+                c->error = ZSTD_getErrorName(r);
+                drained = true;
+                break;
+            }
+            if (!moved && eof) break;
+        }
+        c->raw.resize(out.pos);
+        if (out.pos == 0 && c->ok) return false;
+        c->ready = true;
+        chunks.push_back(c);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Contiguous tar bytes at the read position; 0 at the end of the stream
+    size_t peek(const char *&p) {
+        while (!cur || curPos == cur->raw.size()) {
+            cur.reset();
+            while (!drained && chunks.size() < 2 * pool.size())
+                if (!produce()) drained = true;
+            if (chunks.empty()) return 0;
+            cur = chunks.front();
+            chunks.pop_front();
+            pool.helpUntil([this] { return cur->ready.load(); });
+            if (!cur->ok) {
+                cerr << "unpack: cannot decompress: " << cur->error << "\n";
+                failed = true;
+                cur.reset();
+                return 0;
+            }
+            curPos = 0;
+        }
+        p = cur->raw.data() + curPos;
+        return cur->raw.size() - curPos;
+    }
+
+    bool readExact(char *dst, size_t n) {
+        while (n > 0) {
+            const char *p;
+            size_t k = min(n, peek(p));
+            if (k == 0) return false;
+            memcpy(dst, p, k);
+            curPos += k;
+            dst += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    bool skip(uint64_t n) {
+        while (n > 0) {
+            const char *p;
+            size_t k = (size_t)min<uint64_t>(n, peek(p));
+            if (k == 0) return false;
+            curPos += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    static uint64_t padded(uint64_t n) { return (n + BLOCK - 1) / BLOCK * BLOCK; }
+
+    // Refuse absolute paths and '..' so nothing lands outside 'dest'
+    static bool safeName(string &name) {
+        while (name.compare(0, 2, "./") == 0) name.erase(0, 2);
+        while (!name.empty() && name.back() == '/') name.pop_back();
+        if (name.empty() || name[0] == '/' || name[0] == '\\' ||
+            (name.size() > 1 && name[1] == ':'))
+            return false;
+        size_t pos = 0;
+        while (pos <= name.size()) {
+            size_t next = name.find_first_of("/\\", pos);
+            if (next == string::npos) next = name.size();
+            if (name.compare(pos, next - pos, "..") == 0) return false;
+            pos = next + 1;
+        }
+        return true;
+    }
+
+    string target(const string &name) const {
+        string path = dest;
+        path += PATH_SEP;
+        for (char c : name) path += (c == '/') ? PATH_SEP : c;
+        return path;
+    }
+
+    // Members usually follow their directory, so this is rarely more than a compare
+    void makeParents(const string &path) {
+        size_t cut = path.find_last_of(PATH_SEP);
+        if (cut <= dest.size() || path.compare(0, cut, lastParent) == 0) return;
+        for (size_t pos = dest.size() + 1; (pos = path.find(PATH_SEP, pos)) != string::npos; ++pos)
+            createDirectory(path.substr(0, pos), 0755);
+        lastParent = path.substr(0, cut);
+    }
+
+    void fail(const string &path, int err) {
+        cerr << "unpack: " << path << ": " << strerror(err) << "\n";
+        ++totals.failed;
+    }
+
+    // pax 'x' records: "<len> key=value\n"
+    static void parsePax(const string &text, string &path, string &link, uint64_t &size,
+                         bool &haveSize) {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t space = text.find(' ', pos);
+            if (space == string::npos) break;
+            size_t len = (size_t)strtoull(text.c_str() + pos, NULL, 10);
+            if (len == 0 || pos + len > text.size()) break;
+            string rec = text.substr(space + 1, pos + len - space - 2);
+            size_t eq = rec.find('=');
+            if (eq != string::npos) {
+                string key = rec.substr(0, eq), value = rec.substr(eq + 1);
+                if (key == "path") path = value;
+                else if (key == "linkpath") link = value;
+                else if (key == "size") {
+                    size = strtoull(value.c_str(), NULL, 10);
+                    haveSize = true;
+                }
+            }
+            pos += len;
+        }
+    }
+
+    bool extract() {
+        string longName, longLink;
+        uint64_t paxSize = 0;
+        bool havePaxSize = false;
+        char h[BLOCK];
+
+        while (readExact(h, BLOCK)) {
+            bool zero = true;
+            for (size_t i = 0; i < BLOCK && zero; ++i) zero = (h[i] == '\0');
+            if (zero) return true;
+
+            unsigned sum = 0;
+            for (size_t i = 0; i < BLOCK; ++i)
+                sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+            if (sum != (unsigned)getNumber(h + 148, 8)) {
+                cerr << "unpack: not a tar archive, or damaged (bad header checksum)\n";
+                return false;
+            }
+
+            char type = h[156];
+            uint64_t size = getNumber(h + 124, 12);
+            if (havePaxSize) size = paxSize;
+
+            if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+                string text((size_t)size, '\0');
+                if (!readExact(&text[0], (size_t)size) || !skip(padded(size) - size)) break;
+                if (type == 'L') longName = text.c_str();
+                else if (type == 'K') longLink = text.c_str();
+                else if (type == 'x') parsePax(text, longName, longLink, paxSize, havePaxSize);
+                continue;
+            }
+
+            Member m;
+            m.type = ENTRY_FILE;
+            if (!longName.empty()) {
+                m.name = longName;
+            } else {
+                string prefix(h + 345, strnlen(h + 345, 155));
+                m.name.assign(h, strnlen(h, 100));
+                if (memcmp(h + 257, "ustar", 5) == 0 && !prefix.empty()) m.name = prefix + "/" + m.name;
+            }
+            m.link = !longLink.empty() ? longLink : string(h + 157, strnlen(h + 157, 100));
+            longName.clear();
+            longLink.clear();
+            havePaxSize = false;
+
+            memset(&m.st, 0, sizeof(m.st));
+            m.st.st_mode = (mode_t)getNumber(h + 100, 8);
+            m.st.st_mtime = (time_t)getNumber(h + 136, 12);
+
+            if (!safeName(m.name)) {
+                cerr << "unpack: skipping unsafe path " << m.name << "\n";
+                ++totals.skipped;
+                if (!skip(padded(size))) break;
+                continue;
+            }
+            m.path = target(m.name);
+            makeParents(m.path);
+
+            if (type == '5') {
+                if (!createDirectory(m.path, (m.st.st_mode & 07777) | 0700)) fail(m.path, errno);
+                else ++totals.dirs;
+                dirs.push_back(make_pair(m.path, (int64_t)m.st.st_mtime));
+                if (!skip(padded(size))) break;
+            } else if (type == '2' || type == '1') {
+                m.type = (type == '2') ? ENTRY_LINK : ENTRY_FILE;    // FILE: a hard link
+                links.push_back(m);
+                if (!skip(padded(size))) break;
+            } else if (type == '0' || type == '\0' || type == '7') {
+                if (!writeFile(m, size)) break;
+            } else {
+                ++totals.skipped;
+                if (!skip(padded(size))) break;
+            }
+        }
+        if (!failed) cerr << "unpack: unexpected end of archive\n";
+        return false;
+    }
+
+    // Stream one member's data to write tasks by offset
+    bool writeFile(const Member &m, uint64_t size) {
+        shared_ptr<OutFile> f = make_shared<OutFile>();
+        f->path = m.path;
+        f->mtime = (int64_t)m.st.st_mtime;
+        f->mode = (mode_t)(m.st.st_mode & 07777);
+
+        remove(m.path.c_str());     // replace, and never write through a link
+#ifdef _WIN32
+        f->f = fopen(m.path.c_str(), "wb");
+        bool opened = f->f != NULL;
+#else
+        f->fd = open(m.path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+        bool opened = f->fd >= 0;
+#endif
+        throttle(0);
+        if (!opened) {
+            fail(m.path, errno);
+            return skip(padded(size));
+        }
+        ++totals.files;
+        totals.data += (long long)size;
+        perf::count(perf::FILES);
+
+        for (uint64_t offset = 0; offset < size;) {
+            const char *p;
+            size_t k = (size_t)min<uint64_t>(size - offset, peek(p));
+            if (k == 0) {
+                finishFile(f);
+                return false;
+            }
+            pool.helpUntil([this] { return writing.load() < ARCHIVE_READ_AHEAD; });
+
+            shared_ptr<Chunk> keep = cur;     // the data stays in the chunk until written
+            ++f->pending;
+            writing += k;
+            atomic<size_t> *bytes = &writing;
+            WorkPool *wp = &pool;
+            pool.submit([this, f, keep, p, k, offset, bytes, wp] {
+                if (!writeAt(*f, p, k, offset)) f->failed = true;
+                finishFile(f);
+                *bytes -= k;    // the unpacker may be gone once this reaches zero
+                wp->wakeAll();
+            });
+            curPos += k;
+            offset += k;
+        }
+        finishFile(f);
+        return skip(padded(size) - size);
+    }
+
+    static bool writeAt(OutFile &f, const char *p, size_t n, uint64_t offset) {
+        throttle(n, 0);
+        perf::count(perf::BYTES_WRITTEN, n);
+#ifdef _WIN32
+        lock_guard<mutex> lock(f.mtx);
+        return _fseeki64(f.f, (long long)offset, SEEK_SET) == 0 && fwrite(p, 1, n, f.f) == n;
+#else
+        while (n > 0) {
+            ssize_t w = pwrite(f.fd, p, n, (off_t)offset);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            p += w;
+            n -= (size_t)w;
+            offset += (uint64_t)w;
+        }
+        return true;
+#endif
+    }
+
+    void finishFile(const shared_ptr<OutFile> &f) {
+        if (--f->pending != 0) return;
+#ifdef _WIN32
+        bool ok = fclose(f->f) == 0 && !f->failed;
+        chmod(f->path.c_str(), f->mode & 0777);
+#else
+        fchmod(f->fd, f->mode);
+        bool ok = close(f->fd) == 0 && !f->failed;
+#endif
+        if (!ok) {
+            lock_guard<mutex> lock(consoleMutex);
+            cerr << "unpack: " << f->path << ": write failed\n";
+            failed = true;
+        }
+        setTimes(f->path, f->mtime);
+    }
+
+    // Never follows a symlink at 'path' itself
+    static void setTimes(const string &path, int64_t mtime) {
+#ifdef _WIN32
+        struct _utimbuf times;
+        times.actime = times.modtime = (time_t)mtime;
+        _utime(path.c_str(), &times);
+#else
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = (time_t)mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+#endif
+    }
+
+#ifndef _WIN32
+    // True if a directory between 'dest' and 'path' is a symlink made by
+    // an earlier member, so creating 'path' could land outside 'dest'
+    bool throughSymlink(const string &path) const {
+        for (size_t pos = dest.size() + 1; (pos = path.find(PATH_SEP, pos)) != string::npos; ++pos) {
+            struct stat st;
+            if (lstat(path.substr(0, pos).c_str(), &st) == 0 && S_ISLNK(st.st_mode)) return true;
+        }
+        return false;
+    }
+#endif
+
+    // True if the directory made for 'path' is still there, reached
+    // without passing a symlink
+    bool stillDirectory(const string &path) const {
+#ifdef _WIN32
+        (void)path;
+        return true;
+#else
+        struct stat st;
+        return lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && !throughSymlink(path);
+#endif
+    }
+
+    void makeLink(const Member &m) {
+#ifdef _WIN32
+        cerr << "unpack: " << m.path << ": links are not extracted on Windows\n";
+        ++totals.skipped;
+#else
+        if (m.type == ENTRY_LINK && throughSymlink(m.path)) {
+            cerr << "unpack: skipping " << m.name << " (a symlink in its path leaves " << dest << ")\n";
+            ++totals.skipped;
+            return;
+        }
+        remove(m.path.c_str());
+        if (m.type == ENTRY_LINK) {
+            if (symlink(m.link.c_str(), m.path.c_str()) != 0) return fail(m.path, errno);
+            setTimes(m.path, (int64_t)m.st.st_mtime);
+        } else {
+            string linkName = m.link;
+            if (!safeName(linkName)) {
+                cerr << "unpack: skipping unsafe link " << m.link << "\n";
+                ++totals.skipped;
+                return;
+            }
+            if (link(target(linkName).c_str(), m.path.c_str()) != 0) return fail(m.path, errno);
+        }
+        ++totals.links;
+#endif
+    }
+};
+
+} // namespace archive_detail
+
+/*-------------------------------------------------------------
+    pack: archive 'src' (a folder or a single file) into 'out'
+-------------------------------------------------------------*/
+void packTree(const string &src, const string &out, int level = ARCHIVE_LEVEL) {
+    using namespace archive_detail;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool zstd = isZstdName(out);
+#ifndef FE_WITH_ZSTD
+    if (zstd) {
+        cerr << "pack: built without zstd (-DFE_WITH_ZSTD -lzstd); use a .tar name\n";
+        return;
+    }
+#endif
+
+    struct stat st;
+    if (lstat(src.c_str(), &st) != 0) {
+        printError("pack");
+        return;
+    }
+    FILE *f = fopen(out.c_str(), "wb");
+    if (!f) {
+        printError("pack");
+        return;
+    }
+    struct stat self;
+    bool haveSelf = fstat(fileno(f), &self) == 0;
+
+    // Names start with the source's own name, as 'tar -C parent name' would store them
+    string top = src;
+    while (top.size() > 1 && (top.back() == '/' || top.back() == PATH_SEP)) top.pop_back();
+    size_t cut = top.find_last_of("/\\");
+    string base = (cut == string::npos) ? top : top.substr(cut + 1);
+    if (base.empty() || base == "." || base == "..") base = "archive";
+
+    vector<Member> members;
+    Member root;
+    root.path = top;
+    root.name = base;
+    root.type = typeFromMode(st.st_mode);
+    root.st = st;
+#ifndef _WIN32
+    if (root.type == ENTRY_LINK && !readLink(top, root.link)) {
+        printError("pack");
+        fclose(f);
+        remove(out.c_str());
+        return;
+    }
+#endif
+    members.push_back(root);
+
+    if (S_ISDIR(st.st_mode)) {
+        struct Collect : WalkPolicy<WALK_STAT> {
+            vector<Member> &members;
+            const string &top, &base;
+            mutex &mtx;
+            Collect(vector<Member> &m, const string &t, const string &b, mutex &x)
+                : members(m), top(t), base(b), mtx(x) {}
+
+            bool entry(const WalkEntry &e) const {
+                if (!e.st) return false;
+                Member m;
+                m.path = e.path;
+                m.name = base + '/' + e.path.substr(top.size() + 1);
+#ifdef _WIN32
+                replace(m.name.begin(), m.name.end(), '\\', '/');
+#endif
+                m.type = e.type;
+                m.st = *e.st;
+#ifndef _WIN32
+                if (e.type == ENTRY_LINK && !readLink(e.path, m.link)) return false;
+#endif
+                lock_guard<mutex> lock(mtx);
+                members.push_back(move(m));
+                return e.isDir();
+            }
+            void error(const string &dir, int err) const {
+                lock_guard<mutex> lock(consoleMutex);
+                cerr << "pack: " << dir << ": " << strerror(err) << "\n";
+            }
+        };
+        mutex mtx;
+        walkTree(top, Collect(members, top, base, mtx));
+    }
+
+    // A stable order, each directory ahead of what is in it; the archive
+    // being written is left out, as is anything tar has no type for
+    sort(members.begin() + 1, members.end(),
+         [](const Member &a, const Member &b) { return a.name < b.name; });
+    long long skipped = 0;
+    members.erase(remove_if(members.begin(), members.end(), [&](const Member &m) {
+        bool own = haveSelf && m.st.st_dev == self.st_dev && m.st.st_ino == self.st_ino;
+        bool odd = m.type != ENTRY_FILE && m.type != ENTRY_DIR && m.type != ENTRY_LINK;
+        skipped += own || odd;
+        return own || odd;
+    }), members.end());
+
+    Packer packer(f, zstd, level);
+    bool ok = packer.run(members);
+    if (fclose(f) != 0 && ok) {
+        printError("pack");
+        ok = false;
+    }
+    if (!ok) {
+        remove(out.c_str());
+        return;
+    }
+
+    const Totals &t = packer.totals;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "%lld files, %lld dirs, %lld links, %s of data, %s written, %lld skipped, "
+             "%lld failed in %.3f s",
+             t.files, t.dirs, t.links, humanSize(t.data).c_str(), humanSize(t.written).c_str(),
+             skipped, t.failed, seconds);
+    cout << "Packed: " << src << " -> " << out << " (" << summary << ")" << endl;
+    DirCache::instance().forgetParent(out);
+    IndexMaintainer::instance().noteCreated(out);
+    logAction("Packed: " + src + " -> " + out + " (" + summary + ")");
+}
+
+/*-------------------------------------------------------------
+    unpack: extract an archive (tar or tar.zst) under 'dest'
+-------------------------------------------------------------*/
+void unpackArchive(const string &archive, const string &dest = ".") {
+    using namespace archive_detail;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    FILE *f = fopen(archive.c_str(), "rb");
+    if (!f) {
+        printError("unpack");
+        return;
+    }
+    if (!createDirectory(dest, 0755)) {
+        printError("unpack");
+        fclose(f);
+        return;
+    }
+
+    Totals t;
+    bool ok;
+    {
+        Unpacker unpacker(f, dest);
+        ok = unpacker.run();
+        t = unpacker.totals;
+    }
+    fclose(f);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "%lld files, %lld dirs, %lld links, %s of data, %lld skipped, %lld failed in %.3f s",
+             t.files, t.dirs, t.links, humanSize(t.data).c_str(), t.skipped, t.failed, seconds);
+    cout << (ok ? "Unpacked: " : "Unpacked (incomplete): ") << archive << " -> " << dest
+         << " (" << summary << ")" << endl;
+    DirCache::instance().clear();
+    logAction("Unpacked: " + archive + " -> " + dest + " (" + summary + ")");
+}
+
+/*-------------------------------------------------------------
+    Read side of the binary activity log
+    Maps one generation of the log and walks its blocks. Only a
+    torn tail needs a scan from the front; otherwise every seek
+    starts from the trailer at the end of the file.
+-------------------------------------------------------------*/
+class LogReader {
+public:
+    bool open(const string &path) {
+        using namespace log_format;
+        if (!map.open(path) || map.size() < sizeof(FileHeader) ||
+            memcmp(map.data(), MAGIC, sizeof(MAGIC)) != 0)
+            return false;
+
+        end = map.size();
+        uint64_t start;
+        if (end > first() && !blockBefore(end, start)) {
+            end = first();
+            while (const BlockHeader *h = header(end))
+                end += blockBytes(*h);
+        }
+        return true;
+    }
+
+    void close() {
+        map.close();
+        end = 0;
+    }
+
+    uint64_t first() const { return sizeof(log_format::FileHeader); }
+    uint64_t last() const { return end; }
+
+    // The block at 'at', or NULL past the end or on damage
+    const log_format::BlockHeader *header(uint64_t at) const {
+        using namespace log_format;
+        if (at < first() || at + sizeof(BlockHeader) + sizeof(Trailer) > map.size()) return NULL;
+        const BlockHeader *h = (const BlockHeader *)(map.data() + at);
+        if ((h->magic != DATA && h->magic != TIDX) || h->payload > map.size() - at ||
+            at + blockBytes(*h) > map.size())
+            return NULL;
+        const Trailer *t = (const Trailer *)(map.data() + at + blockBytes(*h) - sizeof(Trailer));
+        return t->magic == END && t->start == at ? h : NULL;
+    }
+
+    // Start of the block that ends at 'at'
+    bool blockBefore(uint64_t at, uint64_t &start) const {
+        using namespace log_format;
+        if (at < first() + sizeof(BlockHeader) + sizeof(Trailer) || at > map.size()) return false;
+        const Trailer *t = (const Trailer *)(map.data() + at - sizeof(Trailer));
+        if (t->magic != END || t->start < first() || t->start >= at) return false;
+        const BlockHeader *h = header(t->start);
+        if (!h || t->start + blockBytes(*h) != at) return false;
+        start = t->start;
+        return true;
+    }
+
+    const log_format::Record *records(const log_format::BlockHeader *h) const {
+        return (const log_format::Record *)(h + 1);
+    }
+
+    // The string table of a DATA block and its used length
+    const char *strings(const log_format::BlockHeader *h, size_t &len) const {
+        const log_format::Record *r = records(h);
+        len = h->count ? r[h->count - 1].offset + r[h->count - 1].length : 0;
+        return (const char *)(r + h->count);
+    }
+
+    // First DATA block that can hold records at or after 'since'
+    uint64_t seek(int64_t since) const {
+        using namespace log_format;
+        uint64_t at = end, found = end, start;
+        while (blockBefore(at, start)) {
+            const BlockHeader *h = header(start);
+            if (h->magic == TIDX) {
+                // Everything before here is covered by the time index
+                for (;;) {
+                    const IndexEntry *e = (const IndexEntry *)(h + 1);
+                    if (h->count == 0 || e[h->count - 1].last < since) return found;
+                    if (e[0].last < since) {
+                        const IndexEntry *hit = lower_bound(e, e + h->count, since,
+                            [](const IndexEntry &x, int64_t t) { return x.last < t; });
+                        return hit->offset;
+                    }
+                    found = e[0].offset;
+                    if (h->prevIndex == NONE || !(h = header(h->prevIndex)) || h->magic != TIDX)
+                        return found;
+                }
+            }
+            if (h->last < since) return found;
+            found = at = start;
+        }
+        return found;
+    }
+
+private:
+    MappedFile map;
+    uint64_t end = 0;
+};
+
+/*-------------------------------------------------------------
+    Activity history (history)
+      history [--since WHEN] [--grep TEXT] [--tail N]
+      history --import [FILE]     convert an old text log
+      history --compact [--before WHEN]
+      history --rotate
+    WHEN is YYYY-mm-dd[THH:MM[:SS]] in local time, or an age such
+    as 90s, 15m, 6h or 7d. Queries cover the rotated generations
+    too, oldest first. --grep first tests each block's whole
+    string table, so blocks without a match are skipped without
+    looking at their records.
+-------------------------------------------------------------*/
+namespace history_detail {
+
+struct Query {
+    int64_t since = INT64_MIN;
+    bool grep = false;
+    LiteralFinder finder;
+    size_t tail = 0;    // 0 prints every match
+};
+
+// Parse an absolute local time or an age before now
+bool parseWhen(const string &s, int64_t &out) {
+    char unit = 0;
+    long long n = 0;
+    int used = 0;
+    if (sscanf(s.c_str(), "%lld%c%n", &n, &unit, &used) == 2 && (size_t)used == s.size()) {
+        long long scale = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 :
+                          unit == 'd' ? 86400 : 0;
+        if (scale) {
+            out = (int64_t)time(NULL) - n * scale;
+            return true;
+        }
+    }
+
+    tm t;
+    memset(&t, 0, sizeof(t));
+    int fields = sscanf(s.c_str(), "%d-%d-%d%*c%d:%d:%d", &t.tm_year, &t.tm_mon, &t.tm_mday,
+                        &t.tm_hour, &t.tm_min, &t.tm_sec);
+    if (fields != 3 && fields < 5) return false;
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_isdst = -1;
+    time_t when = mktime(&t);
+    if (when == (time_t)-1) return false;
+    out = (int64_t)when;
+    return true;
+}
+
+// "[YYYY-mm-dd HH:MM:SS] " formatted once per second, not per record
+class Stamp {
+public:
+    const char *format(int64_t sec, size_t &len) {
+        if (sec != cachedSec) {
+            time_t now = (time_t)sec;
+            char timeStr[24];
+            tm *t = localtime(&now);
+            if (!t || !strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", t))
+                snprintf(timeStr, sizeof(timeStr), "%lld", (long long)sec);
+            cachedLen = (size_t)snprintf(cached, sizeof(cached), "[%s] ", timeStr);
+            cachedSec = sec;
+        }
+        len = cachedLen;
+        return cached;
+    }
+
+private:
+    int64_t cachedSec = INT64_MIN;
+    char cached[32];
+    size_t cachedLen = 0;
+};
+
+bool matches(const Query &q, const log_format::Record &r, const char *strings) {
+    return r.time >= q.since &&
+           (!q.grep || q.finder.find(strings + r.offset, r.length) >= 0);
+}
+
+// Can any record of this DATA block match? Checks the time range and
+// runs one search over the block's whole string table.
+bool blockMayMatch(const Query &q, const LogReader &log, const log_format::BlockHeader *h) {
+    if (h->magic != log_format::DATA || h->last < q.since) return false;
+    if (!q.grep) return true;
+    size_t len;
+    const char *s = log.strings(h, len);
+    return q.finder.find(s, len) >= 0;
+}
+
+size_t countMatches(const Query &q, const LogReader &log, const log_format::BlockHeader *h) {
+    if (!blockMayMatch(q, log, h)) return 0;
+    if (!q.grep && h->first >= q.since) return h->count;
+    size_t len, n = 0;
+    const char *s = log.strings(h, len);
+    const log_format::Record *r = log.records(h);
+    for (uint32_t i = 0; i < h->count; ++i)
+        if (matches(q, r[i], s)) ++n;
+    return n;
+}
+
+// Print the matches from block 'at' to the end, skipping the first 'skip'
+size_t printFrom(const Query &q, const LogReader &log, uint64_t at, size_t skip,
+                 OutputWriter &w, Stamp &stamp) {
+    size_t shown = 0;
+    for (; const log_format::BlockHeader *h = log.header(at); at += log_format::blockBytes(*h)) {
+        if (!blockMayMatch(q, log, h)) continue;
+        size_t len;
+        const char *s = log.strings(h, len);
+        const log_format::Record *r = log.records(h);
+        for (uint32_t i = 0; i < h->count; ++i) {
+            if (!matches(q, r[i], s)) continue;
+            if (skip) {
+                --skip;
+                continue;
+            }
+            const char *p = stamp.format(r[i].time, len);
+            w.put(p, len);
+            w.put(s + r[i].offset, r[i].length);
+            w.put('\n');
+            ++shown;
+        }
+    }
+    return shown;
+}
+
+// Copy the records at or after 'since' into 'out' in full-size blocks
+size_t copyRecords(const LogReader &log, LogAppender &out, int64_t since) {
+    vector<log_format::Item> chunk;
+    chunk.reserve(log_format::BLOCK_RECORDS);
+    size_t copied = 0;
+    for (uint64_t at = log.first(); const log_format::BlockHeader *h = log.header(at);
+         at += log_format::blockBytes(*h)) {
+        if (h->magic != log_format::DATA || h->last < since) continue;
+        size_t len;
+        const char *s = log.strings(h, len);
+        const log_format::Record *r = log.records(h);
+        for (uint32_t i = 0; i < h->count; ++i) {
+            if (r[i].time < since) continue;
+            log_format::Item item = { r[i].time, string_view(s + r[i].offset, r[i].length) };
+            chunk.push_back(item);
+            if (chunk.size() == log_format::BLOCK_RECORDS) {
+                out.append(chunk.data(), chunk.size());
+                copied += chunk.size();
+                chunk.clear();
+            }
+        }
+    }
+    out.append(chunk.data(), chunk.size());
+    return copied + chunk.size();
+}
+
+long long fileSize(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long)st.st_size : 0;
+}
+
+void query(const Query &q) {
+    const string &path = ActivityLogger::instance().path();
+
+    // Generations newest first
+    vector<unique_ptr<LogReader>> logs;
+    for (int g = 0; g <= log_format::ROTATE_KEEP; ++g) {
+        unique_ptr<LogReader> log(new LogReader);
+        if (log->open(log_format::generation(path, g))) logs.push_back(move(log));
+    }
+    if (logs.empty()) {
+        cout << "No activity history found yet.\n";
+        return;
+    }
+
+    // Find the generation and block to start printing from
+    size_t gen = logs.size() - 1, skip = 0;
+    uint64_t from = logs[gen]->first();
+    if (q.tail) {
+        // Walk back block by block until enough matches are behind us
+        size_t found = 0;
+        bool done = false;
+        for (size_t g = 0; g < logs.size() && !done; ++g) {
+            const LogReader &log = *logs[g];
+            uint64_t at = log.last(), start;
+            gen = g;
+            from = at;
+            while (!done && log.blockBefore(at, start)) {
+                const log_format::BlockHeader *h = log.header(start);
+                if (h->magic == log_format::DATA && h->last < q.since) {
+                    done = true;
+                    break;
+                }
+                found += countMatches(q, log, h);
+                from = at = start;
+                if (found >= q.tail) {
+                    skip = found - q.tail;
+                    done = true;
+                }
+            }
+        }
+    } else if (q.since != INT64_MIN) {
+        for (size_t g = 0; g < logs.size(); ++g) {
+            uint64_t at = logs[g]->seek(q.since);
+            if (at == logs[g]->last() && g > 0) break;
+            gen = g;
+            from = at;
+            if (at != logs[g]->first()) break;
+        }
+    }
+
+    OutputWriter w;
+    Stamp stamp;
+    size_t shown = 0;
+    w.put("----------- ACTIVITY LOG -----------\n");
+    for (size_t g = gen + 1; g-- > 0;) {
+        shown += printFrom(q, *logs[g], g == gen ? from : logs[g]->first(), skip, w, stamp);
+        skip = 0;
+    }
+    w.put("------------------------------------\n");
+    if (q.grep || q.since != INT64_MIN || q.tail) {
+        w.putNum((long long)shown);
+        w.put(" record(s)\n");
+    }
+    w.flush();
+}
+
+// Rewrite every generation, dropping the records before 'before'
+void compact(int64_t before) {
+    const string &path = ActivityLogger::instance().path();
+    long long oldBytes = 0, newBytes = 0;
+    size_t kept = 0;
+    ActivityLogger::instance().exclusive([&] {
+        for (int g = log_format::ROTATE_KEEP; g >= 0; --g) {
+            string file = log_format::generation(path, g);
+            LogReader log;
+            if (!log.open(file)) continue;
+            oldBytes += fileSize(file);
+
+            string tmp = file + ".tmp";
+            remove(tmp.c_str());
+            LogAppender out;
+            if (!out.open(tmp)) {
+                printError("history --compact");
+                return;
+            }
+            size_t n = copyRecords(log, out, before);
+            out.close();
+            log.close();
+            if (n == 0 && g > 0) {
+                remove(tmp.c_str());
+                remove(file.c_str());
+                continue;
+            }
+            if (!replaceFile(tmp, file)) {
+                printError("history --compact");
+                remove(tmp.c_str());
+                return;
+            }
+            kept += n;
+            newBytes += fileSize(file);
+        }
+    });
+    cout << "Compacted activity log: " << kept << " record(s), " << oldBytes << " -> "
+         << newBytes << " bytes\n";
+}
+
+// Convert a text log ("[YYYY-mm-dd HH:MM:SS] action" per line) into
+// the binary log, ahead of the records already in it
+void importText(const string &textFile) {
+    MappedFile text;
+    if (!text.open(textFile, true)) {
+        printError(textFile.c_str());
+        return;
+    }
+
+    const string &path = ActivityLogger::instance().path();
+    size_t imported = 0, existing = 0;
+    bool ok = true;
+    ActivityLogger::instance().exclusive([&] {
+        string tmp = path + ".tmp";
+        remove(tmp.c_str());
+        LogAppender out;
+        if (!out.open(tmp)) {
+            ok = false;
+            return;
+        }
+
+        vector<log_format::Item> chunk;
+        chunk.reserve(log_format::BLOCK_RECORDS);
+        int64_t lastTime = 0;
+        const char *p = text.data(), *stop = p + text.size();
+        while (p < stop) {
+            const char *nl = (const char *)memchr(p, '\n', (size_t)(stop - p));
+            const char *eol = nl ? nl : stop;
+            string_view line(p, (size_t)(eol - p));
+            p = eol + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.empty()) continue;
+
+            // Lines without a stamp keep the time of the line before
+            tm t;
+            memset(&t, 0, sizeof(t));
+            if (line.size() > 22 && line[0] == '[' && line[20] == ']' &&
+                sscanf(string(line.substr(1, 19)).c_str(), "%d-%d-%d %d:%d:%d", &t.tm_year,
+                       &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) == 6) {
+                t.tm_year -= 1900;
+                t.tm_mon -= 1;
+                t.tm_isdst = -1;
+                lastTime = (int64_t)mktime(&t);
+                line.remove_prefix(22);
+            }
+            log_format::Item item = { lastTime, line };
+            chunk.push_back(item);
+            if (chunk.size() == log_format::BLOCK_RECORDS) {
+                out.append(chunk.data(), chunk.size());
+                imported += chunk.size();
+                chunk.clear();
+            }
+        }
+        out.append(chunk.data(), chunk.size());
+        imported += chunk.size();
+
+        LogReader current;
+        if (current.open(path)) existing = copyRecords(current, out, INT64_MIN);
+        out.close();
+        current.close();
+        ok = replaceFile(tmp, path);
+        if (!ok) remove(tmp.c_str());
+    });
+
+    if (!ok) {
+        printError("history --import");
+        return;
+    }
+    cout << "Imported " << imported << " record(s) from " << textFile << " ("
+         << existing << " already in the log)\n";
+}
+
+} // namespace history_detail
+
+void historyCommand(const vector<string> &args) {
+    using namespace history_detail;
+    Query q;
+    string usage = "Usage: history [--since WHEN] [--grep TEXT] [--tail N]\n"
+                   "       history --import [FILE] | --compact [--before WHEN] | --rotate\n";
+
+    if (args.size() > 1 && args[1] == "--rotate") {
+        ActivityLogger::instance().exclusive([] {
+            log_format::rotateGenerations(ActivityLogger::instance().path());
+        });
+        cout << "Activity log rotated.\n";
+        return;
+    }
+    if (args.size() > 1 && args[1] == "--import") {
+        string file = args.size() > 2 ? args[2] : ActivityLogger::instance().path();
+        if (args.size() <= 2) file.replace(file.size() - 4, 4, ".txt");
+        importText(file);
+        return;
+    }
+    if (args.size() > 1 && args[1] == "--compact") {
+        int64_t before = INT64_MIN;
+        if (args.size() > 2 && (args[2] != "--before" || args.size() < 4 ||
+                                !parseWhen(args[3], before))) {
+            cout << usage;
+            return;
+        }
+        compact(before);
+        return;
+    }
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--since" && i + 1 < args.size() && parseWhen(args[i + 1], q.since))
+            ++i;
+        else if (args[i] == "--grep" && i + 1 < args.size()) {
+            q.grep = true;
+            q.finder = LiteralFinder(args[++i], false);
+        } else if (args[i] == "--tail" && i + 1 < args.size() && atol(args[i + 1].c_str()) > 0)
+            q.tail = (size_t)atol(args[++i].c_str());
+        else {
+            cout << usage;
+            return;
+        }
+    }
+
+    ActivityLogger::instance().flush();
+    query(q);
+}
+
+/*-------------------------------------------------------------
+    Built-in benchmark (bench)
+    Generates four synthetic trees under a scratch directory and
+    times the commands against each of them:
+      wide   - one directory with many small files
+      deep   - a long chain of directories, a few files per level
+      small  - many directories of 1-8 KiB files
+      huge   - a few large files
+    Every operation runs warm (after an untimed pass) and cold
+    (page cache dropped before each run: /proc/sys/vm/drop_caches
+    when permitted, otherwise POSIX_FADV_DONTNEED per file). The
+    in-process caches are cleared for every run. Command output
+    and logging are muted while timing. Results are printed as a
+    table and written as JSON for regression tracking.
+-------------------------------------------------------------*/
+struct BenchTree {
+    string name, root;
+    long long files = 0, dirs = 0, bytes = 0;
+    long long topEntries = 0;   // what a plain 'ls' of the root lists
+};
+
+struct BenchResult {
+    string tree, op, cache;
+    vector<double> seconds;
+    long long files, bytes;
+    bool moves;     // data-moving op: MB/s is meaningful
+};
+
+namespace bench_detail {
+
+bool writeFile(const string &path, size_t size) {
+    static const string chunk = [] {
+        string c(1 << 16, '\0');
+        for (size_t i = 0; i < c.size(); ++i) c[i] = (char)('a' + (i * 7 + i / 61) % 26);
+        return c;
+    }();
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = true;
+    for (size_t left = size; ok && left > 0;) {
+        size_t n = min(left, chunk.size());
+        ok = fwrite(chunk.data(), 1, n, f) == n;
+        left -= n;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+bool makeFiles(BenchTree &t, const string &dir, long long count, size_t minSize, size_t maxSize) {
+    for (long long i = 0; i < count; ++i) {
+        size_t size = minSize + (maxSize > minSize ? (size_t)(i * 2654435761LL) % (maxSize - minSize) : 0);
+        if (!writeFile(dir + PATH_SEP + "f" + to_string(i) + ".dat", size)) return false;
+        ++t.files;
+        t.bytes += (long long)size;
+    }
+    return true;
+}
+
+bool generate(BenchTree &t, double scale) {
+    long long n = max(1LL, (long long)(20000 * scale));
+    if (!createDirectory(t.root, 0755)) return false;
+    t.dirs = 1;
+
+    if (t.name == "wide") return makeFiles(t, t.root, n, 64, 512);
+
+    if (t.name == "deep") {
+        string dir = t.root;
+        long long levels = max(2LL, (long long)(300 * scale));
+        for (long long d = 0; d < levels; ++d) {
+            dir += PATH_SEP;
+            dir += "d" + to_string(d);
+            if (!createDirectory(dir, 0755) || !makeFiles(t, dir, 8, 64, 512)) return false;
+            ++t.dirs;
+        }
+        return true;
+    }
+
+    if (t.name == "small") {
+        long long dirs = max(1LL, n / 200);
+        for (long long d = 0; d < dirs; ++d) {
+            string dir = t.root + PATH_SEP + "d" + to_string(d);
+            if (!createDirectory(dir, 0755) || !makeFiles(t, dir, 200, 1024, 8192)) return false;
+            ++t.dirs;
+        }
+        return true;
+    }
+
+    // huge
+    size_t size = (size_t)max(1.0, 32 * scale) << 20;
+    return makeFiles(t, t.root, 4, size, size);
+}
+
+// Evict the tree from the page cache; returns how it was done
+const char *dropCaches(const string &root) {
+#ifdef __linux__
+    sync();
+    FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (f) {
+        bool ok = fputs("3\n", f) >= 0;
+        if (fclose(f) == 0 && ok) return "drop_caches";
+    }
+#endif
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    struct Evict : WalkPolicy<> {
+        bool entry(const WalkEntry &e) const {
+            if (e.type == ENTRY_FILE) {
+                int fd = open(e.path.c_str(), O_RDONLY);
+                if (fd >= 0) {
+                    fdatasync(fd);
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    close(fd);
+                }
+            }
+            return e.isDir();
+        }
+    };
+    walkTree(root, Evict());
+    return "fadvise";
+#else
+    (void)root;
+    return "none";
+#endif
+}
+
+double timed(const function<void()> &fn) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    fn();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    size_t rank = (size_t)ceil(p * v.size());
+    return v[rank ? rank - 1 : 0];
+}
+
+string jsonString(const string &s) {
+    return "\"" + perf::jsonEscape(s) + "\"";
+}
+
+} // namespace bench_detail
+
+/*-------------------------------------------------------------
+    bench [--runs N] [--scale S] [--json FILE] [--keep] [dir]
+-------------------------------------------------------------*/
+void benchCommand(const vector<string> &args) {
+    using namespace bench_detail;
+
+    int runs = 5;
+    double scale = 1.0;
+    string jsonPath = "bench_results.json", base = ".";
+    bool keep = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--runs" && i + 1 < args.size()) runs = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--scale" && i + 1 < args.size()) scale = atof(args[++i].c_str());
+        else if (args[i] == "--json" && i + 1 < args.size()) jsonPath = args[++i];
+        else if (args[i] == "--keep") keep = true;
+        else base = args[i];
+    }
+    if (scale <= 0) {
+        cout << "Usage: bench [--runs N] [--scale S] [--json FILE] [--keep] [dir]\n";
+        return;
+    }
+
+    string scratch = base + PATH_SEP + ".explorer_bench_" + to_string((long long)getpid());
+    if (!createDirectory(scratch, 0755)) {
+        printError("bench");
+        return;
+    }
+
+    vector<BenchTree> trees(4);
+    const char *names[] = { "wide", "deep", "small", "huge" };
+    cout << "Generating trees in " << scratch << " (scale " << scale << ")..." << endl;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        trees[i].name = names[i];
+        trees[i].root = scratch + PATH_SEP + names[i];
+        if (!generate(trees[i], scale)) {
+            printError("bench");
+            removeRecursive(scratch);
+            return;
+        }
+        DirStream ds;
+        if (ds.open(trees[i].root))
+            while (ds.nextBatch([&](const char *, EntryType) { ++trees[i].topEntries; })) {
+            }
+    }
+
+    ActivityLogger::instance().pause(true);
+    OutputRouter::instance().mute(true);
+
+    vector<BenchResult> results;
+    const char *coldMethod = "none";
+    for (const BenchTree &t : trees) {
+        string copy = scratch + PATH_SEP + t.name + "_copy";
+        vector<string> pattern(1, "*7.dat");
+
+        struct Op {
+            const char *name;
+            function<void()> run;
+            bool moves;
+        };
+        vector<Op> ops = {
+            { "ls",     [&] { listFiles(t.root); },                      false },
+            { "ls -R",  [&] { listRecursive(t.root); },                  false },
+            { "search", [&] { searchFile(pattern, false, t.root); },     false },
+            { "du",     [&] { diskUsage(t.root, 0, true); },             false },
+            { "cp -r",  [&] { copyRecursive(t.root, copy); },            true  },
+            { "rm",     [&] { removeRecursive(copy); },                  false },
+        };
+
+        for (int cold = 0; cold < 2; ++cold) {
+            vector<BenchResult> rows;
+            for (const Op &op : ops) {
+                long long files = op.name == string("ls") ? t.topEntries : t.files;
+                BenchResult r = { t.name, op.name, cold ? "cold" : "warm", {},
+                                  files, t.bytes, op.moves };
+                rows.push_back(r);
+            }
+
+            // cp and rm alternate so each cp starts without a target and each rm has one
+            for (int run = cold ? 0 : -1; run < runs; ++run) {
+                for (size_t k = 0; k < ops.size(); ++k) {
+                    DirCache::instance().clear();
+                    if (cold && ops[k].name != string("rm")) coldMethod = dropCaches(t.root);
+                    double s = timed(ops[k].run);
+                    if (run >= 0) rows[k].seconds.push_back(s);
+                }
+            }
+            results.insert(results.end(), rows.begin(), rows.end());
+        }
+    }
+
+    OutputRouter::instance().mute(false);
+    ActivityLogger::instance().pause(false);
+    cout.flush();
+
+    // Table
+    char line[200];
+    snprintf(line, sizeof(line), "%-6s %-7s %-5s %11s %11s %12s %9s\n",
+             "tree", "op", "cache", "median ms", "p99 ms", "files/s", "MB/s");
+    string table = line;
+    for (const BenchResult &r : results) {
+        double med = percentile(r.seconds, 0.5), p99 = percentile(r.seconds, 0.99);
+        snprintf(line, sizeof(line), "%-6s %-7s %-5s %11.3f %11.3f %12.0f %9s\n",
+                 r.tree.c_str(), r.op.c_str(), r.cache.c_str(), med * 1e3, p99 * 1e3,
+                 med > 0 ? r.files / med : 0,
+                 r.moves && med > 0 ? to_string((long long)(r.bytes / med / (1 << 20))).c_str() : "-");
+        table += line;
+    }
+    cout << table;
+
+    // JSON
+    string json = "{\n  \"version\": 1,\n  \"timestamp\": " + to_string((long long)time(NULL)) +
+                  ",\n  \"runs\": " + to_string(runs) + ",\n  \"scale\": " + to_string(scale) +
+                  ",\n  \"cold_method\": " + jsonString(coldMethod) + ",\n  \"trees\": [";
+    for (size_t i = 0; i < trees.size(); ++i) {
+        json += (i ? ",\n    " : "\n    ");
+        json += "{\"name\": " + jsonString(trees[i].name) + ", \"files\": " +
+                to_string(trees[i].files) + ", \"dirs\": " + to_string(trees[i].dirs) +
+                ", \"bytes\": " + to_string(trees[i].bytes) + "}";
+    }
+    json += "\n  ],\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        double med = percentile(r.seconds, 0.5), p99 = percentile(r.seconds, 0.99);
+        char nums[256];
+        snprintf(nums, sizeof(nums),
+                 "\"median_ms\": %.4f, \"p99_ms\": %.4f, \"files_per_s\": %.1f, \"mb_per_s\": ",
+                 med * 1e3, p99 * 1e3, med > 0 ? r.files / med : 0.0);
+        json += (i ? ",\n    " : "\n    ");
+        json += "{\"tree\": " + jsonString(r.tree) + ", \"op\": " + jsonString(r.op) +
+                ", \"cache\": " + jsonString(r.cache) + ", " + nums;
+        if (r.moves && med > 0) {
+            snprintf(nums, sizeof(nums), "%.1f", r.bytes / med / (1 << 20));
+            json += nums;
+        } else {
+            json += "null";
+        }
+        json += ", \"samples_ms\": [";
+        for (size_t k = 0; k < r.seconds.size(); ++k) {
+            snprintf(nums, sizeof(nums), "%s%.4f", k ? ", " : "", r.seconds[k] * 1e3);
+            json += nums;
         }
-        else if (cmd == "mkdir") {
-            if (args.size() > 1)
-                makeDir(args[1]);
-            else
-                cout << "Usage: mkdir <dir>\n";
+        json += "]}";
+    }
+    json += "\n  ]\n}\n";
+
+    FILE *f = jsonPath == "-" ? stdout : fopen(jsonPath.c_str(), "w");
+    if (f) {
+        cout.flush();
+        fputs(json.c_str(), f);
+        if (f != stdout) fclose(f);
+        else fflush(f);
+        if (f != stdout) cout << "Results written to " << jsonPath << "\n";
+    } else {
+        printError("bench");
+    }
+
+    if (!keep) {
+        ActivityLogger::instance().pause(true);
+        OutputRouter::instance().mute(true);
+        removeRecursive(scratch);
+        OutputRouter::instance().mute(false);
+        ActivityLogger::instance().pause(false);
+    }
+    logAction("Ran benchmark in " + scratch + " (" + to_string(runs) + " runs, scale " +
+              to_string(scale) + ")");
+}
+
+/*-------------------------------------------------------------
+    stats [reset]
+    Counters and phase times of the last foreground command and
+    of the session since start (or the last 'stats reset'). Phase
+    times are summed over every thread that worked on a command,
+    so they can exceed its wall time. The record is kept per
+    session; the counters are process wide, so work that other
+    sessions or jobs did at the same time is counted too.
+-------------------------------------------------------------*/
+struct CommandRecord {
+    string line;
+    perf::Snapshot delta;
+    double ms = 0;
+};
+
+struct SessionStats {
+    CommandRecord last;
+    perf::Snapshot baseline;
+    long long commands = 0;
+};
+
+void printCounters(const perf::Snapshot &s) {
+    using namespace perf;
+    const Counter groups[][8] = {
+        { DIR_OPENS, DIR_READS, STATS, OPENS, READS, WRITES, COPY_CALLS, UNLINKS },
+        { BYTES_READ, BYTES_WRITTEN, BYTES_OUT, ENTRIES, MATCHES, FILES, COUNTER_COUNT },
+    };
+    const char *labels[] = { "  syscalls:", "  volume:  " };
+    string out;
+    for (int g = 0; g < 2; ++g) {
+        out += labels[g];
+        for (int k = 0; k < 8 && groups[g][k] != COUNTER_COUNT; ++k) {
+            out += k ? ", " : " ";
+            out += counterNames[groups[g][k]];
+            out += ' ';
+            out += to_string((unsigned long long)s.counts[groups[g][k]]);
         }
-        else if (cmd == "search") {
-            if (args.size() > 1)
-                searchFile(args[1]);
+        out += '\n';
+    }
+    out += "  phases:  ";
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        char part[48];
+        snprintf(part, sizeof(part), "%s %s %.3f ms", p ? "," : "", phaseNames[p],
+                 s.phaseNs[p] / 1e6);
+        out += part;
+    }
+    out += '\n';
+    cout << out;
+}
+
+void statsCommand(const vector<string> &args, SessionStats &stats) {
+    if (args.size() > 1 && args[1] == "reset") {
+        stats = SessionStats();
+        stats.baseline = perf::Registry::instance().total();
+        cout << "Statistics reset.\n";
+        return;
+    }
+
+    if (!stats.last.line.empty()) {
+        char head[64];
+        snprintf(head, sizeof(head), " (%.3f ms)\n", stats.last.ms);
+        cout << "Last command: " << stats.last.line << head;
+        printCounters(stats.last.delta);
+    }
+    cout << "Session (" << stats.commands << " commands):\n";
+    printCounters(perf::Registry::instance().total() - stats.baseline);
+}
+
+/*-------------------------------------------------------------
+    Display list of available commands
+-------------------------------------------------------------*/
+void showHelp() {
+    cout << "\nAvailable Commands:\n";
+    cout << "  ls [path]        - List files and folders\n";
+    cout << "  ls -R [--ordered] [path] - List folders recursively (in walk order)\n";
+    cout << "  ls [--limit N] [--sort=name|size|mtime] [--page N] [path]\n";
+    cout << "                   (--mem SIZE: sort huge folders on disk within SIZE of memory)\n";
+    cout << "  cd <dir>         - Change directory\n";
+    cout << "  pwd              - Print current directory\n";
+    cout << "  cp <src> <dest>  - Copy file\n";
+    cout << "  cp -r <src> <dst>- Copy folder recursively\n";
+    cout << "  mv [--verify] <src> <dest> - Move or rename (copies across filesystems)\n";
+    cout << "  rm <path>        - Delete file/folder\n";
+    cout << "  touch <file>     - Create empty file\n";
+    cout << "  mkdir <dir>      - Create new folder\n";
+    cout << "  search <name>    - Search file by name\n";
+    cout << "  search [-i] <pat>... - Globs (*.log) / several names\n";
+    cout << "  grep [-i] <text> [path] - Search inside files\n";
+    cout << "  find [path] [-name|-iname GLOB] [-type f|d|l] [-size [+-]N[kMG]]\n";
+    cout << "       [-mtime|-mmin [+-]N] [-mindepth N] [-maxdepth N] [-prune GLOB]\n";
+    cout << "                   - Find entries passing every test (uses a current index)\n";
+    cout << "                   (search/grep/find: -0 ends paths with NUL, --ordered keeps walk order)\n";
+    cout << "                   (search/find: --sort [--mem SIZE] sorts the paths, spilling to disk)\n";
+    cout << "  du [-d N] [--fresh] [path] - Disk usage of a folder\n";
+    cout << "  dupes [--min SIZE] [--link|--reflink] [path] - Find duplicate files\n";
+    cout << "  sync [--delete] [--dry-run] <src> <dest> - Mirror src into dest, copying only changes\n";
+    cout << "  pack [--level N] <path> <out.tar[.zst]> - Archive a folder (zst: compressed)\n";
+    cout << "  unpack <archive> [dest] - Extract a .tar or .tar.zst archive\n";
+    cout << "  index build|update [path] - Build/refresh search index\n";
+    cout << "  index watch|unwatch [path] - Keep the index current\n";
+    cout << "  complete <prefix> - Complete a path (or end a line with Tab)\n";
+    cout << "  cache [clear|--budget N|--prefetch on|off] - Directory cache usage/limit\n";
+    cout << "  history [--since WHEN] [--grep TEXT] [--tail N]\n";
+    cout << "                   - Show activity log (WHEN: YYYY-mm-dd[THH:MM] or 15m/6h/7d)\n";
+    cout << "  history --import [FILE] | --compact [--before WHEN] | --rotate\n";
+    cout << "                   - Convert a text log, rewrite or rotate the log\n";
+    cout << "  cp/mv/rm/grep/pack ... --bwlimit RATE --iops-limit N --progress\n";
+    cout << "                   - Throttle a transfer (RATE like 20M) and show progress\n";
+    cout << "  stats [reset]    - Syscall counters and phase times\n";
+    cout << "  bench [--runs N] [--scale S] [--json FILE] [dir] - Benchmark commands\n";
+    cout << "  <command> &      - Run in the background; 'wait' joins\n";
+    cout << "  help             - Show help menu\n";
+    cout << "  exit             - Exit explorer\n\n";
+}
+
+
+/*-------------------------------------------------------------
+    Run one parsed command
+-------------------------------------------------------------*/
+void dispatchCommand(const vector<string> &args) {
+    const string &cmd = args[0];
+
+    if (cmd == "help")
+        showHelp();
+    else if (cmd == "ls") {
+        if (args.size() > 1 && args[1] == "-R") {
+            vector<string> rest(args.begin() + 2, args.end());
+            ResultFormat fmt;
+            takeResultFormat(rest, fmt);
+            listRecursive(rest.empty() ? "." : rest[0], fmt.ordered);
+        } else {
+            ListOptions opts;
+            string target = ".";
+            bool ok = true;
+            double v;
+            for (size_t i = 1; i < args.size(); ++i) {
+                const string &a = args[i];
+                if (a == "--limit" && i + 1 < args.size())
+                    opts.limit = (size_t)atol(args[++i].c_str());
+                else if (a == "--page" && i + 1 < args.size())
+                    opts.page = (size_t)atol(args[++i].c_str());
+                else if (a == "--sort=name") opts.sort = SORT_NAME;
+                else if (a == "--sort=size") opts.sort = SORT_SIZE;
+                else if (a == "--sort=mtime") opts.sort = SORT_MTIME;
+                else if (a == "--mem" && i + 1 < args.size() && parseScaled(args[i + 1], v)) {
+                    opts.memory = max((size_t)1, (size_t)v);
+                    ++i;
+                }
+                else if (a.compare(0, 2, "--") == 0) ok = false;
+                else target = a;
+            }
+            if (ok)
+                listFiles(target, opts);
             else
-                cout << "Usage: search <pattern>\n";
+                cout << "Usage: ls [--limit N] [--sort=name|size|mtime [--mem SIZE]] [--page N] [path]\n";
+        }
+    }
+    else if (cmd == "cd") {
+        if (args.size() > 1) changeDir(args[1]);
+        else cout << "Usage: cd <dir>\n";
+    }
+    else if (cmd == "pwd")
+        printPwd();
+    else if (cmd == "cp" && args.size() > 1 && args[1] == "-r") {
+        if (args.size() > 3)
+            copyRecursive(args[2], args[3]);
+        else
+            cout << "Usage: cp -r <src> <dest>\n";
+    }
+    else if (cmd == "cp") {
+        if (args.size() > 2) {
+            CopyStats stats;
+            if (copyFile(args[1], args[2], &stats)) {
+                char rate[96];
+                snprintf(rate, sizeof(rate), "%lld bytes in %.3f s, %.1f MB/s via %s",
+                         stats.bytes, stats.seconds, stats.mbPerSec(),
+                         copyMethodName(stats.method));
+                cout << "Copied: " << args[1] << " -> " << args[2]
+                     << " (" << rate << ")" << endl;
+            } else
+                printError("cp");
+        } else cout << "Usage: cp <src> <dest>\n";
+    }
+    else if (cmd == "mv") {
+        bool verify = args.size() > 1 && args[1] == "--verify";
+        size_t first = verify ? 2 : 1;
+        if (args.size() > first + 1)
+            moveFile(args[first], args[first + 1], verify);
+        else
+            cout << "Usage: mv [--verify] <src> <dest>\n";
+    }
+    else if (cmd == "rm") {
+        if (args.size() > 1)
+            removeRecursive(args[1]);
+        else
+            cout << "Usage: rm <path>\n";
+    }
+    else if (cmd == "touch") {
+        if (args.size() > 1)
+            touchFile(args[1]);
+        else
+            cout << "Usage: touch <file>\n";
+    }
+    else if (cmd == "mkdir") {
+        if (args.size() > 1)
+            makeDir(args[1]);
+        else
+            cout << "Usage: mkdir <dir>\n";
+    }
+    else if (cmd == "search") {
+        vector<string> rest = args;
+        ResultFormat fmt;
+        takeResultFormat(rest, fmt);
+        bool icase = false;
+        vector<string> patterns;
+        for (size_t i = 1; i < rest.size(); ++i) {
+            if (rest[i] == "-i") icase = true;
+            else patterns.push_back(rest[i]);
+        }
+        if (!patterns.empty())
+            searchFile(patterns, icase, ".", fmt);
+        else
+            cout << "Usage: search [-i] [-0] [--ordered | --sort [--mem SIZE]] <pattern> [pattern...]\n";
+    }
+    else if (cmd == "find") {
+        vector<string> rest = args;
+        ResultFormat fmt;
+        takeResultFormat(rest, fmt);
+        find_detail::Query q;
+        string root = ".";
+        if (find_detail::parse(rest, q, root)) {
+            string label;
+            for (size_t i = 1; i < args.size(); ++i) label += (label.empty() ? "" : " ") + args[i];
+            findFiles(q, root, label, fmt);
+        } else {
+            cout << "Usage: find [path] [-name|-iname GLOB] [-type f|d|l] [-size [+-]N[kMG]]\n"
+                    "            [-mtime|-mmin [+-]N] [-mindepth N] [-maxdepth N] [-prune GLOB]\n"
+                    "            [-0] [--ordered | --sort [--mem SIZE]]\n";
+        }
+    }
+    else if (cmd == "grep") {
+        vector<string> rest = args;
+        ResultFormat fmt;
+        takeResultFormat(rest, fmt);
+        bool icase = rest.size() > 1 && rest[1] == "-i";
+        size_t first = icase ? 2 : 1;
+        if (rest.size() > first)
+            grepContent(rest[first], icase, rest.size() > first + 1 ? rest[first + 1] : ".", fmt);
+        else
+            cout << "Usage: grep [-i] [-0] [--ordered] <pattern> [path]\n";
+    }
+    else if (cmd == "du") {
+        int depth = 1;
+        bool fresh = false;
+        string target = ".";
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-d" && i + 1 < args.size()) depth = atoi(args[++i].c_str());
+            else if (args[i] == "--fresh") fresh = true;
+            else target = args[i];
+        }
+        diskUsage(target, depth, fresh);
+    }
+    else if (cmd == "dupes") {
+        long long minSize = 1;
+        int replace = 0;
+        string target = ".";
+        bool ok = true;
+        for (size_t i = 1; i < args.size(); ++i) {
+            double v;
+            if (args[i] == "--min" && i + 1 < args.size() && parseScaled(args[i + 1], v)) {
+                minSize = max(1LL, (long long)v);
+                ++i;
+            } else if (args[i] == "--link") replace = 1;
+            else if (args[i] == "--reflink") replace = 2;
+            else if (args[i].compare(0, 2, "--") == 0) ok = false;
+            else target = args[i];
+        }
+        if (ok)
+            findDuplicates(target, minSize, replace);
+        else
+            cout << "Usage: dupes [--min SIZE] [--link | --reflink] [path]\n";
+    }
+    else if (cmd == "sync") {
+        sync_detail::Options opts;
+        vector<string> paths;
+        bool ok = true;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--delete") opts.remove = true;
+            else if (args[i] == "--dry-run" || args[i] == "-n") opts.dryRun = true;
+            else if (args[i].compare(0, 2, "--") == 0) ok = false;
+            else paths.push_back(args[i]);
         }
-        else if (cmd == "history")
-            showHistory();
+        if (ok && paths.size() == 2)
+            syncTrees(paths[0], paths[1], opts);
         else
-            cout << "Unknown command. Type 'help' for list.\n";
+            cout << "Usage: sync [--delete] [--dry-run] <src> <dest>\n";
+    }
+    else if (cmd == "pack") {
+        int level = ARCHIVE_LEVEL;
+        vector<string> paths;
+        bool ok = true;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--level" && i + 1 < args.size()) {
+                level = atoi(args[++i].c_str());
+                if (level < 1 || level > 19) ok = false;
+            }
+            else if (args[i].compare(0, 2, "--") == 0) ok = false;
+            else paths.push_back(args[i]);
+        }
+        if (ok && paths.size() == 2)
+            packTree(paths[0], paths[1], level);
+        else
+            cout << "Usage: pack [--level 1-19] <path> <out.tar|out.tar.zst>\n";
+    }
+    else if (cmd == "unpack") {
+        if (args.size() == 2 || args.size() == 3)
+            unpackArchive(args[1], args.size() == 3 ? args[2] : ".");
+        else
+            cout << "Usage: unpack <archive> [dest]\n";
+    }
+    else if (cmd == "index")
+        indexCommand(args);
+    else if (cmd == "cache")
+        cacheCommand(args);
+    else if (cmd == "complete")
+        completePath(args.size() > 1 ? args[1] : "");
+    else if (cmd == "history")
+        historyCommand(args);
+    else if (cmd == "bench")
+        benchCommand(args);
+    else
+        cout << "Unknown command. Type 'help' for list.\n";
+}
+
+// Copy, move, sync, remove, grep, dupes, pack and unpack run under their
+// throttle/progress options
+void runCommand(const vector<string> &args) {
+    const string &cmd = args[0];
+    if (cmd != "cp" && cmd != "mv" && cmd != "sync" && cmd != "rm" && cmd != "grep" &&
+        cmd != "dupes" && cmd != "pack" && cmd != "unpack") {
+        dispatchCommand(args);
+        return;
+    }
+
+    vector<string> rest = args;
+    TransferOptions opts;
+    if (!takeTransferOptions(rest, opts)) {
+        cout << "Usage: " << cmd << " [--bwlimit RATE[K|M|G]] [--iops-limit N] "
+             << "[--progress|--no-progress] ...\n";
+        return;
+    }
+    TransferScope scope(cmd, opts);
+    dispatchCommand(rest);
+}
+
+/*-------------------------------------------------------------
+    Background commands ('cmd &')
+    Each job runs on its own thread with its console output
+    captured, including what pool workers print on its behalf.
+    'wait', 'cd' and the end of the session join the jobs in
+    launch order and print each job's output as one block;
+    errors are passed on as they happen. At most
+    max(2, cores) jobs run at once; launching one more first
+    waits for the oldest.
+-------------------------------------------------------------*/
+class JobQueue {
+public:
+    JobQueue() : limit(max(2u, thread::hardware_concurrency())) {}
+    ~JobQueue() { waitAll(); }
+
+    void launch(const vector<string> &args, void (*run)(const vector<string> &)) {
+        if (jobs.size() >= limit) waitOldest();
+        shared_ptr<Job> job = make_shared<Job>(OutputRouter::capturing());
+        job->worker = thread([job, args, run] {
+            OutputRouter::capture(&job->output);
+            run(args);
+            cout.flush();
+            OutputRouter::capture(NULL);
+        });
+        jobs.push_back(job);
+    }
+
+    void waitAll() {
+        while (!jobs.empty()) waitOldest();
+    }
+
+private:
+    struct Job {
+        explicit Job(OutputSink *parent) : output(parent) {}
+        thread worker;
+        StringSink output;
+    };
+
+    size_t limit;
+    deque<shared_ptr<Job>> jobs;
+
+    void waitOldest() {
+        shared_ptr<Job> job = jobs.front();
+        jobs.pop_front();
+        job->worker.join();
+        cout << job->output.take();
+    }
+};
+
+/*-------------------------------------------------------------
+    Run one command line
+    Handles the session-level words (exit, wait, a trailing '&')
+    and passes everything else to runCommand(). Returns false
+    when the session should end.
+-------------------------------------------------------------*/
+struct SessionTiming {
+    long long commands = 0;
+    chrono::steady_clock::duration dispatch{0}, total{0};
+    SessionStats stats;
+};
+
+bool runLine(string_view line, JobQueue &jobs, SessionTiming &timing) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<string> args = split(line);
+    if (args.empty()) return true;
+
+    bool background = false;
+    if (args.back() == "&") {
+        background = true;
+        args.pop_back();
+    } else if (args.back().size() > 1 && args.back().back() == '&') {
+        background = true;
+        args.back().pop_back();
+    }
+    if (args.empty()) return true;
+
+    const string &cmd = args[0];
+    if (cmd == "exit" || cmd == "quit") return false;
+
+    ++timing.commands;
+    chrono::steady_clock::time_point ready = chrono::steady_clock::now();
+    timing.dispatch += ready - start;
+
+    if (cmd == "wait") {
+        jobs.waitAll();
+    } else if (cmd == "stats") {
+        statsCommand(args, timing.stats);
+    } else if (cmd == "cd" || !background) {
+        if (cmd == "cd") jobs.waitAll();     // jobs use relative paths; don't move under them
+        perf::Snapshot before = perf::Registry::instance().total();
+        long long begin = perf::nowNs();
+        runCommand(args);
+        long long dur = perf::nowNs() - begin;
+
+        CommandRecord &last = timing.stats.last;
+        last.line = cmd;
+        for (size_t i = 1; i < args.size(); ++i) last.line += ' ' + args[i];
+        last.delta = perf::Registry::instance().total() - before;
+        last.ms = dur / 1e6;
+        if (perf::tracing) perf::traceEvent("command", last.line, begin, dur);
+    } else {
+        jobs.launch(args, runCommand);
+    }
+    ++timing.stats.commands;
+    timing.total += chrono::steady_clock::now() - start;
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Non-interactive session (-c "cmd; cmd" or -f script)
+    Commands are separated by newlines or ';'; lines starting
+    with '#' are comments. No prompt is drawn and output is
+    written out when the script ends.
+-------------------------------------------------------------*/
+void runScript(const string &text, SessionTiming &timing) {
+    JobQueue jobs;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t end = text.find_first_of(";\n", pos);
+        if (end == string::npos) end = text.size();
+        string_view cmd(text.data() + pos, end - pos);
+
+        size_t first = 0;
+        while (first < cmd.size() && isspace((unsigned char)cmd[first])) ++first;
+        bool comment = first < cmd.size() && cmd[first] == '#';
+        if (comment) end = text.find('\n', pos);     // a comment runs to the end of its line
+        if (end == string::npos) end = text.size();
+
+        if (!comment && !runLine(cmd, jobs, timing)) break;
+        pos = end + 1;
+    }
+    jobs.waitAll();
+}
+
+bool readScript(const string &path, string &text) {
+    if (path == "-") {
+        text.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+        return true;
+    }
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    text.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return true;
+}
+
+/*-------------------------------------------------------------
+    Command server
+      explorer --serve [ADDR]         - keep running, take scripts
+      explorer --connect [ADDR] -c .. - run them on that server
+      explorer --stop [ADDR]          - ask the server to exit
+    ADDR is a Unix socket path (a named pipe on Windows); it
+    defaults to $FE_SOCKET, else a per-user name. A server keeps
+    its directory cache, index watchers and pools warm between
+    scripts. Every connection is one session on its own thread:
+    the client sends its working directory and script, the
+    session runs the script under the CwdGate with its output
+    captured, and streams it back. Sessions share the pools, the
+    caches and the throttle limits.
+    Frames both ways are a type byte, a 32-bit length and data:
+      client: 'D' directory, then 'S' script  (or 'Q' to stop)
+      server: 'O' output, 'E' errors, ..., 'Z' done
+-------------------------------------------------------------*/
+namespace server_detail {
+
+#if !defined(_WIN32) && !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0          // SIGPIPE is ignored while serving instead
+#endif
+
+const uint32_t MAX_FRAME = 64u << 20;
+const size_t SINK_FLUSH = 64 * 1024;
+
+string defaultAddress() {
+    if (const char *env = getenv("FE_SOCKET")) return env;
+#ifdef _WIN32
+    const char *user = getenv("USERNAME");
+    return string("\\\\.\\pipe\\fe-explorer-") + (user ? user : "default");
+#else
+    if (const char *run = getenv("XDG_RUNTIME_DIR")) return string(run) + "/fe-explorer.sock";
+    return "/tmp/fe-explorer-" + to_string((long)getuid()) + ".sock";
+#endif
+}
+
+// One end of a connection
+class Channel {
+public:
+#ifdef _WIN32
+    explicit Channel(HANDLE h = INVALID_HANDLE_VALUE) : pipe(h) {}
+    bool valid() const { return pipe != INVALID_HANDLE_VALUE; }
+#else
+    explicit Channel(int f = -1) : fd(f) {}
+    bool valid() const { return fd >= 0; }
+#endif
+    ~Channel() { close(); }
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    bool connect(const string &address) {
+#ifdef _WIN32
+        pipe = CreateFileA(address.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           OPEN_EXISTING, 0, NULL);
+        return valid();
+#else
+        sockaddr_un sa;
+        if (!socketAddress(address, sa)) return false;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && ::connect(fd, (sockaddr *)&sa, sizeof(sa)) == 0) return true;
+        close();
+        return false;
+#endif
+    }
+
+    bool writeAll(const char *p, size_t n) {
+        while (n > 0) {
+#ifdef _WIN32
+            DWORD done = 0;
+            if (!WriteFile(pipe, p, (DWORD)min<size_t>(n, 1 << 20), &done, NULL)) return false;
+            size_t k = done;
+#else
+            ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+#endif
+            p += k;
+            n -= (size_t)k;
+        }
+        return true;
+    }
+
+    bool readAll(char *p, size_t n) {
+        while (n > 0) {
+#ifdef _WIN32
+            DWORD done = 0;
+            if (!ReadFile(pipe, p, (DWORD)min<size_t>(n, 1 << 20), &done, NULL) || done == 0)
+                return false;
+            size_t k = done;
+#else
+            ssize_t k = ::recv(fd, p, n, 0);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+#endif
+            p += k;
+            n -= (size_t)k;
+        }
+        return true;
+    }
+
+    bool send(char type, const char *data, size_t n) {
+        char head[5];
+        uint32_t len = (uint32_t)n;
+        head[0] = type;
+        memcpy(head + 1, &len, 4);
+        return writeAll(head, 5) && writeAll(data, n);
+    }
+
+    bool receive(char &type, string &data) {
+        char head[5];
+        uint32_t len;
+        if (!readAll(head, 5)) return false;
+        type = head[0];
+        memcpy(&len, head + 1, 4);
+        if (len > MAX_FRAME) return false;
+        data.resize(len);
+        return readAll(&data[0], len);
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (valid()) CloseHandle(pipe);
+        pipe = INVALID_HANDLE_VALUE;
+#else
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+#ifndef _WIN32
+    static bool socketAddress(const string &address, sockaddr_un &sa) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(sa.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        memcpy(sa.sun_path, address.data(), address.size());
+        return true;
+    }
+#endif
+
+private:
+#ifdef _WIN32
+    HANDLE pipe;
+#else
+    int fd;
+#endif
+};
+
+// A session's console: output is framed and sent in 64 KiB pieces
+class ChannelSink : public OutputSink {
+public:
+    explicit ChannelSink(Channel &c) : ch(c) {}
+
+    void write(int stream, const char *s, size_t n) override {
+        char type = stream ? 'E' : 'O';
+        lock_guard<mutex> lock(mtx);
+        if (type != last) flushLocked();
+        last = type;
+        buf.append(s, n);
+        if (buf.size() >= SINK_FLUSH) flushLocked();
+    }
+
+    void flush() {
+        lock_guard<mutex> lock(mtx);
+        flushLocked();
+    }
+
+private:
+    Channel &ch;
+    mutex mtx;
+    string buf;
+    char last = 'O';
+    bool gone = false;      // the client went away; drop the rest
+
+    void flushLocked() {
+        if (!buf.empty() && !gone && !ch.send(last, buf.data(), buf.size())) gone = true;
+        buf.clear();
+    }
+};
+
+class Server {
+public:
+    // Serve until a client sends 'Q'; false if the address is unusable
+    bool run(const string &addr) {
+        address = addr;
+        if (!listen()) return false;
+#ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN);       // a client that hangs up only ends its session
+#endif
+        cout << "Serving on " << address << endl;
+        logAction("Server started on " + address);
+
+        while (!stopping) {
+            unique_ptr<Channel> ch = accept();
+            if (stopping) break;
+            if (!ch) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                printError("server");
+                break;
+            }
+            {
+                lock_guard<mutex> lock(mtx);
+                ++sessions;
+            }
+            Channel *raw = ch.release();
+            thread([this, raw] {
+                unique_ptr<Channel> owned(raw);
+                serve(*owned);
+                owned.reset();
+                lock_guard<mutex> lock(mtx);
+                if (--sessions == 0) idle.notify_all();
+            }).detach();
+        }
+
+        {
+            unique_lock<mutex> lock(mtx);
+            idle.wait(lock, [this] { return sessions == 0; });
+        }
+        close();
+        cout << "Server stopped" << endl;
+        logAction("Server stopped on " + address);
+        return true;
+    }
+
+private:
+    string address;
+    atomic<bool> stopping{false};
+    mutex mtx;
+    condition_variable idle;
+    int sessions = 0;
+#ifdef _WIN32
+    HANDLE next = INVALID_HANDLE_VALUE;
+#else
+    int listener = -1;
+#endif
+
+    void serve(Channel &ch) {
+        char type;
+        string dir, script;
+        if (!ch.receive(type, dir)) return;
+        if (type == 'Q') {
+            stop();
+            ch.send('Z', "", 0);
+            return;
+        }
+        if (type != 'D' || !ch.receive(type, script) || type != 'S') return;
+
+        ChannelSink sink(ch);
+        OutputRouter::capture(&sink);
+        if (CwdGate::instance().enter(absolutePath(dir))) {
+            SessionTiming timing;
+            timing.stats.baseline = perf::Registry::instance().total();
+            runScript(script, timing);
+            cout.flush();
+            CwdGate::instance().leave();
+        } else {
+            printError(dir.c_str());
+        }
+        OutputRouter::capture(NULL);
+        sink.flush();
+        ch.send('Z', "", 0);
+    }
+
+#ifdef _WIN32
+    HANDLE createPipe(bool first) {
+        DWORD mode = PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0);
+        return CreateNamedPipeA(address.c_str(), mode,
+                                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                                    PIPE_REJECT_REMOTE_CLIENTS,
+                                PIPE_UNLIMITED_INSTANCES, SINK_FLUSH, SINK_FLUSH, 0, NULL);
+    }
+
+    bool listen() {
+        next = createPipe(true);
+        if (next == INVALID_HANDLE_VALUE) {
+            cerr << "server: " << address << ": cannot create pipe (already serving?)\n";
+            return false;
+        }
+        return true;
+    }
+
+    unique_ptr<Channel> accept() {
+        HANDLE h = next;
+        bool ok = ConnectNamedPipe(h, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+        next = createPipe(false);
+        if (!ok) {
+            CloseHandle(h);
+            errno = EIO;
+            return nullptr;
+        }
+        return unique_ptr<Channel>(new Channel(h));
+    }
+
+    void stop() {
+        stopping = true;
+        // Unblock ConnectNamedPipe() with a connection of our own
+        HANDLE h = CreateFileA(address.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                               OPEN_EXISTING, 0, NULL);
+        if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+    }
+
+    void close() {
+        if (next != INVALID_HANDLE_VALUE) CloseHandle(next);
+        next = INVALID_HANDLE_VALUE;
+    }
+#else
+    bool listen() {
+        sockaddr_un sa;
+        if (!Channel::socketAddress(address, sa)) {
+            printError(address.c_str());
+            return false;
+        }
+        // A socket file nobody answers on is left over from a server that died
+        Channel probe;
+        if (probe.connect(address)) {
+            cerr << "server: " << address << ": already serving\n";
+            return false;
+        }
+        unlink(address.c_str());
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        mode_t mask = umask(077);       // only this user may run commands through it
+        bool ok = listener >= 0 && bind(listener, (sockaddr *)&sa, sizeof(sa)) == 0 &&
+                  ::listen(listener, 64) == 0;
+        umask(mask);
+        if (!ok) {
+            printError(address.c_str());
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    unique_ptr<Channel> accept() {
+        int fd = ::accept(listener, NULL, NULL);
+        if (fd < 0) return nullptr;
+        return unique_ptr<Channel>(new Channel(fd));
+    }
+
+    void stop() {
+        stopping = true;
+        shutdown(listener, SHUT_RDWR);      // wakes accept()
+    }
+
+    void close() {
+        if (listener < 0) return;
+        ::close(listener);
+        listener = -1;
+        unlink(address.c_str());
+    }
+#endif
+};
+
+} // namespace server_detail
+
+bool serveCommands(const string &address) {
+    server_detail::Server server;
+    return server.run(address);
+}
+
+// Run 'script' on the server at 'address'. Returns false without
+// running anything when no server answers there.
+bool forwardCommands(const string &address, const string &script, bool &completed) {
+    server_detail::Channel ch;
+    completed = false;
+    if (!ch.connect(address)) return false;
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = 0;
+    if (!ch.send('D', cwd, strlen(cwd)) || !ch.send('S', script.data(), script.size()))
+        return true;
+
+    char type;
+    string data;
+    while (ch.receive(type, data)) {
+        if (type == 'Z') {
+            completed = true;
+            break;
+        }
+        if (type == 'E') {
+            fflush(stdout);
+            fwrite(data.data(), 1, data.size(), stderr);
+        } else {
+            fwrite(data.data(), 1, data.size(), stdout);
+        }
     }
+    fflush(stdout);
+    return true;
+}
 
-    cout << "\nGoodbye! Have a nice day :)\n";
-    return 0;
+bool stopServer(const string &address) {
+    server_detail::Channel ch;
+    char type;
+    string data;
+    return ch.connect(address) && ch.send('Q', "", 0) && ch.receive(type, data);
 }
 
+/*-------------------------------------------------------------
+    MAIN PROGRAM
+    explorer                  - interactive prompt
+    explorer -c "cmd; cmd"    - run commands and exit
+    explorer -f script|-      - run a script file (or stdin)
+    explorer --serve [ADDR]   - run as a command server
+    explorer --connect [ADDR] - run -c/-f (or stdin) on it
+    --timing reports startup and per-command dispatch cost
+    --trace FILE writes a Chrome trace of commands and phases
+-------------------------------------------------------------*/
+int main(int argc, char **argv) {
+    chrono::steady_clock::time_point launched = chrono::steady_clock::now();
+
+    string script, tracePath, address;
+    bool batch = false, timed = false;
+    int status = 0;
+    enum { LOCAL, SERVE, CONNECT, STOP } mode = LOCAL;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--serve" || a == "--connect" || a == "--stop") {
+            mode = a == "--serve" ? SERVE : a == "--connect" ? CONNECT : STOP;
+            if (i + 1 < argc && argv[i + 1][0] != '-') address = argv[++i];
+        } else if (a == "-c" && i + 1 < argc) {
+            script += argv[++i];
+            script += '\n';
+            batch = true;
+        } else if (a == "-f" && i + 1 < argc) {
+            string text;
+            if (!readScript(argv[++i], text)) {
+                printError(argv[i]);
+                return 1;
+            }
+            script += text;
+            script += '\n';
+            batch = true;
+        } else if (a == "--timing") {
+            timed = true;
+        } else if (a == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+            perf::tracing = true;
+        } else {
+            cerr << "Usage: " << argv[0]
+                 << " [-c \"cmd; cmd\"] [-f script|-] [--timing] [--trace out.json]\n"
+                 << "       " << argv[0] << " --serve|--stop [ADDR]\n"
+                 << "       " << argv[0] << " --connect [ADDR] -c \"cmd; cmd\" | -f script|-\n";
+            return 2;
+        }
+    }
+    if (address.empty()) address = server_detail::defaultAddress();
+
+    if (mode == STOP) {
+        if (stopServer(address)) return 0;
+        cerr << "No server at " << address << "\n";
+        return 1;
+    }
+    if (mode == CONNECT) {
+        if (!batch && !readScript("-", script)) return 1;
+        bool completed;
+        if (forwardCommands(address, script, completed)) return completed ? 0 : 1;
+        cerr << "No server at " << address << "; running locally\n";
+        batch = true;
+    }
+
+    installLogFlushHandlers();
+    ActivityLogger::instance();
+    OutputRouter::instance().install(batch);
+    OutputRouter::errors().install(false);
+    SessionTiming timing;
+    chrono::steady_clock::duration startup = chrono::steady_clock::now() - launched;
+
+    if (mode == SERVE) {
+        if (batch) runScript(script, timing);       // e.g. -c "index watch" to warm up
+        if (!serveCommands(address)) status = 1;
+    } else if (batch) {
+        runScript(script, timing);
+    } else {
+        cout << "---------------------------------------------\n";
+        cout << "   SIMPLE CONSOLE FILE EXPLORER (C++ / GCC6)\n";
+        cout << "---------------------------------------------\n";
+        cout << "Type 'help' to see available commands.\n\n";
+
+        JobQueue jobs;
+        string line;
+        while (true) {
+            char cwd[1024];
+            getcwd(cwd, sizeof(cwd));
+            cout << cwd << " $ ";
+
+            if (!getline(cin, line)) break;
+            if (!line.empty() && line.back() == '\t') {
+                // Tab then Enter: complete the last word instead of running the line
+                line.pop_back();
+                vector<string> words = split(line);
+                completePath(words.empty() || isspace((unsigned char)line.back()) ? "" : words.back());
+                continue;
+            }
+            if (!runLine(line, jobs, timing)) break;
+        }
+        jobs.waitAll();
+    }
+
+    IndexMaintainer::instance().shutdown();
+    ActivityLogger::instance().shutdown();
+    if (!batch && mode == LOCAL) cout << "\nGoodbye! Have a nice day :)\n";
+    OutputRouter::instance().finish();
+    OutputRouter::errors().finish();
+
+    if (timed) {
+        typedef chrono::duration<double, micro> us;
+        double perCommand = timing.commands
+                                ? us(timing.dispatch).count() / timing.commands : 0;
+        fprintf(stderr, "startup %.0f us; %lld commands in %.3f ms; dispatch %.2f us/command\n",
+                us(startup).count(), timing.commands,
+                us(timing.total).count() / 1000.0, perCommand);
+    }
+    if (!tracePath.empty()) {
+        if (perf::writeTrace(tracePath)) cerr << "Trace written to " << tracePath << "\n";
+        else printError(tracePath.c_str());
+    }
+    return status;
+}